@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/* Castagnoli polynomial, bit-reversed */
+#define POLY 0x82f63b78
+
+/* table[k][b]: CRC of byte b followed by k zero bytes, for slicing by 8 */
+static uint32_t table[8][256];
+static int tableReady;
+
+static void table_init(void)
+{
+	for (int b = 0; b < 256; b++) {
+		uint32_t crc = b;
+		for (int i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		table[0][b] = crc;
+	}
+	for (int b = 0; b < 256; b++) {
+		for (int k = 1; k < 8; k++)
+			table[k][b] = (table[k - 1][b] >> 8) ^
+				      table[0][table[k - 1][b] & 0xff];
+	}
+	tableReady = 1;
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (!tableReady)
+		table_init();
+
+	crc = ~crc;
+	// Eight bytes per step, little-endian
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+		      table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+		      table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+		      table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#ifdef HAVE_X86
+/*
+ * The crc32 instruction has a latency of 3 cycles but can start every cycle,
+ * so the hardware version runs three independent CRCs over three lanes of
+ * LANE bytes and merges them. The CRC register is linear: after A then B it
+ * is the register after A shifted over |B| zero bytes, xored with the
+ * register after B alone (starting from 0). Shifts over LANE and 2*LANE
+ * bytes are table lookups.
+ */
+#define LANE 128
+
+/* shiftTable[s][k][b]: register after (s+1)*LANE zero bytes from b << 8k */
+static uint32_t shiftTable[2][4][256];
+static int shiftReady;
+
+/* register after n zero bytes, without the final inversion */
+static uint32_t zeros(uint32_t reg, size_t n)
+{
+	while (n--)
+		reg = (reg >> 8) ^ table[0][reg & 0xff];
+	return reg;
+}
+
+static void shift_init(void)
+{
+	if (!tableReady)
+		table_init();
+	for (int s = 0; s < 2; s++) {
+		// Built from the 32 single-bit registers, by linearity
+		uint32_t bit[32];
+		for (int i = 0; i < 32; i++)
+			bit[i] = zeros(1U << i, (s + 1) * LANE);
+		for (int k = 0; k < 4; k++) {
+			for (int b = 0; b < 256; b++) {
+				uint32_t v = 0;
+				for (int i = 0; i < 8; i++)
+					v ^= b & (1 << i) ? bit[8 * k + i] : 0;
+				shiftTable[s][k][b] = v;
+			}
+		}
+	}
+	shiftReady = 1;
+}
+
+/* register reg shifted over (s+1)*LANE zero bytes */
+static uint32_t shift(int s, uint32_t reg)
+{
+	return shiftTable[s][0][reg & 0xff] ^ shiftTable[s][1][(reg >> 8) & 0xff] ^
+	       shiftTable[s][2][(reg >> 16) & 0xff] ^ shiftTable[s][3][reg >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t c = ~crc;
+
+	if (len >= 3 * LANE && !shiftReady)
+		shift_init();
+	while (len >= 3 * LANE) {
+		uint64_t c1 = 0, c2 = 0;
+		for (int i = 0; i < LANE; i += 8) {
+			uint64_t v0, v1, v2;
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + LANE + i, 8);
+			memcpy(&v2, p + 2 * LANE + i, 8);
+			c = _mm_crc32_u64(c, v0);
+			c1 = _mm_crc32_u64(c1, v1);
+			c2 = _mm_crc32_u64(c2, v2);
+		}
+		c = shift(1, c) ^ shift(0, c1) ^ c2;
+		p += 3 * LANE;
+		len -= 3 * LANE;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef HAVE_X86
+	static int hw = -1;
+	if (hw == -1) {
+		__builtin_cpu_init();
+		hw = __builtin_cpu_supports("sse4.2");
+	}
+	if (hw)
+		return crc32c_hw(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+}
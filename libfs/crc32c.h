@@ -0,0 +1,36 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli polynomial), as used by iSCSI and ext4. The SSE4.2
+ * crc32 instruction is used when the CPU has it, a table-driven version
+ * otherwise.
+ */
+
+/**
+ * crc32c - Compute a CRC-32C
+ * @crc: CRC of the preceding data, 0 to start a new computation
+ * @buf: Data
+ * @len: Size of @buf in bytes
+ *
+ * Return: the CRC-32C of the data before @buf (whose CRC is @crc) followed by
+ * the @len bytes of @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_sw - Compute a CRC-32C without hardware support
+ * @crc: CRC of the preceding data, 0 to start a new computation
+ * @buf: Data
+ * @len: Size of @buf in bytes
+ *
+ * Same as crc32c(), always using the table-driven version.
+ *
+ * Return: the CRC-32C of the data.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
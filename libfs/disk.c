@@ -1,8 +1,13 @@
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -10,135 +15,1108 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Size of the sectors addressed by backends */
+#define SECTOR BLOCK_SIZE_MIN
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Backend, NULL if no disk is open */
+	const struct block_dev_ops *ops;
+	/* Backend state */
+	void *dev;
+	/* Sector count */
+	size_t nsectors;
+	/* Sectors per block */
+	size_t spb;
 	/* Block count */
 	size_t bcount;
+	/* BLOCK_* flags it was opened with */
+	int flags;
+	/* Block following the last one accessed */
+	size_t head;
+	/* Counters, updated atomically */
+	struct block_stats stats;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk;
 
-int block_disk_open(const char *diskname)
+/* Flags of the disk being opened, for the file backend */
+static int openFlags;
+
+static const struct block_dev_ops *backend_find(const char **name);
+
+/* open disk name with its backend */
+static int backend_open(const char *name, const struct block_dev_ops **ops,
+			void **dev, size_t *nsectors)
+{
+	*ops = backend_find(&name);
+	return (*ops)->open(dev, name, nsectors);
+}
+
+/*
+ * File backend: the virtual disk file itself
+ */
+
+struct file_dev {
+	int fd;
+	size_t nsectors;
+	/* Read-only mapping of the whole file, NULL until mapped */
+	void *map;
+};
+
+static int file_open(void **dev, const char *arg, size_t *nsectors)
 {
 	int fd;
 	struct stat st;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	if ((fd = open(arg, openFlags & BLOCK_RDONLY ? O_RDONLY : O_RDWR,
+		       0644)) < 0) {
+		perror("open");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	/* The disk image's size should be a multiple of the sector size */
+	if (st.st_size % SECTOR != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, SECTOR);
+		close(fd);
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	struct file_dev *f = calloc(1, sizeof(*f));
+	f->fd = fd;
+	f->nsectors = st.st_size / SECTOR;
+	*dev = f;
+	*nsectors = f->nsectors;
+	return 0;
+}
+
+static int file_close(void *dev)
+{
+	struct file_dev *f = dev;
+	if (f->map)
+		munmap(f->map, f->nsectors * SECTOR);
+	close(f->fd);
+	free(f);
+	return 0;
+}
+
+static int file_read(void *dev, size_t sector, size_t count, void *buf)
+{
+	struct file_dev *f = dev;
+
+	/* One positioned read for the whole range */
+	if (pread(f->fd, buf, count * SECTOR, sector * SECTOR) < 0) {
+		perror("pread");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	return 0;
+}
+
+static int file_write(void *dev, size_t sector, size_t count, const void *buf)
+{
+	struct file_dev *f = dev;
+
+	/* One positioned write for the whole range */
+	if (pwrite(f->fd, buf, count * SECTOR, sector * SECTOR) < 0) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static const void *file_map(void *dev)
+{
+	struct file_dev *f = dev;
+
+	if (!f->map) {
+		void *map = mmap(NULL, f->nsectors * SECTOR, PROT_READ,
+				 MAP_SHARED, f->fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			return NULL;
+		}
+		f->map = map;
+	}
+
+	return f->map;
+}
+
+static int file_grow(void *dev, size_t nsectors)
+{
+	struct file_dev *f = dev;
+
+	if (ftruncate(f->fd, nsectors * SECTOR) != 0) {
+		perror("ftruncate");
+		return -1;
+	}
+
+	/* Mapped again on the next file_map(), at the new size */
+	if (f->map)
+		munmap(f->map, f->nsectors * SECTOR);
+	f->map = NULL;
+	f->nsectors = nsectors;
+	return 0;
+}
+
+static const struct block_dev_ops fileOps = {
+	.prefix = NULL,
+	.open = file_open,
+	.close = file_close,
+	.read = file_read,
+	.write = file_write,
+	.map = file_map,
+	.clock = NULL,
+	.grow = file_grow,
+};
+
+/*
+ * RAM disk backend: a copy of a virtual disk file, kept in memory
+ */
+
+struct ram_dev {
+	char *mem;
+	size_t nsectors;
+};
+
+static int ram_open(void **dev, const char *arg, size_t *nsectors)
+{
+	const struct block_dev_ops *ops;
+	void *src;
+
+	// Whatever backend arg names is only read once
+	if (backend_open(arg, &ops, &src, nsectors) != 0)
+		return -1;
+	char *mem = NULL;
+	if (posix_memalign((void**)&mem, 4096, *nsectors * SECTOR) != 0 ||
+	    ops->read(src, 0, *nsectors, mem) != 0) {
+		block_error("cannot load '%s'", arg);
+		free(mem);
+		ops->close(src);
+		return -1;
+	}
+	ops->close(src);
+
+	struct ram_dev *r = malloc(sizeof(*r));
+	r->mem = mem;
+	r->nsectors = *nsectors;
+	*dev = r;
+	return 0;
+}
+
+static int ram_close(void *dev)
+{
+	struct ram_dev *r = dev;
+	free(r->mem);
+	free(r);
+	return 0;
+}
+
+static int ram_read(void *dev, size_t sector, size_t count, void *buf)
+{
+	struct ram_dev *r = dev;
+	memcpy(buf, r->mem + sector * SECTOR, count * SECTOR);
+	return 0;
+}
+
+static int ram_write(void *dev, size_t sector, size_t count, const void *buf)
+{
+	struct ram_dev *r = dev;
+	memcpy(r->mem + sector * SECTOR, buf, count * SECTOR);
+	return 0;
+}
+
+static const void *ram_map(void *dev)
+{
+	struct ram_dev *r = dev;
+	return r->mem;
+}
+
+static int ram_grow(void *dev, size_t nsectors)
+{
+	struct ram_dev *r = dev;
+	char *mem = NULL;
+	if (posix_memalign((void**)&mem, 4096, nsectors * SECTOR) != 0)
+		return -1;
+	memcpy(mem, r->mem, r->nsectors * SECTOR);
+	memset(mem + r->nsectors * SECTOR, 0, (nsectors - r->nsectors) * SECTOR);
+	free(r->mem);
+	r->mem = mem;
+	r->nsectors = nsectors;
+	return 0;
+}
+
+static const struct block_dev_ops ramOps = {
+	.prefix = "ram:",
+	.open = ram_open,
+	.close = ram_close,
+	.read = ram_read,
+	.write = ram_write,
+	.map = ram_map,
+	.clock = NULL,
+	.grow = ram_grow,
+};
+
+/*
+ * Latency backend: another backend, delayed per a latency model
+ */
+
+/* Sectors per block of the latency model */
+#define LAT_UNIT (BLOCK_SIZE / SECTOR)
+
+/* Typical hard disk drive: 4 ms of rotation, up to 10 ms of seek, 150 MB/s */
+static const struct block_latency hddModel = { 20000, 4000000, 1000, 10000000, 27000 };
+
+/* Typical NVMe solid-state drive: 80 us per operation, 2 GB/s */
+static const struct block_latency ssdModel = { 80000, 0, 0, 0, 2000 };
+
+struct lat_dev {
+	const struct block_dev_ops *ops;
+	void *dev;
+	struct block_latency model;
+
+	// Operations are queued on the simulated device one at a time
+	pthread_mutex_t lock;
+	size_t head; // sector following the last one accessed
+	uint64_t clock; // simulated time, in nanoseconds
+};
+
+/* open disk name arg, delayed per model */
+static int lat_setup(void **dev, const char *arg, size_t *nsectors,
+		     const struct block_latency *model)
+{
+	struct lat_dev *l = calloc(1, sizeof(*l));
+	if (backend_open(arg, &l->ops, &l->dev, nsectors) != 0) {
+		free(l);
+		return -1;
+	}
+	l->model = *model;
+	pthread_mutex_init(&l->lock, NULL);
+	*dev = l;
+	return 0;
+}
+
+static int hdd_open(void **dev, const char *arg, size_t *nsectors)
+{
+	return lat_setup(dev, arg, nsectors, &hddModel);
+}
+
+static int ssd_open(void **dev, const char *arg, size_t *nsectors)
+{
+	return lat_setup(dev, arg, nsectors, &ssdModel);
+}
+
+/* arg is "<io>,<pos>,<seek>,<seekmax>,<xfer>:<disk>" */
+static int lat_open(void **dev, const char *arg, size_t *nsectors)
+{
+	struct block_latency model;
+	int n = 0;
+
+	if (sscanf(arg, "%u,%u,%u,%u,%u:%n", &model.io_ns, &model.pos_ns,
+		   &model.seek_ns, &model.seek_max_ns, &model.xfer_ns, &n) != 5 ||
+	    n == 0) {
+		block_error("invalid latency model '%s'", arg);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	return lat_setup(dev, arg + n, nsectors, &model);
+}
+
+static int lat_close(void *dev)
+{
+	struct lat_dev *l = dev;
+	int ret = l->ops->close(l->dev);
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+	return ret;
+}
+
+/* cost of an operation on count sectors from sector, moving the head */
+static uint64_t lat_cost(struct lat_dev *l, size_t sector, size_t count)
+{
+	const struct block_latency *m = &l->model;
+	uint64_t cost = m->io_ns + (uint64_t)m->xfer_ns * count / LAT_UNIT;
+	if (sector != l->head) {
+		size_t dist = sector > l->head ? sector - l->head : l->head - sector;
+		uint64_t seek = (uint64_t)m->seek_ns * dist / LAT_UNIT;
+		cost += m->pos_ns + (seek < m->seek_max_ns ? seek : m->seek_max_ns);
+	}
+	l->head = sector + count;
+	return cost;
+}
+
+/* wait until the simulated device has served an operation of count sectors */
+static void lat_wait(struct lat_dev *l, size_t sector, size_t count)
+{
+	pthread_mutex_lock(&l->lock);
+	uint64_t cost = lat_cost(l, sector, count);
+	l->clock += cost;
+	pthread_mutex_unlock(&l->lock);
+
+	struct timespec ts = { cost / 1000000000, cost % 1000000000 };
+	while (nanosleep(&ts, &ts) != 0)
+		; // interrupted, sleep the rest
+}
+
+static int lat_read(void *dev, size_t sector, size_t count, void *buf)
+{
+	struct lat_dev *l = dev;
+	lat_wait(l, sector, count);
+	return l->ops->read(l->dev, sector, count, buf);
+}
+
+static int lat_write(void *dev, size_t sector, size_t count, const void *buf)
+{
+	struct lat_dev *l = dev;
+	lat_wait(l, sector, count);
+	return l->ops->write(l->dev, sector, count, buf);
+}
+
+static int lat_grow(void *dev, size_t nsectors)
+{
+	struct lat_dev *l = dev;
+	return l->ops->grow ? l->ops->grow(l->dev, nsectors) : -1;
+}
+
+static uint64_t lat_clock(void *dev)
+{
+	struct lat_dev *l = dev;
+	pthread_mutex_lock(&l->lock);
+	uint64_t clock = l->clock;
+	pthread_mutex_unlock(&l->lock);
+	return clock;
+}
+
+/* Not mappable, accesses to the mapping would not be delayed */
+static const struct block_dev_ops hddOps = {
+	"hdd:", hdd_open, lat_close, lat_read, lat_write, NULL, lat_clock,
+	lat_grow
+};
+static const struct block_dev_ops ssdOps = {
+	"ssd:", ssd_open, lat_close, lat_read, lat_write, NULL, lat_clock,
+	lat_grow
+};
+static const struct block_dev_ops latOps = {
+	"lat:", lat_open, lat_close, lat_read, lat_write, NULL, lat_clock,
+	lat_grow
+};
+
+/*
+ * Stripe backend: several disks, the logical sectors dealt to them in turn
+ * one stripe unit at a time. Operations spanning several members are split
+ * and run on all of them at once, by one worker thread per member. The unit
+ * is given in blocks of BLOCK_SIZE bytes.
+ */
+
+/* Most member disks of a striped disk */
+#define STRIPE_MAX 16
+
+/* Operation of a caller, possibly split over several members */
+struct stripe_op {
+	int write;
+	size_t sector;
+	size_t count;
+	char *buf;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending; // members still working on it
+	int ret;
+};
+
+struct stripe_member {
+	const struct block_dev_ops *ops;
+	void *dev;
+	size_t nsectors;
+
+	// Operations queued for the worker, protected by the stripe's lock
+	struct stripe_op *queue[STRIPE_MAX];
+	int queued;
+	pthread_cond_t work;
+	pthread_t thread;
+};
+
+struct stripe_dev {
+	size_t unit; // stripe unit in sectors
+	int n;
+	struct stripe_member members[STRIPE_MAX];
+	pthread_mutex_t lock;
+	int stop;
+};
+
+/* args of the worker of member m */
+struct stripe_worker {
+	struct stripe_dev *s;
+	int m;
+};
+
+/* sectors of the first total logical sectors that member m holds */
+static size_t stripe_share(struct stripe_dev *s, int m, size_t total)
+{
+	size_t round = s->n * s->unit;
+	size_t rem = total % round;
+	size_t extra = rem > m * s->unit ? rem - m * s->unit : 0;
+	return total / round * s->unit + (extra < s->unit ? extra : s->unit);
+}
+
+/* transfer the sectors of op held by member m */
+static int stripe_member_io(struct stripe_dev *s, int m, struct stripe_op *op)
+{
+	struct stripe_member *mb = &s->members[m];
+	size_t b = op->sector;
+	while (b < op->sector + op->count) {
+		size_t stripe = b / s->unit;
+		size_t n = s->unit - b % s->unit;
+		if (n > op->sector + op->count - b)
+			n = op->sector + op->count - b;
+		if (stripe % s->n == m) {
+			size_t msector = stripe / s->n * s->unit + b % s->unit;
+			char *buf = op->buf + (b - op->sector) * SECTOR;
+			int ret = op->write ? mb->ops->write(mb->dev, msector, n, buf)
+					    : mb->ops->read(mb->dev, msector, n, buf);
+			if (ret != 0)
+				return -1;
+		}
+		b += n;
+	}
+	return 0;
+}
+
+/* record that member m is done with op */
+static void stripe_op_done(struct stripe_op *op, int ret)
+{
+	pthread_mutex_lock(&op->lock);
+	if (ret != 0)
+		op->ret = -1;
+	if (--op->pending == 0)
+		pthread_cond_signal(&op->done);
+	pthread_mutex_unlock(&op->lock);
+}
+
+static void *stripe_worker(void *arg)
+{
+	struct stripe_worker *w = arg;
+	struct stripe_dev *s = w->s;
+	struct stripe_member *mb = &s->members[w->m];
+	int m = w->m;
+	free(w);
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!mb->queued && !s->stop)
+			pthread_cond_wait(&mb->work, &s->lock);
+		if (!mb->queued)
+			break; // stopping
+		struct stripe_op *op = mb->queue[0];
+		memmove(mb->queue, mb->queue + 1, --mb->queued * sizeof(op));
+		pthread_mutex_unlock(&s->lock);
+
+		stripe_op_done(op, stripe_member_io(s, m, op));
+		pthread_mutex_lock(&s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static int stripe_close(void *dev)
+{
+	struct stripe_dev *s = dev;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	for (int m = 0; m < s->n; m++)
+		pthread_cond_signal(&s->members[m].work);
+	pthread_mutex_unlock(&s->lock);
+
+	int ret = 0;
+	for (int m = 0; m < s->n; m++) {
+		struct stripe_member *mb = &s->members[m];
+		if (mb->thread)
+			pthread_join(mb->thread, NULL);
+		pthread_cond_destroy(&mb->work);
+		if (mb->ops && mb->ops->close(mb->dev) != 0)
+			ret = -1;
+	}
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+	return ret;
+}
+
+/* arg is "<unit>:<disk>+<disk>...", members are given in order */
+static int stripe_open(void **dev, const char *arg, size_t *nsectors)
+{
+	char *end;
+	size_t unit = strtoul(arg, &end, 0);
+	if (unit == 0 || *end != ':') {
+		block_error("invalid stripe unit '%s'", arg);
+		return -1;
+	}
+
+	struct stripe_dev *s = calloc(1, sizeof(*s));
+	s->unit = unit * (BLOCK_SIZE / SECTOR);
+	pthread_mutex_init(&s->lock, NULL);
+	*nsectors = 0;
+
+	char *names = strdup(end + 1), *save;
+	for (char *name = strtok_r(names, "+", &save); name;
+	     name = strtok_r(NULL, "+", &save)) {
+		if (s->n == STRIPE_MAX) {
+			block_error("more than %d stripe members", STRIPE_MAX);
+			goto fail;
+		}
+		struct stripe_member *mb = &s->members[s->n];
+		pthread_cond_init(&mb->work, NULL);
+		s->n++;
+		if (backend_open(name, &mb->ops, &mb->dev, &mb->nsectors) != 0) {
+			mb->ops = NULL;
+			goto fail;
+		}
+		*nsectors += mb->nsectors;
+	}
+
+	// Members hold their share of the logical sectors, and no more
+	for (int m = 0; m < s->n; m++) {
+		if (s->members[m].nsectors != stripe_share(s, m, *nsectors)) {
+			block_error("member %d has %zu sectors instead of %zu", m,
+				    s->members[m].nsectors,
+				    stripe_share(s, m, *nsectors));
+			goto fail;
+		}
+	}
+
+	for (int m = 0; m < s->n; m++) {
+		struct stripe_worker *w = malloc(sizeof(*w));
+		*w = (struct stripe_worker){ s, m };
+		if (pthread_create(&s->members[m].thread, NULL, stripe_worker, w)) {
+			free(w);
+			goto fail;
+		}
+	}
+
+	free(names);
+	*dev = s;
+	return 0;
+
+fail:
+	free(names);
+	stripe_close(s);
+	return -1;
+}
+
+/* run op on every member holding some of its sectors */
+static int stripe_io(struct stripe_dev *s, struct stripe_op *op)
+{
+	int first = op->sector / s->unit % s->n;
+	size_t stripes = (op->sector % s->unit + op->count + s->unit - 1) / s->unit;
+	if (stripes == 1)
+		return stripe_member_io(s, first, op); // a single member, inline
+
+	// The caller takes the first member, the workers the others
+	int others = stripes < s->n ? stripes - 1 : s->n - 1;
+	pthread_mutex_init(&op->lock, NULL);
+	pthread_cond_init(&op->done, NULL);
+	op->pending = others;
+	op->ret = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for (int i = 1; i <= others; i++) {
+		struct stripe_member *mb = &s->members[(first + i) % s->n];
+		if (mb->queued == STRIPE_MAX) {
+			// Full, only with STRIPE_MAX callers on this member
+			pthread_mutex_unlock(&s->lock);
+			stripe_op_done(op, stripe_member_io(s, (first + i) % s->n, op));
+			pthread_mutex_lock(&s->lock);
+			continue;
+		}
+		mb->queue[mb->queued++] = op;
+		pthread_cond_signal(&mb->work);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	int ret = stripe_member_io(s, first, op);
+	pthread_mutex_lock(&op->lock);
+	while (op->pending)
+		pthread_cond_wait(&op->done, &op->lock);
+	pthread_mutex_unlock(&op->lock);
+
+	pthread_cond_destroy(&op->done);
+	pthread_mutex_destroy(&op->lock);
+	return ret || op->ret ? -1 : 0;
+}
+
+static int stripe_read(void *dev, size_t sector, size_t count, void *buf)
+{
+	struct stripe_op op = { .write = 0, .sector = sector, .count = count,
+				.buf = buf };
+	return stripe_io(dev, &op);
+}
+
+static int stripe_write(void *dev, size_t sector, size_t count, const void *buf)
+{
+	struct stripe_op op = { .write = 1, .sector = sector, .count = count,
+				.buf = (char*)buf };
+	return stripe_io(dev, &op);
+}
+
+/* members work in parallel: the busiest one's time */
+static uint64_t stripe_clock(void *dev)
+{
+	struct stripe_dev *s = dev;
+	uint64_t clock = 0;
+	for (int m = 0; m < s->n; m++) {
+		struct stripe_member *mb = &s->members[m];
+		uint64_t c = mb->ops->clock ? mb->ops->clock(mb->dev) : 0;
+		if (c > clock)
+			clock = c;
+	}
+	return clock;
+}
+
+/* Not mappable, consecutive sectors are on different members; cannot grow */
+static const struct block_dev_ops stripeOps = {
+	"stripe:", stripe_open, stripe_close, stripe_read, stripe_write, NULL,
+	stripe_clock, NULL
+};
+
+/*
+ * Queue backend: another backend, in front of which the operations of
+ * concurrent callers wait in a queue sorted by sector. The caller finding the
+ * device idle dispatches for everyone until its own operation is done, in
+ * sweeps of increasing sectors (C-SCAN): after the highest one, it goes back
+ * to the lowest. Operations in the same direction on consecutive sectors go
+ * out as one, through a bounce buffer. An operation queued for longer than
+ * its deadline goes out next, wherever the sweep is.
+ */
+
+/* Longest operation made by merging, in sectors */
+#define QUEUE_MERGE_MAX (1024 * 1024 / SECTOR)
+
+/* Deadlines of reads and writes, in nanoseconds after being queued */
+#define QUEUE_READ_NS 100000000ULL
+#define QUEUE_WRITE_NS 1000000000ULL
+
+/* Operation of a caller, waiting in the queue */
+struct queue_req {
+	int write;
+	size_t sector;
+	size_t count;
+	char *buf;
+	uint64_t deadline;
+	int done;
+	int ret;
+	struct queue_req *next; // by sector, then by arrival
+};
+
+struct queue_dev {
+	const struct block_dev_ops *ops;
+	void *dev;
+
+	pthread_mutex_t lock; // protects everything below
+	pthread_cond_t done; // signaled when operations complete
+	struct queue_req *pending;
+	int busy; // a caller is dispatching
+	size_t head; // sector following the last one dispatched
+};
+
+static uint64_t queue_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int queue_open(void **dev, const char *arg, size_t *nsectors)
+{
+	struct queue_dev *q = calloc(1, sizeof(*q));
+	if (backend_open(arg, &q->ops, &q->dev, nsectors) != 0) {
+		free(q);
+		return -1;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->done, NULL);
+	*dev = q;
+	return 0;
+}
+
+static int queue_close(void *dev)
+{
+	struct queue_dev *q = dev;
+	int ret = q->ops->close(q->dev);
+	pthread_cond_destroy(&q->done);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+	return ret;
+}
+
+/* link to the next operation: the most late if any, else the sweep's next */
+static struct queue_req **queue_next(struct queue_dev *q, uint64_t now)
+{
+	struct queue_req **late = NULL, **next = NULL;
+	for (struct queue_req **p = &q->pending; *p; p = &(*p)->next) {
+		if ((*p)->deadline <= now &&
+		    (!late || (*p)->deadline < (*late)->deadline))
+			late = p;
+		if (!next && (*p)->sector >= q->head)
+			next = p;
+	}
+	if (late)
+		return late;
+	return next ? next : &q->pending; // wrap around
+}
+
+static int queue_xfer(struct queue_dev *q, int write, size_t sector,
+		      size_t count, char *buf)
+{
+	return write ? q->ops->write(q->dev, sector, count, buf)
+		     : q->ops->read(q->dev, sector, count, buf);
+}
+
+/* run the operations of list first, on consecutive sectors */
+static int queue_merged(struct queue_dev *q, struct queue_req *first,
+			size_t count)
+{
+	char *bounce = malloc(count * SECTOR);
+	if (!bounce) { // one at a time then
+		int ret = 0;
+		for (struct queue_req *r = first; r; r = r->next)
+			if (queue_xfer(q, r->write, r->sector, r->count, r->buf))
+				ret = -1;
+		return ret;
+	}
+
+	char *p = bounce;
+	for (struct queue_req *r = first; r && first->write; r = r->next) {
+		memcpy(p, r->buf, r->count * SECTOR);
+		p += r->count * SECTOR;
+	}
+	int ret = queue_xfer(q, first->write, first->sector, count, bounce);
+	p = bounce;
+	for (struct queue_req *r = first; r && !first->write; r = r->next) {
+		memcpy(r->buf, p, r->count * SECTOR);
+		p += r->count * SECTOR;
+	}
+	free(bounce);
+	return ret;
+}
+
+/* dispatch the next operations, q->lock is held and released meanwhile */
+static void queue_dispatch(struct queue_dev *q)
+{
+	struct queue_req **link = queue_next(q, queue_now());
+	struct queue_req *first = *link, *last = first;
+	size_t count = first->count;
+
+	// Take the following ones as long as they continue it
+	while (last->next && last->next->write == first->write &&
+	       last->next->sector == last->sector + last->count &&
+	       count + last->next->count <= QUEUE_MERGE_MAX) {
+		last = last->next;
+		count += last->count;
+	}
+	*link = last->next;
+	last->next = NULL;
+	q->head = first->sector + count;
+	pthread_mutex_unlock(&q->lock);
+
+	int ret = first == last ? queue_xfer(q, first->write, first->sector,
+					     first->count, first->buf)
+				: queue_merged(q, first, count);
+
+	// Callers return once done: no access to their operation after that
+	pthread_mutex_lock(&q->lock);
+	for (struct queue_req *r = first, *next; r; r = next) {
+		next = r->next;
+		r->ret = ret;
+		r->done = 1;
+	}
+	pthread_cond_broadcast(&q->done);
+}
+
+/* queue req, and dispatch while it waits on an idle device */
+static int queue_io(struct queue_dev *q, struct queue_req *req)
+{
+	req->deadline = queue_now() + (req->write ? QUEUE_WRITE_NS
+						  : QUEUE_READ_NS);
+	pthread_mutex_lock(&q->lock);
+	struct queue_req **p = &q->pending;
+	while (*p && (*p)->sector <= req->sector)
+		p = &(*p)->next;
+	req->next = *p;
+	*p = req;
+
+	while (!req->done) {
+		if (q->busy) {
+			pthread_cond_wait(&q->done, &q->lock);
+			continue;
+		}
+		q->busy = 1;
+		while (!req->done)
+			queue_dispatch(q);
+		q->busy = 0;
+		pthread_cond_broadcast(&q->done); // another caller takes over
+	}
+	pthread_mutex_unlock(&q->lock);
+	return req->ret;
+}
+
+static int queue_read(void *dev, size_t sector, size_t count, void *buf)
+{
+	struct queue_req req = { .write = 0, .sector = sector, .count = count,
+				 .buf = buf };
+	return queue_io(dev, &req);
+}
+
+static int queue_write(void *dev, size_t sector, size_t count, const void *buf)
+{
+	struct queue_req req = { .write = 1, .sector = sector, .count = count,
+				 .buf = (char*)buf };
+	return queue_io(dev, &req);
+}
+
+/* Mapping and growing bypass the queue */
+static const void *queue_map(void *dev)
+{
+	struct queue_dev *q = dev;
+	return q->ops->map ? q->ops->map(q->dev) : NULL;
+}
+
+static uint64_t queue_clock(void *dev)
+{
+	struct queue_dev *q = dev;
+	return q->ops->clock ? q->ops->clock(q->dev) : 0;
+}
+
+static int queue_grow(void *dev, size_t nsectors)
+{
+	struct queue_dev *q = dev;
+	return q->ops->grow ? q->ops->grow(q->dev, nsectors) : -1;
+}
+
+static const struct block_dev_ops queueOps = {
+	"queue:", queue_open, queue_close, queue_read, queue_write, queue_map,
+	queue_clock, queue_grow
+};
+
+/*
+ * Disk
+ */
+
+/* Backends selected by a prefix */
+static const struct block_dev_ops *backends[] = {
+	&ramOps, &hddOps, &ssdOps, &latOps, &stripeOps, &queueOps,
+};
+
+/* backend selected by the prefix of name, which is skipped; files if none */
+static const struct block_dev_ops *backend_find(const char **name)
+{
+	for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		size_t len = strlen(backends[i]->prefix);
+		if (!strncmp(*name, backends[i]->prefix, len)) {
+			*name += len;
+			return backends[i];
+		}
+	}
+	return &fileOps;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
+{
+	if (!diskname || (flags & ~BLOCK_RDONLY)) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (disk.ops) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	const struct block_dev_ops *ops;
+	void *dev;
+	size_t nsectors;
+	openFlags = flags;
+	if (backend_open(diskname, &ops, &dev, &nsectors) != 0)
+		return -1;
+
+	memset(&disk, 0, sizeof(disk));
+	disk.dev = dev;
+	disk.flags = flags;
+	disk.nsectors = nsectors;
+	disk.spb = BLOCK_SIZE / SECTOR;
+	disk.bcount = nsectors / disk.spb;
+	disk.ops = ops;
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.ops) {
 		block_error("no disk  currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	disk.ops->close(disk.dev);
 
-	disk.fd = INVALID_FD;
+	disk.ops = NULL;
 
 	return 0;
 }
 
-int block_disk_count(void)
+int block_disk_block_size(size_t size)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	if (disk.nsectors % (size / SECTOR) != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    disk.nsectors * SECTOR, size);
+		return -1;
+	}
+
+	disk.spb = size / SECTOR;
+	disk.bcount = disk.nsectors / disk.spb;
+	return 0;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return disk.bcount;
+}
+
+int block_disk_grow(size_t count)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if ((disk.flags & BLOCK_RDONLY) || !disk.ops->grow || count < disk.bcount) {
+		block_error("cannot grow the disk to %zu blocks", count);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (disk.ops->grow(disk.dev, count * disk.spb) != 0)
 		return -1;
+	disk.nsectors = count * disk.spb;
+	disk.bcount = count;
+	return 0;
+}
+
+/* update the counters for an operation on count blocks from block */
+static void disk_account(size_t block, size_t count, int write)
+{
+	struct block_stats *st = &disk.stats;
+	__atomic_fetch_add(write ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(write ? &st->blocks_written : &st->blocks_read, count,
+			   __ATOMIC_RELAXED);
+
+	size_t head = __atomic_exchange_n(&disk.head, block + count,
+					  __ATOMIC_RELAXED);
+	if (head != block) {
+		__atomic_fetch_add(&st->seeks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->seek_blocks,
+				   head > block ? head - block : block - head,
+				   __ATOMIC_RELAXED);
 	}
+}
 
-	return 0;
+int block_write(size_t block, const void *buf)
+{
+	return block_write_n(block, 1, buf);
 }
 
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	return block_read_n(block, 1, buf);
+}
+
+int block_write_n(size_t block, size_t count, const void *buf)
+{
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (disk.flags & BLOCK_RDONLY) {
+		block_error("disk opened read-only");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (block + count > disk.bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	disk_account(block, count, 1);
+	return disk.ops->write(disk.dev, block * disk.spb, count * disk.spb,
+			       buf);
+}
+
+int block_read_n(size_t block, size_t count, void *buf)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	return 0;
+	if (block + count > disk.bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	disk_account(block, count, 0);
+	return disk.ops->read(disk.dev, block * disk.spb, count * disk.spb,
+			      buf);
 }
 
+const void *block_disk_map(void)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	return disk.ops->map ? disk.ops->map(disk.dev) : NULL;
+}
+
+int block_disk_stats(struct block_stats *st)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	*st = disk.stats;
+	st->sim_ns = disk.ops->clock ? disk.ops->clock(disk.dev) : 0;
+
+	return 0;
+}
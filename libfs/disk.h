@@ -2,9 +2,67 @@
 #define _DISK_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, unless set with block_disk_block_size() */
 #define BLOCK_SIZE 4096
+/** Smallest block size, the unit in which backends address disks */
+#define BLOCK_SIZE_MIN 512
+/** Largest block size */
+#define BLOCK_SIZE_MAX (1024*1024)
+
+/*
+ * Backends.
+ *
+ * Every operation on the open disk goes through a table of operations,
+ * implemented by a backend: the virtual disk file itself, a RAM disk, or a
+ * wrapper adding the latency of a simulated device to another backend.
+ * Operations on several blocks may be called from several threads at once.
+ * Backends address disks in sectors of %BLOCK_SIZE_MIN bytes, whatever the
+ * block size.
+ */
+
+/** Operations of a backend, on its state @dev */
+struct block_dev_ops {
+	const char *prefix;	/* Prefix selecting it in disk names, with ':' */
+	/* Open @arg, the disk name after the prefix; set the sector count */
+	int (*open)(void **dev, const char *arg, size_t *nsectors);
+	int (*close)(void *dev);
+	int (*read)(void *dev, size_t sector, size_t count, void *buf);
+	int (*write)(void *dev, size_t sector, size_t count, const void *buf);
+	/* Address of sector 0; NULL if the content cannot be mapped */
+	const void *(*map)(void *dev);
+	/* Simulated time in nanoseconds; NULL if not simulated */
+	uint64_t (*clock)(void *dev);
+	/* Grow the disk to @nsectors sectors; NULL if it cannot grow */
+	int (*grow)(void *dev, size_t nsectors);
+};
+
+/**
+ * Latency model of a simulated device. An operation costs @io_ns, plus
+ * @xfer_ns per block transferred, plus a positioning cost unless it starts
+ * where the previous one ended: @pos_ns plus @seek_ns per block of distance,
+ * the distance part being at most @seek_max_ns. Blocks are %BLOCK_SIZE bytes
+ * here, whatever the block size of the disk.
+ */
+struct block_latency {
+	unsigned io_ns;		/* Cost of every operation */
+	unsigned pos_ns;	/* Cost of any non-sequential operation */
+	unsigned seek_ns;	/* ... plus this per block of distance */
+	unsigned seek_max_ns;	/* ... up to this */
+	unsigned xfer_ns;	/* Cost per block transferred */
+};
+
+/** Counters of the open disk, see block_disk_stats() */
+struct block_stats {
+	size_t reads;		/* Read operations */
+	size_t writes;		/* Write operations */
+	size_t blocks_read;	/* Blocks read */
+	size_t blocks_written;	/* Blocks written */
+	size_t seeks;		/* Operations not starting where the last ended */
+	size_t seek_blocks;	/* Total distance of those, in blocks */
+	size_t sim_ns;		/* Simulated device time, 0 without latency */
+};
 
 /**
  * block_disk_open - Open virtual disk file
@@ -14,11 +72,42 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * A prefix in @diskname selects another backend than the file itself:
+ * - "ram:<file>": a RAM disk holding a copy of virtual disk file <file>.
+ *   Writes only go to memory, and are lost at block_disk_close().
+ * - "hdd:<disk>", "ssd:<disk>": <disk> (itself possibly prefixed), delayed
+ *   like a hard disk drive or a solid-state drive would.
+ * - "lat:<io>,<pos>,<seek>,<seekmax>,<xfer>:<disk>": <disk>, delayed per the
+ *   latency model of struct block_latency, given in nanoseconds.
+ * - "queue:<disk>": <disk>, with the operations of concurrent callers
+ *   queued, sorted by block and merged when adjacent. Each waits at most
+ *   100 ms (reads) or 1 s (writes) behind operations that come first in a
+ *   sweep of increasing blocks.
+ *
+ * Blocks are %BLOCK_SIZE bytes until block_disk_block_size().
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/** block_disk_open_flags() flag: open the disk for reading only */
+#define BLOCK_RDONLY 0x01
+
+/**
+ * block_disk_open_flags - Open virtual disk file with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of BLOCK_* flags
+ *
+ * Like block_disk_open(). With %BLOCK_RDONLY, files are opened for reading
+ * only, so that images without write permission can be opened, and
+ * block_write() fails.
+ *
+ * Return: -1 in the same cases as block_disk_open(), or if @flags is invalid.
+ * 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,20 +115,47 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_block_size - Set the block size of the open disk
+ * @size: Block size in bytes, a power of two from %BLOCK_SIZE_MIN to
+ * %BLOCK_SIZE_MAX
+ *
+ * Block indexes and counts of all the other functions are in blocks of @size
+ * bytes from then on, until the disk is closed.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is invalid,
+ * or if the disk's size is not a multiple of it. 0 otherwise.
+ */
+int block_disk_block_size(size_t size);
+
 /**
  * block_disk_count - Get disk's block count
  *
  * Return: -1 if there was no virtual disk file opened, otherwise the number of
- * blocks that the currently open disk contains.
+ * whole blocks that the currently open disk contains.
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_grow - Enlarge the open disk
+ * @count: New block count
+ *
+ * Add blocks at the end of the open disk, so that it holds @count blocks.
+ * Their content is undefined (zeros for files). The address returned by an
+ * earlier block_disk_map() is no longer valid.
+ *
+ * Return: -1 if there was no virtual disk file opened, if it was opened
+ * read-only, if @count is smaller than its block count, or if its backend
+ * cannot grow. 0 otherwise.
+ */
+int block_disk_grow(size_t count);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (one block) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -52,7 +168,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (one block) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -60,5 +176,58 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_n - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count blocks) in the
+ * virtual disk's blocks @block to @block + @count - 1, in a single operation.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_n(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_n - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with the content of the blocks
+ *
+ * Read the content of the virtual disk's blocks @block to @block + @count - 1
+ * (@count blocks) into buffer @buf, in a single operation.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_n(size_t block, size_t count, void *buf);
+
+/**
+ * block_disk_map - Map virtual disk file in memory
+ *
+ * Map the whole virtual disk file read-only in memory, the first time it is
+ * called for the open disk. The mapping is shared with the file: blocks
+ * written with block_write() show their new content in it. RAM disks are
+ * their own mapping; disks with simulated latency cannot be mapped, since
+ * accesses to the mapping would not be delayed.
+ *
+ * Return: NULL if there was no virtual disk file opened, or if it cannot be
+ * mapped. Otherwise the address of block 0, valid until block_disk_close().
+ */
+const void *block_disk_map(void);
+
+/**
+ * block_disk_stats - Get the counters of the open disk
+ * @st: Structure to be filled
+ *
+ * Counters start from zero at block_disk_open(). Simulated time adds up the
+ * delays of the latency model, and does not depend on the machine.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_disk_stats(struct block_stats *st);
+
 #endif /* _DISK_H */
 
@@ -1,15 +1,36 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "crc32c.h"
+#include "mem.h"
+#include "lz.h"
+#include "simd.h"
 
 /*FAT end-of-chain value*/
 #define FAT_EOC 0xFFFF 
 
+/*
+ * Block size of the mounted image, 1 << blkShift bytes. Offsets are split
+ * into blocks with the shift and mask these expand to, which is as fast as
+ * with a constant block size.
+ */
+static int blkShift = 12;
+#define BLK_SIZE ((size_t)1 << blkShift)
+
+typedef struct __attribute__((__packed__)) Snapshot {
+	uint8_t name[16];
+	uint16_t metaIndex; // first data block of the saved root and FAT, 0 if unused
+}Snapshot;
+
 typedef struct __attribute__((__packed__)) Superblock {
 	uint8_t sig[8];
 	uint16_t numBlocks;
@@ -17,9 +38,19 @@ typedef struct __attribute__((__packed__)) Superblock {
 	uint16_t dataIndex;
 	uint16_t numDataBlocks;
 	uint8_t numFAT; // number of blocks for FAT
-	uint8_t padding[4079];
+	// Extensions, all zero on images made by the reference tools
+	uint16_t refIndex; // first data block of the refcount table, 0 if none
+	Snapshot snaps[FS_SNAPSHOT_MAX_COUNT];
+	uint16_t hashIndex; // first data block of the block hash table, 0 if none
+	uint16_t csumIndex; // first data block of the checksum table, 0 if none
+	uint8_t blockShift; // log2 of the block size, 0 for BLOCK_SIZE
+	uint8_t padding[4072 - FS_SNAPSHOT_MAX_COUNT*sizeof(Snapshot)];
 }Superblock;
 
+/* Whatever the block size, the superblock is read from its first bytes */
+_Static_assert(offsetof(Superblock, padding) <= BLOCK_SIZE_MIN,
+	       "superblock fields do not fit in the smallest block");
+
 typedef struct __attribute__((__packed__)) FAT {
 	uint16_t content;
 }FAT;
@@ -28,524 +59,4046 @@ typedef struct __attribute__((__packed__)) Root {
 	uint8_t name[16]; 
 	uint32_t size; //file size in bytes
 	uint16_t indexFirstBlock;
-	uint8_t padding[10]; 
+	uint8_t flags; // FILE_* layout flags, 0 for a plain chain of data blocks
+	uint8_t packSlot; // FILE_PACKED: first PACK_UNIT of the data in its block
+	uint8_t padding[8]; 
 }Root;
 
+/* Root.flags: the chain holds an index of compressed chunks */
+#define FILE_COMPRESSED 0x01
+/* Root.flags: the chain holds an index of (possibly shared) data blocks */
+#define FILE_DEDUP 0x02
+/* Root.flags: the chain holds an index of data blocks, 0 entries are holes */
+#define FILE_SPARSE 0x04
+/* Root.flags: layouts where the file's chain is an index rather than data */
+#define FILE_INDEXED (FILE_COMPRESSED | FILE_DEDUP | FILE_SPARSE)
+/* Root.flags: index layouts with one entry per data block */
+#define FILE_BLKINDEX (FILE_DEDUP | FILE_SPARSE)
+/* Root.flags: small file stored in a block shared with other small files */
+#define FILE_PACKED 0x08
+
 typedef struct FD{
 	int id;
 	int offset;
 	int index; // index of the file of the root directory 
 
+	// data written through this descriptor, not on disk yet
+	char *wbuf; // WBUF_SIZE bytes, allocated on first use
+	int wbufStart; // file offset of wbuf[0]
+	int wbufLen;
+	int wbufBlocks; // data blocks reserved for writing it back
+
+	int flags; // FS_OPEN_* flags
 }FD;
 
+/* Per-descriptor write buffer of 64 KiB (or a block), flushed when full */
+#define WBUF_SIZE (BLK_SIZE > 65536 ? BLK_SIZE : 65536)
+#define WBUF_BLOCKS ((int)(WBUF_SIZE/BLK_SIZE))
+/* All write buffers together, buffers are flushed past this */
+#define WBUF_TOTAL (4*WBUF_SIZE)
+
 
 
 /* internal data structs for metadata */
 static Superblock* sblk;// Global instance
 static FAT* fat;// num of entries should equal num_data_blocks
-static Root root[128]; // Global instance
+static Root *root; // FS_FILE_MAX_COUNT entries, in root_blocks() blocks
+
+/* Bytes of the root directory */
+#define ROOT_SIZE (FS_FILE_MAX_COUNT*sizeof(Root))
+
+/* blocks holding the root directory, the first ROOT_SIZE bytes are used */
+static int root_blocks() {
+	return (ROOT_SIZE + BLK_SIZE - 1) / BLK_SIZE;
+}
+
+/*
+ * Number of references (live FAT and snapshots) to each data block. Only
+ * allocated once the image has had a snapshot; until then a block is in use
+ * iff its FAT entry is non-zero.
+ */
+static uint16_t *refcnt;
+static int readOnly; // set when a snapshot is mounted
+
+/*
+ * Content hash of each data block written through deduplicated files, 0 if
+ * none. Blocks with the same hash are linked from hashHead[] through
+ * hashNext[] so that a new block can be matched against existing ones. Only
+ * allocated once the image has had a deduplicated file.
+ */
+static uint32_t *blkHash;
+static uint16_t *hashHead;
+static uint16_t *hashNext;
+static uint32_t hashMask; // number of hashHead buckets - 1
+
+/*
+ * Blocks holding packed small files, rebuilt at mount from the root
+ * directory. Each block is cut into units of PACK_UNIT bytes, used tells which
+ * ones hold file data. A slot with blk 0 is unused.
+ */
+typedef struct Pack {
+	uint16_t blk;
+	uint16_t files; // number of live files stored in blk
+	uint64_t used;
+}Pack;
+static Pack packs[FS_FILE_MAX_COUNT];
+
+/*
+ * CRC-32C of each data block, 0 if unknown (blocks not written since they
+ * were allocated). Only allocated once checksums were enabled on the image.
+ */
+static uint32_t *csum;
+static int csumPolicy;
+static uint32_t csumReads; // reads considered for verification
+static struct fs_csum_stats csumStats;
+
+/* With FS_CSUM_SAMPLED, one read out of CSUM_SAMPLE_RATE is verified */
+#define CSUM_SAMPLE_RATE 16
+
+/*
+ * Data blocks read since mount, a bit each, with FS_MOUNT_WARM. Listed at
+ * unmount for the warm-up of the next mount, see "Warm-up".
+ */
+static uint8_t *warmHot;
+
+/* dedup counters since mount */
+static uint32_t dedupHits;
+static uint32_t dedupWrites;
 
 static FD filedes[FS_OPEN_MAX_COUNT];
+static int wbufTotal; // bytes held by write buffers
+static int wbufReserved; // data blocks reserved by write buffers
 static int numFilesOpen = 0;
 static int idCount = 0; // running count of ids to assign 
 
 
 
-/* returns the number of empty data blocks */
-int num_free_fat() {
-	int count = 0;
-	for (int i=1; i < sblk->numDataBlocks; i++) { // first data block cannot be used
-		if(fat[i].content == 0) // if entry is empty 
-			count++;
-	}
-	return count;
+/* memory of the mounted file system, released by fs_umount() */
+static struct arena mountArena;
+static struct buf_pool blkPool;
+
+/* zeroed memory living until fs_umount() */
+static void *meta_alloc(size_t size) {
+	return arena_alloc(&mountArena, size, 4096);
 }
 
-/* returns the number of root directory entries that are empty */
-int num_free_rdir() {
-	int count = 0;
-	for (int i=0; i < FS_FILE_MAX_COUNT; i++) {
-		if((char)*(root[i].name) == '\0') //if entry is empty
-			count++;
-	}
-	return count;
+/* pool buffers holding n blocks, pool buffers being at least 4 KiB */
+static int pool_bufs(int n) {
+	return (((size_t)n << blkShift) + blkPool.bufSize - 1) / blkPool.bufSize;
 }
 
-int fs_info()
-{
-	// Check the presence of an underlying virtual disk
-	if (block_disk_count() == -1)
-		return -1;
+/* n consecutive scratch block buffers, given back with buf_put() */
+static void *buf_get(int n) {
+	return pool_get(&blkPool, pool_bufs(n));
+}
 
-	// Printing information
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", sblk->numBlocks);
-	printf("fat_blk_count=%d\n", sblk->numFAT);
-	printf("rdir_blk=%d\n", sblk->rootIndex);
-	printf("data_blk=%d\n", sblk->dataIndex);
-	printf("data_blk_count=%d\n", sblk->numDataBlocks);
-
-	printf("fat_free_ratio=%d/%d\n", num_free_fat(), sblk->numDataBlocks);
-	printf("rdir_free_ratio=%d/128\n", num_free_rdir());
-	
+static void buf_put(void *buf, int n) {
+	pool_put(&blkPool, buf, pool_bufs(n));
+}
 
+/* checksum of a block's content, never 0 */
+static uint32_t csum_of(const void *buf) {
+	uint32_t crc = crc32c(0, buf, BLK_SIZE);
+	return crc ? crc : ~0U;
+}
+
+/* block_write() of n data blocks starting at data block i */
+static int data_write_n(int i, int n, const void *buf) {
+	if (block_write_n(i + sblk->dataIndex, n, buf) != 0)
+		return -1;
+	if (csum) {
+		for (int j = 0; j < n; j++)
+			csum[i + j] = csum_of((const char*)buf + j*BLK_SIZE);
+	}
 	return 0;
 }
 
+static int data_write(int i, const void *buf) {
+	return data_write_n(i, 1, buf);
+}
 
 /*
- * sb_init 
- * Extract the file system information into internal (global) data struct
- * Also perform error check
- * Return -1 if error is found. 0 otherwise.
+ * Check the content of n data blocks starting at data block i, found in buf,
+ * against their checksums per policy. Counters are atomic, see
+ * fs_pread_shareable().
  */
-int sb_init() {
-	// Reading superblock (first block of the file system)
-	sblk = malloc(BLOCK_SIZE);
-	block_read(0, sblk);
-	
-	// Check if signature is as expected
-	if (strncmp((char*)(sblk->sig), "ECS150FS", 8) != 0) {
-		fprintf(stderr, "Incorrect signature\n");
-		return -1;
-	}
+static int csum_check(int i, int n, const void *buf) {
+	if (!csum || csumPolicy == FS_CSUM_OFF)
+		return 0;
+	if (csumPolicy == FS_CSUM_SAMPLED &&
+	    __atomic_fetch_add(&csumReads, 1, __ATOMIC_RELAXED) % CSUM_SAMPLE_RATE != 0)
+		return 0;
 
-	// Check if total amount of blocks is correct
-	if (sblk->numBlocks != block_disk_count()) {
-		fprintf(stderr, "Incorrect total number of blocks\n");
-		return -1;
+	int verified = 0, ret = 0;
+	for (int j = 0; j < n; j++) {
+		if (csum[i + j] == 0)
+			continue; // never written since allocated
+		verified++;
+		if (csum_of((const char*)buf + j*BLK_SIZE) != csum[i + j]) {
+			__atomic_fetch_add(&csumStats.errors, 1, __ATOMIC_RELAXED);
+			fprintf(stderr, "Checksum mismatch in data block %d\n", i + j);
+			ret = -1;
+			break;
+		}
 	}
-	
-	// Check if number of blocks for FAT is correct 
-	// uint8_t trueNumFAT = block_disk_count()*2.0/BLOCK_SIZE;
-	// printf("true %d, actual: %d \n", trueNumFAT, sblk->numFAT);
-	// if (sblk->numFAT != trueNumFAT) {
-	// 	fprintf(stderr, "Incorrect number of blocks for FAT\n");
-	// 	return -1;
-	// }
+	__atomic_fetch_add(&csumStats.verified, verified, __ATOMIC_RELAXED);
+	return ret;
+}
 
-	// Check if root index is correct
-	if (sblk->rootIndex != (sblk->numFAT + 1)) {
-		fprintf(stderr, "Incorrect root index\n");
-		return -1;
+/* mark n data blocks starting at data block i as read, see fs_pread_shareable() */
+static void warm_mark(int i, int n) {
+	for (int j = i; j < i + n; j++) {
+		if (!(warmHot[j >> 3] & (1 << (j & 7))))
+			__atomic_fetch_or(&warmHot[j >> 3], 1 << (j & 7), __ATOMIC_RELAXED);
 	}
+}
 
-	// Check if data index is correct
-	if (sblk->dataIndex != (sblk->rootIndex + 1)) {
-		fprintf(stderr, "Incorrect data index\n");
+/* block_read() of n data blocks starting at data block i, checked per policy */
+static int data_read_n(int i, int n, void *buf) {
+	if (block_read_n(i + sblk->dataIndex, n, buf) != 0)
 		return -1;
-	}
+	if (warmHot)
+		warm_mark(i, n);
+	return csum_check(i, n, buf);
+}
 
-	return 0; // No error found
+static int data_read(int i, void *buf) {
+	return data_read_n(i, 1, buf);
 }
 
-/* read in FAT */
-int fat_init() {
-	fat = malloc((sblk->numFAT)*BLOCK_SIZE); //get size of FAT array
-	int i;
-	for(i = 1; i <= sblk->numFAT; i++) {
-		block_read(i, (char*)fat + BLOCK_SIZE*(i-1));
-	}
-	
+/* returns 1 if data block i is referenced neither by a file nor a snapshot */
+static int blk_free(int i) {
+	if (refcnt)
+		return refcnt[i] == 0;
+	return fat[i].content == 0;
+}
 
-	if(fat[0].content != FAT_EOC) // first entry is always invalid
-		return -1;
+/* entries equal to 0 in here are free data blocks, see blk_free() */
+static const void *free_map() {
+	if (refcnt)
+		return refcnt;
+	return fat; // FAT entries are plain uint16
+}
 
-	return 0; 
+/* returns the number of empty data blocks */
+int num_free_fat() {
+	// first data block cannot be used
+	return simd_count_zero16((const uint16_t*)free_map() + 1, sblk->numDataBlocks - 1);
 }
 
-/* read in root */
-int root_init() {
-	block_read(sblk->rootIndex, root);
-	return 0; // all good
+/* returns the number of root directory entries that are empty */
+int num_free_rdir() {
+	return simd_count_empty(root, FS_FILE_MAX_COUNT, sizeof(Root));
 }
 
+int find_empty_fat(){
+	int i = simd_find_zero16((const uint16_t*)free_map() + 1, sblk->numDataBlocks - 1);
+	return i == -1 ? -1 : i + 1; // -1 if no space
+}
 
-int fd_init() {
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		filedes[i].id = -1;
-		filedes[i].offset = 0;
-		filedes[i].index = -1;
+/* returns the root directory entry of file filename, -1 if there is none */
+static int root_find(const char *filename) {
+	char key[FS_FILENAME_LEN] = { 0 };
+	if (*filename == '\0' || strlen(filename) >= FS_FILENAME_LEN)
+		return -1;
+	strcpy(key, filename); // names are zero padded, compare all 16 bytes
+	return simd_find_name(root, FS_FILE_MAX_COUNT, sizeof(Root), key);
+}
+
+/* zero the bytes following the name of every entry, for root_find() */
+static void root_pad_names() {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		size_t len = strnlen((char*)root[i].name, FS_FILENAME_LEN);
+		memset(root[i].name + len, 0, FS_FILENAME_LEN - len);
 	}
-	return 0;
 }
-	
-int fs_mount(const char *diskname)
-{
-	if (block_disk_open(diskname) != 0)
-		return -1; // Open failed
 
-	// Read in metadata in order
-	if (sb_init() != 0) // 1. superblock 
-		return -1; // Error checking failed
-	fat_init(); // 2. FAT
-	root_init(); // 3. root directory
+static void hash_remove(int i);
 
-	// initialize file descriptors
-	fd_init();
+/* turn free data block i into a one-block chain */
+static void blk_take(int i) {
+	if (blkHash && blkHash[i])
+		hash_remove(i); // stale content hash of a freed block
+	if (csum)
+		csum[i] = 0; // content unknown until written
+	fat[i].content = FAT_EOC;
+	if (refcnt)
+		refcnt[i] = 1;
+}
 
-	return 0;
+/* allocate a data block as a one-block chain, returns its index or -1 */
+static int blk_alloc() {
+	int i = find_empty_fat();
+	if (i == -1)
+		return -1;
+	blk_take(i);
+	return i;
 }
 
-int fs_umount(void)
-{
-	// Write back to disk the meta-information
-	block_write(0, sblk);
+/* drop the live FAT's reference to data block i */
+static void blk_release(int i) {
+	fat[i].content = 0;
+	if (refcnt)
+		refcnt[i]--;
+}
 
-	int i;
-	for(i = 1; i <= sblk->numFAT; i++) {
-		block_write(i, (char*)fat + BLOCK_SIZE*(i-1));
-	} // fat
+/* drop one reference to data block i, freeing it with the last one */
+static void blk_unref(int i) {
+	if (!refcnt || --refcnt[i] == 0)
+		fat[i].content = 0;
+}
 
-	// root directory
-	block_write(sblk->rootIndex, root);
+/* returns 1 if data block i is also referenced by another file or a snapshot */
+static int blk_shared(int i) {
+	return refcnt && refcnt[i] > 1;
+}
 
-	if (block_disk_close() != 0)
-		return -1; // Close failed
+/* allocate a chain of n data blocks, returns its first block or -1 */
+static int chain_alloc(int n) {
+	if (n <= 0 || num_free_fat() < n)
+		return -1;
 
-	return 0;
+	int first = blk_alloc();
+	int prev = first;
+	for (int i = 1; i < n; i++) {
+		int cur = blk_alloc();
+		fat[prev].content = cur;
+		prev = cur;
+	}
+	return first;
 }
 
-/* helper function to check valid filename */
-int valid_filename(const char *filename){
-	char bad_chars[] = "!@%^*~|";
-	for (int i = 0; i < strlen(bad_chars); i++) {
-		if(strchr(filename, bad_chars[i]) != NULL)
-			return -1;
-	} //check valid filename
-	
-	return 0;
+/* like chain_alloc(), but on consecutive blocks if there is such a run */
+static int chain_alloc_run(int n) {
+	int run = 0;
+	for (int i = 1; i < sblk->numDataBlocks && n > 0; i++) {
+		run = blk_free(i) ? run + 1 : 0;
+		if (run < n)
+			continue;
+		int first = i - n + 1;
+		for (int j = first; j <= i; j++) {
+			blk_take(j);
+			if (j > first)
+				fat[j - 1].content = j;
+		}
+		return first;
+	}
+	return chain_alloc(n); // too fragmented
 }
 
-int find_empty_fat(){
-	uint16_t itr = 1;
-	while(itr < sblk->numDataBlocks){
-		if(fat[itr].content == 0) {
-			return itr;
-		}		
-		itr++;
+/* release every block of the chain starting at itr */
+static void chain_release(uint16_t itr) {
+	while (itr != FAT_EOC) {
+		uint16_t next = fat[itr].content;
+		blk_release(itr);
+		itr = next;
 	}
-
-	return -1; // no space
-
 }
 
-int fs_create(const char *filename)
-{
-	if(strlen(filename)*sizeof(char) > FS_FILENAME_LEN) 
-		return -1; //filename too long
-
-	if(valid_filename(filename) == -1)
-		return -1;
+/* returns the number of blocks of the chain starting at itr */
+static int chain_length(uint16_t itr) {
+	int n = 0;
+	for (; itr != FAT_EOC; itr = fat[itr].content)
+		n++;
+	return n;
+}
 
-	for (int j = 0; j < FS_FILE_MAX_COUNT; j++){
-		if(strncmp((char*)root[j].name, filename, strlen(filename)) == 0) // filename already exists;
-			return -1; 	
+/* returns 1 if the chain at itr starts with n consecutive blocks */
+static int chain_is_run(uint16_t itr, int n) {
+	for (int i = 1; i < n; i++, itr++) {
+		if (fat[itr].content != itr + 1)
+			return 0;
 	}
+	return 1;
+}
 
-	int k;
-	for(k = 0; k < FS_FILE_MAX_COUNT; k++) {
-		if((char) *(root[k].name) == '\0') { //empty entry 
-			strcpy((char*) root[k].name, filename);
-			root[k].size = 0; 
-			root[k].indexFirstBlock = find_empty_fat();
-			fat[root[k].indexFirstBlock].content = FAT_EOC;
-			break;
+/*
+ * Last block and length of the chain of each plain file, so that appending
+ * to a file does not walk its chain. An entry with len 0 is unknown and is
+ * filled on first use; code changing a plain file's chain other than at its
+ * end resets the entry.
+ */
+typedef struct ChainEnd {
+	uint16_t tail;
+	int len;
+} ChainEnd;
+static ChainEnd chainEnd[FS_FILE_MAX_COUNT];
+
+/* returns the number of blocks of plain file rootInd, its last one in *tail */
+static int chain_end(int rootInd, uint16_t *tail) {
+	ChainEnd *e = &chainEnd[rootInd];
+	if (e->len == 0) {
+		uint16_t itr = root[rootInd].indexFirstBlock;
+		for (; itr != FAT_EOC; itr = fat[itr].content) {
+			e->tail = itr;
+			e->len++;
 		}
 	}
+	if (tail)
+		*tail = e->tail;
+	return e->len;
+}
 
-	if(k == FS_FILE_MAX_COUNT) // no empty entries
-		return -1;
+/*
+ * Read (or write) n consecutive blocks of buf from (to) the chain at itr. Runs
+ * of consecutive blocks in the chain are transferred in a single operation.
+ */
+static int chain_io(uint16_t itr, void *buf, int n, int write) {
+	for (int i = 0; i < n; ) {
+		if (itr == FAT_EOC)
+			return -1; // chain too short
+		uint16_t first = itr;
+		int run = 1;
+		itr = fat[itr].content;
+		while (i + run < n && itr == first + run) {
+			itr = fat[itr].content;
+			run++;
+		}
 
+		char *blk = (char*)buf + i*BLK_SIZE;
+		int ret = write ? data_write_n(first, run, blk)
+				: data_read_n(first, run, blk);
+		if (ret != 0)
+			return -1;
+		i += run;
+	}
 	return 0;
 }
 
-int fs_delete(const char *filename)
-{
-	if(valid_filename(filename) == -1)
-		return -1;
-
-	int j;
-	for (j = 0; j < FS_FILE_MAX_COUNT; j++){
-		if(strncmp((char*)root[j].name, filename, strlen(filename)) == 0){ // found the file
-			*(root[j].name) = (int) '\0'; // just clear the name
-			uint16_t itr = root[j].indexFirstBlock; //to go through the FAT
-			while(itr != FAT_EOC){
-				uint16_t itr2 = fat[itr].content;
-				fat[itr].content = 0; 
-				itr = itr2;
-			} //clear FAT blocks
-			break;
-		}
+/* adjust the refcount of every block of the chain at itr in the given FAT */
+static void chain_ref(FAT *table, uint16_t itr, int delta) {
+	while (itr != FAT_EOC) {
+		uint16_t next = table[itr].content;
+		refcnt[itr] += delta;
+		if (refcnt[itr] == 0)
+			fat[itr].content = 0; // last reference gone
+		itr = next;
 	}
+}
 
-	if(j == FS_FILE_MAX_COUNT)
-		return -1; //file not found
-	
-	return 0;
+/* number of blocks needed to store the refcount table */
+static int refcnt_blocks() {
+	return (sblk->numDataBlocks*sizeof(uint16_t) + BLK_SIZE - 1) / BLK_SIZE;
 }
 
-int fs_ls(void)
-{
-	//check underlying virtual disk
-	if (block_disk_count() == -1)
+/* start tracking refcounts, called when the first snapshot is taken */
+static int refcnt_enable() {
+	int n = refcnt_blocks();
+	if (num_free_fat() < n)
 		return -1;
 
-	printf("FS Ls:\n");
-	int i;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if((char)*(root[i].name) != '\0') //if name not empty
-			printf("file: %s, size: %d, data_blk: %d\n", root[i].name, root[i].size, root[i].indexFirstBlock); //print it out
+	refcnt = meta_alloc(n*BLK_SIZE);
+	for (int i = 0; i < sblk->numDataBlocks; i++)
+		refcnt[i] = fat[i].content != 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (packs[i].blk)
+			refcnt[packs[i].blk] = packs[i].files; // one per packed file
 	}
 
+	// The table lives in the data region, like any other chain
+	sblk->refIndex = chain_alloc(n);
 	return 0;
 }
 
-int fs_open(const char *filename)
-{
-	if(valid_filename(filename) == -1)
-		return -1;
-
-	if (numFilesOpen > FS_OPEN_MAX_COUNT)
-		return -1; //too many files open
-	
-	int j, k; // for loop iteration
-	for (j = 0; j < FS_FILE_MAX_COUNT; j++) { // iterate through files in root directory
-		
-		if(strncmp((char*)root[j].name, filename, strlen(filename)) == 0){ // found the file
-			
-			// iterate through file descriptors to find empty entry
-			for(k = 0; k < FS_OPEN_MAX_COUNT; k++){ 
-				
-				if(filedes[k].id == -1) { // if empty
-
-					// initialize variables
-					filedes[k].id = idCount;
-					filedes[k].index = j;
-					filedes[k].offset = 0;
-
-					idCount++;
-					numFilesOpen++;
-					
-					return filedes[k].id;
-				}	
-			}
-		}
-	} 
-	return -1; //file not found	
+/* number of blocks needed to store the block hash table */
+static int hash_blocks() {
+	return (sblk->numDataBlocks*sizeof(uint32_t) + BLK_SIZE - 1) / BLK_SIZE;
 }
 
+/* 32-bit content hash of a data block, never 0 */
+static uint32_t blk_hash(const void *buf) {
+	const char *p = buf;
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < BLK_SIZE / 8; i++, p += 8) {
+		uint64_t v; // buf may not be 8-byte aligned
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return (uint32_t)h ? (uint32_t)h : 1;
+}
 
-int fs_close(int fd)
-{
-	if (fd > idCount || fd < 0)
-		return -1; //invalid fd
+static void hash_insert(int i, uint32_t h) {
+	blkHash[i] = h;
+	hashNext[i] = hashHead[h & hashMask];
+	hashHead[h & hashMask] = i;
+}
 
-	int i;
-	for(i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(filedes[i].id == fd){ //found fd
-			filedes[i].id = -1;
-			filedes[i].offset = 0;
-			filedes[i].index = -1;
-			numFilesOpen--;
-			return 0;
-		}
-	}
-	return -1; // file not found	
+static void hash_remove(int i) {
+	uint16_t *link = &hashHead[blkHash[i] & hashMask];
+	while (*link && *link != i)
+		link = &hashNext[*link];
+	if (*link)
+		*link = hashNext[i];
+	blkHash[i] = 0;
 }
 
-int fs_stat(int fd)
-{
-	if (fd > idCount || fd < 0)
-		return -1; //invalid fd
+/* build the hash buckets from blkHash[] */
+static void hash_build() {
+	hashMask = 1;
+	while (hashMask < sblk->numDataBlocks)
+		hashMask <<= 1;
+	hashHead = meta_alloc(hashMask*sizeof(uint16_t));
+	hashNext = meta_alloc(sblk->numDataBlocks*sizeof(uint16_t));
+	hashMask--;
 
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(filedes[i].id == fd) //found fd
-			return root[filedes[i].index].size;
+	for (int i = 1; i < sblk->numDataBlocks; i++) {
+		uint32_t h = blkHash[i];
+		if (h && refcnt[i]) // skip hashes of blocks freed since
+			hash_insert(i, h);
 	}
-	return -1; // fd not found
 }
 
-int fs_lseek(int fd, size_t offset)
-{
-	int size = fs_stat(fd);
-	if(size == -1 || offset > size)
+/* start hashing blocks, called when the first deduplicated file is created */
+static int hash_enable() {
+	if (!refcnt && refcnt_enable() != 0)
 		return -1;
 
-	int i;
-	for(i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(filedes[i].id == fd){ //found fd
-			filedes[i].offset = offset;
-			return 0;
-		}
-	}
-	return -1; // file not found	
+	int n = hash_blocks();
+	if (num_free_fat() < n)
+		return -1;
+	blkHash = meta_alloc(n*BLK_SIZE);
+	sblk->hashIndex = chain_alloc(n);
+	hash_build();
+	return 0;
 }
 
+/*
+ * Replace block cur of file rootInd's chain (following block prev, or FAT_EOC
+ * if cur is the first block) by a fresh block if a snapshot also references
+ * it. The caller is responsible for filling the new block. Returns the block
+ * now in place, or -1 if there is no space left for the copy.
+ */
+static int blk_unshare(int rootInd, uint16_t prev, uint16_t cur) {
+	if (!refcnt || refcnt[cur] <= 1)
+		return cur; // private already
 
-/* Return the index of the entry in filedes corresponding to fd */
-int filedes_index(int fd)
-{
-	if (fd > idCount || fd < 0)
-		return -1; //invalid fd
+	int copy = blk_alloc();
+	if (copy == -1)
+		return -1;
+	fat[copy].content = fat[cur].content;
+	if (prev == FAT_EOC)
+		root[rootInd].indexFirstBlock = copy;
+	else
+		fat[prev].content = copy;
+	if (chainEnd[rootInd].len && chainEnd[rootInd].tail == cur)
+		chainEnd[rootInd].tail = copy;
+	blk_release(cur); // the snapshot keeps its own reference
+	return copy;
+}
 
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(filedes[i].id == fd){ //found fd
-			return i;	
+/*
+ * Compressed files
+ *
+ * The data of a compressed file is cut into chunks of CHUNK_SIZE bytes that
+ * are compressed independently. The file's own chain holds an index: one
+ * uint16 entry per chunk giving the first block of the chain that stores the
+ * chunk, or 0 if the chunk was never written (block 0 is never a data block).
+ * A stored chunk starts with a 32-bit header giving its compressed length,
+ * immediately followed by the compressed bytes. Reading at any offset thus
+ * costs an index lookup plus the few blocks of one chunk.
+ *
+ * Chunks are decompressed into a small cache where writes are applied; a
+ * dirty chunk is compressed into a newly allocated chain when it is complete,
+ * evicted, or when the file is closed.
+ */
+#define CHUNK_SIZE (BLK_SIZE > 65536 ? BLK_SIZE : 65536)
+#define CHUNK_BLOCKS ((int)(CHUNK_SIZE/BLK_SIZE))
+#define INDEX_ENTRIES (BLK_SIZE/sizeof(uint16_t))
+#define CHUNK_RAW 0x80000000 // header flag: chunk did not compress, stored as is
+#define CHUNK_CACHE_SIZE 4
+
+typedef struct ChunkCache {
+	int rootInd; // file owning the cached chunk, -1 if the slot is unused
+	int chunk;
+	int dirty;
+	unsigned long lastUse;
+	char *data; // CHUNK_SIZE bytes, allocated on first use
+}ChunkCache;
+
+static ChunkCache chunkCache[CHUNK_CACHE_SIZE];
+static unsigned long chunkClock;
+
+/* last index block read or written, sequential access reuses it */
+static uint16_t idxCacheBlk; // 0 if empty
+static uint16_t *idxCache; // a block, allocated with the chunks
+
+static void chunk_cache_init() {
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+		chunkCache[i].rootInd = -1;
+		chunkCache[i].data = NULL; // the arena is released at unmount
+	}
+	idxCacheBlk = 0;
+	idxCache = NULL;
+}
+
+/* returns the content of index block blk, NULL if it cannot be read */
+static uint16_t *index_block(uint16_t blk) {
+	if (!idxCache)
+		idxCache = meta_alloc(BLK_SIZE);
+	if (blk != idxCacheBlk) {
+		idxCacheBlk = 0;
+		if (data_read(blk, idxCache) != 0)
+			return NULL;
+		idxCacheBlk = blk;
+	}
+	return idxCache;
+}
+
+static void index_write(uint16_t blk, const uint16_t *ent) {
+	data_write(blk, ent);
+	if (!idxCache)
+		idxCache = meta_alloc(BLK_SIZE);
+	memcpy(idxCache, ent, BLK_SIZE);
+	idxCacheBlk = blk;
+}
+
+/* returns the index entry of chunk c of file r, 0 if unset, -1 on error */
+static int index_get(Root *r, int c) {
+	uint16_t itr = r->indexFirstBlock;
+	for (int i = c / INDEX_ENTRIES; i > 0 && itr != FAT_EOC; i--)
+		itr = fat[itr].content;
+	if (itr == FAT_EOC)
+		return 0; // past the end of the index
+
+	uint16_t *ent = index_block(itr);
+	return ent ? ent[c % INDEX_ENTRIES] : -1;
+}
+
+/* set the index entry of chunk c of file rootInd, growing the index if needed */
+static int index_set(int rootInd, int c, uint16_t val) {
+	uint16_t *ent = buf_get(1);
+	uint16_t prev = FAT_EOC;
+	uint16_t itr = root[rootInd].indexFirstBlock;
+	for (int i = c / INDEX_ENTRIES; ; i--) {
+		if (itr == FAT_EOC) { // append a zeroed index block
+			int blk = blk_alloc();
+			if (blk == -1) {
+				buf_put(ent, 1);
+				return -1;
+			}
+			memset(ent, 0, BLK_SIZE);
+			index_write(blk, ent);
+			if (prev == FAT_EOC)
+				root[rootInd].indexFirstBlock = blk;
+			else
+				fat[prev].content = blk;
+			itr = blk;
 		}
+		if (i == 0)
+			break;
+		prev = itr;
+		itr = fat[itr].content;
 	}
-	return -1; // fd not found
+
+	uint16_t *cur = index_block(itr);
+	if (!cur) {
+		buf_put(ent, 1);
+		return -1;
+	}
+	memcpy(ent, cur, BLK_SIZE);
+	ent[c % INDEX_ENTRIES] = val;
+	int blk = blk_unshare(rootInd, prev, itr);
+	if (blk != -1)
+		index_write(blk, ent);
+	buf_put(ent, 1);
+	return blk == -1 ? -1 : 0;
 }
 
-/* 
- * Returns the index of the data block corresponding to the file’s offset 
- * Returns -1 if a new block should be allocated
+/*
+ * collect the index entries of indexed file r (walked with FAT table), -1 if
+ * the index cannot be read
  */
-int dataBlk_index(int fd) 
-{
-	int fdInd = filedes_index(fd); // get filedes index 
-	int rootInd = filedes[fdInd].index; // get root dir index
-	uint16_t dataInd = root[rootInd].indexFirstBlock; // first data block index
+static int index_entries(Root *r, FAT *table, uint16_t **out) {
+	int n = 0;
+	for (uint16_t itr = r->indexFirstBlock; itr != FAT_EOC; itr = table[itr].content)
+		n++;
 
-	int offset = filedes[fd].offset; 
-	while(offset >= BLOCK_SIZE) { // if offset goes over current block
-		// go to next block
-		dataInd = fat[dataInd].content;
-		if (dataInd == FAT_EOC) // if next index has not been allocated
+	uint16_t *ent = buf_get(n ? n : 1);
+	uint16_t itr = r->indexFirstBlock;
+	for (int i = 0; i < n; i++) {
+		if (data_read(itr, (char*)ent + i*BLK_SIZE) != 0) {
+			buf_put(ent, n);
 			return -1;
-		offset = offset - BLOCK_SIZE;
+		}
+		itr = table[itr].content;
 	}
+	*out = ent;
+	return n*INDEX_ENTRIES;
+}
 
-	return dataInd + sblk->dataIndex;
-} 
+/* give back the entries returned by index_entries() */
+static void index_entries_put(uint16_t *ent, int n) {
+	buf_put(ent, n ? n / INDEX_ENTRIES : 1);
+}
 
-/* Change the size of the file corresponding to the specified file descriptor */
-void set_file_size(int fd, int sizeInc) {
-	int fdInd = filedes_index(fd); // get filedes index 
-	int rootInd = filedes[fdInd].index; // get root dir index
-	root[rootInd].size += sizeInc;
+static void pack_free(Root *r);
+
+/* release every block owned by file r */
+static void file_release(Root *r) {
+	if (r->flags & FILE_PACKED) {
+		pack_free(r);
+		return;
+	}
+	if (r->flags & FILE_INDEXED) {
+		uint16_t *ent;
+		int n = index_entries(r, fat, &ent);
+		for (int i = 0; i < n; i++) {
+			if (!ent[i])
+				continue;
+			if (r->flags & FILE_BLKINDEX)
+				blk_unref(ent[i]); // may be shared with other files
+			else
+				chain_release(ent[i]);
+		}
+		if (n >= 0) // unreadable, the blocks it points at are leaked
+			index_entries_put(ent, n);
+		idxCacheBlk = 0;
+	}
+	chain_release(r->indexFirstBlock);
 }
 
+/* returns the number of data blocks owned by file r, 0 if packed */
+static int file_blocks(Root *r) {
+	if (r->flags & FILE_PACKED)
+		return 0;
 
-int fs_read(int fd, void *buf, size_t count)
-{	
-	int fdInd = filedes_index(fd);
-	if (fdInd == -1)
-		return -1; // fd invalid or not found
+	int n = chain_length(r->indexFirstBlock);
+	if (r->flags & FILE_INDEXED) {
+		uint16_t *ent;
+		int cnt = index_entries(r, fat, &ent);
+		for (int i = 0; i < cnt; i++) {
+			if (!ent[i])
+				continue;
+			n += r->flags & FILE_BLKINDEX ? 1 : chain_length(ent[i]);
+		}
+		if (cnt >= 0)
+			index_entries_put(ent, cnt);
+	}
+	return n;
+}
+
+/*
+ * adjust the refcount of every block owned by file r, walked with FAT table.
+ * Nothing is changed if its index cannot be read.
+ */
+static int file_ref(Root *r, FAT *table, int delta) {
+	if (r->flags & FILE_INDEXED) {
+		uint16_t *ent;
+		int n = index_entries(r, table, &ent);
+		if (n < 0)
+			return -1;
+		for (int i = 0; i < n; i++) {
+			if (ent[i])
+				chain_ref(table, ent[i], delta);
+		}
+		index_entries_put(ent, n);
+	}
+	chain_ref(table, r->indexFirstBlock, delta);
+	return 0;
+}
 
-	int bufOff = 0; // offset for read buffer
-	size_t toRead = count; // remaining # of bytes to (try to) read
-	size_t leftOff, rightOff, bytesRead; // left & right offsets, # of bytes read
+/*
+ * Clear the index entries of file rootInd from entry keep on, releasing what
+ * they point at, and drop the index blocks that are no longer needed. This is
+ * done in a single walk of the index.
+ */
+static int index_truncate(int rootInd, int keep) {
+	Root *r = &root[rootInd];
+	int keepBlks = keep ? (keep + INDEX_ENTRIES - 1) / INDEX_ENTRIES : 1;
+	uint16_t *ent = buf_get(1);
+	uint16_t prev = FAT_EOC;
+	uint16_t itr = r->indexFirstBlock;
+	int ret = 0;
+	for (int i = 0; itr != FAT_EOC; i++) {
+		int from = keep - i*(int)INDEX_ENTRIES;
+		if (from < 0)
+			from = 0;
+		if (from >= INDEX_ENTRIES) { // nothing to drop in this one
+			prev = itr;
+			itr = fat[itr].content;
+			continue;
+		}
 
-	int i = 0; // loop iteration count 
-	while(toRead != 0) { // more bytes to read 
-		
-		// Set left & right offsets
-		// Left offset may be nonzero only if it is first block read
-		leftOff = 0;
-		if (i == 0)
-			leftOff = filedes[fdInd].offset % BLOCK_SIZE;
-		// Right offset is non-zero if we don't need to read another block
-		rightOff = 0;
-		if (toRead + leftOff < BLOCK_SIZE) {
-			rightOff = BLOCK_SIZE - toRead - leftOff;
+		uint16_t *cur = index_block(itr);
+		if (!cur) {
+			ret = -1;
+			break;
 		}
-		
-		// Read whole block into bounce buffer
-		void *bBuf = malloc(BLOCK_SIZE);
-		if (block_read(dataBlk_index(fd), bBuf) == -1) {
-			fprintf(stderr, "Error in block reading");
-			return count - toRead; // return the number of bytes sucessfully read
+		memcpy(ent, cur, BLK_SIZE);
+		int dirty = 0;
+		for (int j = from; j < INDEX_ENTRIES; j++)
+			dirty |= ent[j] != 0;
+
+		// Kept index blocks are rewritten, so get a private copy first
+		if (i < keepBlks && dirty) {
+			int blk = blk_unshare(rootInd, prev, itr);
+			if (blk == -1) {
+				ret = -1;
+				break;
+			}
+			itr = blk;
 		}
 
-		// Copy into read buffer, with offsets in mind
-		bytesRead = BLOCK_SIZE - leftOff - rightOff;
-		memcpy((char*)buf+bufOff, (char*)bBuf+leftOff, bytesRead); // (dest, src, length in bytes)
-		
-		// Update status variables accordingly
-		filedes[fd].offset = filedes[fd].offset + bytesRead; // update file offset
-		bufOff = bufOff + bytesRead; // update read buffer offset
-		toRead = toRead - bytesRead; // update # of bytes to read
-		free(bBuf); 
-		i++;
+		for (int j = from; j < INDEX_ENTRIES; j++) {
+			if (!ent[j])
+				continue;
+			if (r->flags & FILE_BLKINDEX)
+				blk_unref(ent[j]);
+			else
+				chain_release(ent[j]);
+			ent[j] = 0;
+		}
+
+		uint16_t next = fat[itr].content;
+		if (i < keepBlks) {
+			if (dirty)
+				index_write(itr, ent);
+			if (i == keepBlks - 1)
+				fat[itr].content = FAT_EOC;
+			prev = itr;
+		} else {
+			blk_release(itr);
+		}
+		itr = next;
+	}
+	buf_put(ent, 1);
+	idxCacheBlk = 0; // may hold a released block
+	return ret;
+}
+
+/* decompress the chunk stored in the chain at first into out */
+static int chunk_read_stored(uint16_t first, char *out) {
+	char *buf = buf_get(CHUNK_BLOCKS + 1);
+	uint32_t hdr;
+
+	if (data_read(first, buf) != 0) {
+		buf_put(buf, CHUNK_BLOCKS + 1);
+		return -1;
 	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	int clen = hdr & ~CHUNK_RAW;
+	int nblk = (sizeof(hdr) + clen + BLK_SIZE - 1) / BLK_SIZE;
+	int len = -1;
+	if (clen <= CHUNK_SIZE &&
+	    chain_io(fat[first].content, buf + BLK_SIZE, nblk - 1, 0) == 0) {
+		if (hdr & CHUNK_RAW) {
+			memcpy(out, buf + sizeof(hdr), clen);
+			len = clen;
+		} else {
+			len = lz_decompress(buf + sizeof(hdr), clen, out, CHUNK_SIZE);
+		}
+	}
+	buf_put(buf, CHUNK_BLOCKS + 1);
 
-	return count - toRead; // return the number of bytes sucessfully read
+	if (len < 0) {
+		fprintf(stderr, "Corrupted compressed chunk at block %d\n", first);
+		return -1;
+	}
+	memset(out + len, 0, CHUNK_SIZE - len);
+	return 0;
 }
 
-void allocate_block(int fd){
+/* compress a dirty chunk into a new chain and point the index at it */
+static int chunk_flush(ChunkCache *cc) {
+	Root *r = &root[cc->rootInd];
+	long len = (long)r->size - (long)(cc->chunk*CHUNK_SIZE);
+	if (len > (long)CHUNK_SIZE)
+		len = CHUNK_SIZE;
+	if (len <= 0) {
+		cc->dirty = 0;
+		return 0; // nothing left of this chunk
+	}
 
-	int fdInd = filedes_index(fd);
+	// Keep the compressed form only if it actually saves space
+	char *buf = buf_get(CHUNK_BLOCKS + 1);
+	uint32_t hdr = lz_compress(cc->data, len, buf + sizeof(hdr), len - 1);
+	if (hdr == 0) {
+		memcpy(buf + sizeof(hdr), cc->data, len);
+		hdr = len | CHUNK_RAW;
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	int nblk = (sizeof(hdr) + (hdr & ~CHUNK_RAW) + BLK_SIZE - 1) / BLK_SIZE;
+
+	int first = chain_alloc(nblk);
+	if (first == -1 || chain_io(first, buf, nblk, 1) != 0) {
+		buf_put(buf, CHUNK_BLOCKS + 1);
+		if (first != -1)
+			chain_release(first);
+		return -1;
+	}
+	buf_put(buf, CHUNK_BLOCKS + 1);
+
+	int old = index_get(r, cc->chunk);
+	if (old < 0 || index_set(cc->rootInd, cc->chunk, first) != 0) {
+		chain_release(first);
+		return -1;
+	}
+	if (old)
+		chain_release(old);
+
+	cc->dirty = 0;
+	return 0;
+}
+
+/* returns the number of dirty chunks in the cache */
+static int chunk_dirty_count() {
+	int n = 0;
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++)
+		n += chunkCache[i].rootInd != -1 && chunkCache[i].dirty;
+	return n;
+}
+
+/*
+ * Get chunk c of file rootInd into the cache. If load is 0 the caller is about
+ * to overwrite the whole chunk and its current content is not read.
+ */
+static ChunkCache *chunk_get(int rootInd, int c, int load) {
+	ChunkCache *victim = NULL;
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+		ChunkCache *cc = &chunkCache[i];
+		if (cc->rootInd == rootInd && cc->chunk == c) {
+			cc->lastUse = ++chunkClock;
+			return cc;
+		}
+		if (!victim || (victim->rootInd != -1 &&
+		    (cc->rootInd == -1 || cc->lastUse < victim->lastUse)))
+			victim = cc;
+	}
+
+	if (victim->rootInd != -1 && victim->dirty && chunk_flush(victim) != 0)
+		return NULL;
+
+	victim->rootInd = -1;
+	if (!victim->data)
+		victim->data = meta_alloc(CHUNK_SIZE);
+	if (load) {
+		int first = index_get(&root[rootInd], c);
+		if (first == 0)
+			memset(victim->data, 0, CHUNK_SIZE); // never written
+		else if (first < 0 || chunk_read_stored(first, victim->data) != 0)
+			return NULL;
+	}
+	victim->rootInd = rootInd;
+	victim->chunk = c;
+	victim->dirty = 0;
+	victim->lastUse = ++chunkClock;
+	return victim;
+}
+
+/* write back (or drop, if discard) the cached chunks of file rootInd, -1 for all */
+static int chunk_flush_file(int rootInd, int discard) {
+	int ret = 0;
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+		ChunkCache *cc = &chunkCache[i];
+		if (cc->rootInd == -1 || (rootInd != -1 && cc->rootInd != rootInd))
+			continue;
+		if (!discard && cc->dirty && chunk_flush(cc) != 0)
+			ret = -1;
+		if (discard)
+			cc->rootInd = -1;
+	}
+	return ret;
+}
+
+/* fs_read() for compressed files, count is already clamped to the file size */
+static int zfile_read(int fdInd, char *buf, size_t count) {
 	int rootInd = filedes[fdInd].index;
-	uint16_t dataInd = root[rootInd].indexFirstBlock;
-	uint16_t itr = dataInd; //to go through the FAT
-	while(fat[itr].content != FAT_EOC){
-		itr = fat[itr].content;
-	} 
-	
-	int newInd;
-	if ((newInd = find_empty_fat()) == -1) { // if full, do nothing
-		return;
-	} else {
-		fat[itr].content = newInd;
-		fat[fat[itr].content].content = FAT_EOC;
+	size_t done = 0;
+	while (done < count) {
+		int off = filedes[fdInd].offset;
+		ChunkCache *cc = chunk_get(rootInd, off / CHUNK_SIZE, 1);
+		if (!cc)
+			break;
+
+		size_t n = CHUNK_SIZE - off % CHUNK_SIZE;
+		if (n > count - done)
+			n = count - done;
+		memcpy(buf + done, cc->data + off % CHUNK_SIZE, n);
+		filedes[fdInd].offset += n;
+		done += n;
 	}
-	//printf("Allocated a new block: %d\n", fat[itr].content);
+	return done;
 }
 
-int fs_write(int fd, void *buf, size_t count)
-{
-	int fdInd = filedes_index(fd);
-	if (fdInd == -1)
-		return -1; // fd invalid or not found	
+/* fs_write() for compressed files */
+static int zfile_write(int fdInd, const char *buf, size_t count) {
+	int rootInd = filedes[fdInd].index;
+	size_t done = 0;
+	while (done < count) {
+		int off = filedes[fdInd].offset;
+		int c = off / CHUNK_SIZE;
+		size_t in = off % CHUNK_SIZE;
+		size_t n = CHUNK_SIZE - in;
+		if (n > count - done)
+			n = count - done;
 
-	int bufOff = 0; // offset for buffer containing content to write
-	size_t toWrite = count; // remaining # of bytes to (try to) write
-	size_t leftOff, rightOff, bWritten; // left & right offsets, # of bytes written in the iteration
+		// Every dirty chunk must be able to land on disk uncompressed
+		int cached = 0;
+		for (int i = 0; i < CHUNK_CACHE_SIZE; i++)
+			cached |= chunkCache[i].rootInd == rootInd &&
+				  chunkCache[i].chunk == c && chunkCache[i].dirty;
+		if (!cached && num_free_fat() <
+		    (chunk_dirty_count() + 1)*(CHUNK_BLOCKS + 2))
+			break; // disk full
 
-	int i = 0; // loop iteration count 
-	while(toWrite != 0) { // more bytes to read 
-		
-		// Set left & right offsets (same as in fs_read)
-		leftOff = 0;
-		if (i == 0)
-			leftOff = filedes[fdInd].offset % BLOCK_SIZE;
+		ChunkCache *cc = chunk_get(rootInd, c, n != CHUNK_SIZE);
+		if (!cc)
+			break;
+		memcpy(cc->data + in, buf + done, n);
+		cc->dirty = 1;
+		filedes[fdInd].offset += n;
+		done += n;
+		if (filedes[fdInd].offset > root[rootInd].size)
+			root[rootInd].size = filedes[fdInd].offset;
+
+		// Appends are the common case, store chunks as soon as they fill up
+		if (in + n == CHUNK_SIZE && chunk_flush(cc) != 0)
+			break;
+	}
+	return done;
+}
 
-		rightOff = 0;
-		if (toWrite + leftOff < BLOCK_SIZE) {
-			rightOff = BLOCK_SIZE - toWrite - leftOff;
+/*
+ * Deduplicated files
+ *
+ * A deduplicated file uses the same index layout as a compressed file, with
+ * one entry per data block. Every full-block write is hashed and looked up
+ * among the blocks previously written through deduplicated files; if a block
+ * with the same content is found (compared byte for byte, hashes may collide)
+ * a reference to it is taken instead of allocating and writing a new block.
+ * Shared blocks are never modified in place: partial writes go to a private
+ * block, which is not hashed.
+ */
+
+/* returns a referenced block holding data, an existing one if possible */
+static int dedup_store(const void *data) {
+	uint32_t h = blk_hash(data);
+	dedupWrites++;
+
+	void *bBuf = buf_get(1);
+	for (uint16_t b = hashHead[h & hashMask]; b; b = hashNext[b]) {
+		if (blkHash[b] != h || refcnt[b] == 0)
+			continue;
+		if (data_read(b, bBuf) != 0)
+			continue; // never share a block failing its checksum
+		if (memcmp(bBuf, data, BLK_SIZE) == 0) {
+			buf_put(bBuf, 1);
+			refcnt[b]++;
+			dedupHits++;
+			return b;
 		}
-		
-		// Read whole block into bounce buffer
-		void *bBuf = malloc(BLOCK_SIZE);
-		if (dataBlk_index(fd) == -1) { // new block must be allocated
-			if (num_free_fat() <= 0) { // if disk is full
-				set_file_size(fd, count - toWrite);
-				return count - toWrite; // return the number of bytes sucessfully written
-			} else { // otherwise, allocate a new block
-				allocate_block(fd);	
-			}				
+	}
+	buf_put(bBuf, 1);
+
+	int b = blk_alloc();
+	if (b == -1)
+		return -1;
+	data_write(b, data);
+	hash_insert(b, h);
+	return b;
+}
+
+/* fs_read() for deduplicated and sparse files, count is already clamped */
+static int bfile_read(int fdInd, char *buf, size_t count) {
+	Root *r = &root[filedes[fdInd].index];
+	void *bBuf = buf_get(1);
+	size_t done = 0;
+	while (done < count) {
+		int off = filedes[fdInd].offset;
+		size_t in = off % BLK_SIZE;
+		size_t n = BLK_SIZE - in;
+		if (n > count - done)
+			n = count - done;
+
+		int b = index_get(r, off / BLK_SIZE);
+		if (b < 0) {
+			break;
+		} else if (b == 0) {
+			memset(buf + done, 0, n); // never written
+		} else if (n == BLK_SIZE) {
+			if (data_read(b, buf + done) != 0)
+				break;
+		} else {
+			if (data_read(b, bBuf) != 0)
+				break;
+			memcpy(buf + done, (char*)bBuf + in, n);
+		}
+		filedes[fdInd].offset += n;
+		done += n;
+	}
+	buf_put(bBuf, 1);
+	if (done == 0 && count > 0)
+		return -1; // first block failed its checksum
+	return done;
+}
+
+/* fs_write() for deduplicated and sparse files */
+static int bfile_write(int fdInd, const char *buf, size_t count) {
+	int rootInd = filedes[fdInd].index;
+	int dedup = root[rootInd].flags & FILE_DEDUP;
+	void *bBuf = buf_get(1);
+	size_t done = 0;
+	int err = 0;
+	while (done < count) {
+		int off = filedes[fdInd].offset;
+		int lblk = off / BLK_SIZE;
+		size_t in = off % BLK_SIZE;
+		size_t n = BLK_SIZE - in;
+		if (n > count - done)
+			n = count - done;
+
+		int old = index_get(&root[rootInd], lblk);
+		if (old < 0) {
+			err = 1;
+			break;
+		}
+		int b;
+		if (dedup && n == BLK_SIZE) {
+			b = dedup_store(buf + done);
+			if (b == old)
+				blk_unref(b); // same content as before
 		} else {
-			block_read(dataBlk_index(fd), bBuf);
+			const void *data = buf + done;
+			if (n != BLK_SIZE) {
+				if (old && data_read(old, bBuf) != 0) {
+					err = 1; // don't seal bad data under a fresh CRC
+					break;
+				} else if (!old) {
+					memset(bBuf, 0, BLK_SIZE); // filling a hole
+				}
+				memcpy((char*)bBuf + in, buf + done, n);
+				data = bBuf;
+			}
+
+			if (old && !blk_shared(old)) { // private, update in place
+				b = old;
+				if (blkHash && blkHash[b])
+					hash_remove(b);
+			} else {
+				b = blk_alloc();
+			}
+			if (b != -1 && data_write(b, data) != 0) {
+				if (b != old)
+					blk_unref(b);
+				err = 1;
+				break;
+			}
+		}
+		if (b == -1)
+			break; // disk full
+
+		if (b != old) {
+			if (index_set(rootInd, lblk, b) != 0) {
+				blk_unref(b);
+				break;
+			}
+			if (old)
+				blk_unref(old);
+		}
+
+		filedes[fdInd].offset += n;
+		done += n;
+		if (filedes[fdInd].offset > root[rootInd].size)
+			root[rootInd].size = filedes[fdInd].offset;
+	}
+	buf_put(bBuf, 1);
+	if (err && done == 0)
+		return -1;
+	return done;
+}
+
+int fs_dedup_stats(struct fs_dedup_stats *st)
+{
+	if (block_disk_count() == -1)
+		return -1;
+
+	memset(st, 0, sizeof(*st));
+	st->block_writes = dedupWrites;
+	st->dedup_hits = dedupHits;
+
+	int nSeen = (sblk->numDataBlocks + BLK_SIZE - 1) / BLK_SIZE;
+	uint8_t *seen = memset(buf_get(nSeen), 0, nSeen*BLK_SIZE);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if ((char)*(root[i].name) == '\0' || !(root[i].flags & FILE_DEDUP))
+			continue;
+
+		uint16_t *ent;
+		int n = index_entries(&root[i], fat, &ent);
+		if (n < 0) {
+			buf_put(seen, nSeen);
+			return -1;
+		}
+		for (int j = 0; j < n; j++) {
+			if (!ent[j])
+				continue;
+			st->logical_blocks++;
+			if (!seen[ent[j]]) {
+				seen[ent[j]] = 1;
+				st->physical_blocks++;
+			}
 		}
+		index_entries_put(ent, n);
+	}
+	buf_put(seen, nSeen);
+
+	return 0;
+}
+
+/*
+ * Checksums
+ *
+ * Once enabled on an image, every data block write records the CRC-32C of the
+ * block in a table of 32-bit entries, saved in a chain recorded in the
+ * superblock (csumIndex) like the refcount table. Reads verify the blocks
+ * they return according to the mount's policy.
+ */
+
+/* number of blocks needed to store the checksum table */
+static int csum_blocks() {
+	return (sblk->numDataBlocks*sizeof(uint32_t) + BLK_SIZE - 1) / BLK_SIZE;
+}
+
+static int wbuf_make_room(int n);
+
+static int do_csum_enable(void)
+{
+	if (block_disk_count() == -1 || readOnly)
+		return -1;
+	if (csum)
+		return 0; // already on
 
-		// write into bounce buffer, with the offsets in mind
-		bWritten = BLOCK_SIZE - leftOff - rightOff;
-		memcpy((char*)bBuf+leftOff, (char*)buf+bufOff, bWritten); // (dest, src, length in bytes)
+	int n = csum_blocks();
+	if (wbuf_make_room(n) != 0)
+		return -1;
+	int first = chain_alloc(n);
+	if (first == -1)
+		return -1;
+
+	// Checksum whatever is in use, the table itself is never verified
+	uint32_t *table = meta_alloc(n*BLK_SIZE);
+	void *bBuf = buf_get(1);
+	for (int i = 1; i < sblk->numDataBlocks; i++) {
+		if (!blk_free(i) && data_read(i, bBuf) == 0)
+			table[i] = csum_of(bBuf);
+	}
+	for (uint16_t itr = first; itr != FAT_EOC; itr = fat[itr].content)
+		table[itr] = 0;
+	buf_put(bBuf, 1);
+
+	csum = table;
+	sblk->csumIndex = first;
+	csumPolicy = FS_CSUM_ALWAYS;
+	return 0;
+}
+
+static int do_csum_policy(int policy)
+{
+	if (block_disk_count() == -1 || !csum ||
+	    policy < FS_CSUM_OFF || policy > FS_CSUM_ALWAYS)
+		return -1;
+
+	csumPolicy = policy;
+	return 0;
+}
+
+int fs_csum_stats(struct fs_csum_stats *st)
+{
+	if (block_disk_count() == -1)
+		return -1;
+
+	*st = csumStats;
+	return 0;
+}
+
+int fs_mem_stats(struct fs_mem_stats *st)
+{
+	if (block_disk_count() == -1)
+		return -1;
+
+	st->arena_bytes = mountArena.reserved;
+	st->arena_used = mountArena.used;
+	st->pool_bytes = blkPool.nbufs*blkPool.bufSize;
+	st->pool_hits = __atomic_load_n(&blkPool.hits, __ATOMIC_RELAXED);
+	st->pool_misses = __atomic_load_n(&blkPool.misses, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Packed files
+ *
+ * Files created with FS_CREATE_PACKED start out packed: their data is stored
+ * in a slot of a block shared with other small files. Root.indexFirstBlock is
+ * that block (FAT_EOC while the file is empty, so creating a file costs no
+ * data block) and Root.packSlot the first PACK_UNIT of the slot. Each packed
+ * file holds one reference on its block. A file that grows past PACK_MAX
+ * bytes migrates to a regular chain of data blocks.
+ *
+ * A pack block referenced by a snapshot is never written: the file moves to
+ * another slot instead, like any other copy-on-write block.
+ */
+#define PACK_UNIT (BLK_SIZE/64)
+#define PACK_MAX (BLK_SIZE/2)
+#define PACK_UNITS(size) (((size) + PACK_UNIT - 1) / PACK_UNIT)
+
+static uint64_t pack_mask(int slot, int units) {
+	return ((units == 64 ? 0 : 1ULL << units) - 1) << slot;
+}
 
-		block_write(dataBlk_index(fd), bBuf); // write dirty block back to disk
+/* returns the pack entry of block blk, NULL if none */
+static Pack *pack_find(uint16_t blk) {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (packs[i].blk == blk)
+			return &packs[i];
+	}
+	return NULL;
+}
+
+/* returns 1 if a snapshot also references the block of p */
+static int pack_shared(Pack *p) {
+	return refcnt && refcnt[p->blk] > p->files;
+}
+
+/* returns the first slot of a run of units free units in p, or -1 */
+static int pack_fit(Pack *p, int units) {
+	for (int slot = 0; slot + units <= 64; slot++) {
+		if (!(p->used & pack_mask(slot, units)))
+			return slot;
+	}
+	return -1;
+}
+
+/* reserve a slot of units units for file r, sets r's block and slot */
+static int pack_alloc(Root *r, int units) {
+	Pack *p = NULL;
+	int slot = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT && slot == -1; i++) {
+		if (packs[i].blk && !pack_shared(&packs[i]))
+			slot = pack_fit(p = &packs[i], units);
+	}
 
-		// Update status variables accordingly
-		filedes[fd].offset = filedes[fd].offset + bWritten; // update file offset
-		bufOff = bufOff + bWritten; // update read buffer offset
-		toWrite = toWrite - bWritten; // update # of bytes to read
-		free(bBuf); 
-		i++;
+	if (slot == -1) { // start a new pack block
+		int blk = blk_alloc();
+		if (blk == -1 || !(p = pack_find(0))) {
+			if (blk != -1)
+				blk_release(blk);
+			return -1;
+		}
+		p->blk = blk;
+		p->files = 0;
+		p->used = 0;
+		slot = 0;
+	} else if (refcnt) {
+		refcnt[p->blk]++;
 	}
 
-	set_file_size(fd, count - toWrite);
-	return count - toWrite; // return the number of bytes sucessfully written
+	p->used |= pack_mask(slot, units);
+	p->files++;
+	r->indexFirstBlock = p->blk;
+	r->packSlot = slot;
+	return 0;
+}
+
+/* give back the slot of packed file r, freeing its block with the last file */
+static void pack_free(Root *r) {
+	Pack *p;
+	if (r->indexFirstBlock == FAT_EOC || !(p = pack_find(r->indexFirstBlock)))
+		return; // empty file
+
+	p->used &= ~pack_mask(r->packSlot, PACK_UNITS(r->size));
+	if (--p->files == 0)
+		p->blk = 0;
+	if (refcnt ? --refcnt[r->indexFirstBlock] == 0 : p->files == 0)
+		fat[r->indexFirstBlock].content = 0;
+	r->indexFirstBlock = FAT_EOC;
+}
+
+/* rebuild the pack table from the root directory */
+static void pack_init() {
+	memset(packs, 0, sizeof(packs));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		Root *r = &root[i];
+		if ((char)*(r->name) == '\0')
+			continue;
+		if (!(r->flags & FILE_PACKED) || r->indexFirstBlock == FAT_EOC)
+			continue;
+		Pack *p = pack_find(r->indexFirstBlock);
+		if (!p) {
+			p = pack_find(0);
+			p->blk = r->indexFirstBlock;
+		}
+		p->used |= pack_mask(r->packSlot, PACK_UNITS(r->size));
+		p->files++;
+	}
 }
 
+/* move packed file rootInd to a regular one-block chain */
+static int file_unpack(int rootInd) {
+	Root *r = &root[rootInd];
+	int blk = blk_alloc();
+	if (blk == -1)
+		return -1;
+
+	char *bBuf = memset(buf_get(1), 0, BLK_SIZE);
+	if (r->indexFirstBlock != FAT_EOC) {
+		if (data_read(r->indexFirstBlock, bBuf) != 0) {
+			buf_put(bBuf, 1);
+			blk_release(blk);
+			return -1;
+		}
+		memmove(bBuf, bBuf + r->packSlot*PACK_UNIT, r->size);
+		memset(bBuf + r->size, 0, BLK_SIZE - r->size);
+	}
+	if (data_write(blk, bBuf) != 0) {
+		buf_put(bBuf, 1);
+		blk_release(blk);
+		return -1;
+	}
+	buf_put(bBuf, 1);
+
+	pack_free(r);
+	r->indexFirstBlock = blk;
+	r->flags &= ~FILE_PACKED;
+	chainEnd[rootInd] = (ChainEnd){ blk, 1 };
+	return 0;
+}
 
+/* fs_read() for packed files, count is already clamped to the file size */
+static int pfile_read(int fdInd, char *buf, size_t count) {
+	Root *r = &root[filedes[fdInd].index];
+	char *bBuf = buf_get(1);
+	if (data_read(r->indexFirstBlock, bBuf) != 0) {
+		buf_put(bBuf, 1);
+		return -1;
+	}
+	memcpy(buf, bBuf + r->packSlot*PACK_UNIT + filedes[fdInd].offset, count);
+	buf_put(bBuf, 1);
+	filedes[fdInd].offset += count;
+	return count;
+}
+
+/* fs_write() for packed files that stay within PACK_MAX bytes */
+static int pfile_write(int fdInd, const char *buf, size_t count) {
+	Root *r = &root[filedes[fdInd].index];
+	size_t off = filedes[fdInd].offset;
+	size_t size = off + count > r->size ? off + count : r->size;
+	if (count == 0)
+		return 0;
+
+	// Current content, shifted to the start of the buffer
+	char *bBuf = memset(buf_get(1), 0, BLK_SIZE);
+	char *data = memset(buf_get(1), 0, PACK_MAX);
+	uint16_t blk = r->indexFirstBlock;
+	if (blk != FAT_EOC) {
+		if (data_read(blk, bBuf) != 0) {
+			buf_put(bBuf, 1);
+			buf_put(data, 1);
+			return -1;
+		}
+		memcpy(data, bBuf + r->packSlot*PACK_UNIT, r->size);
+	}
+	memcpy(data + off, buf, count);
+
+	// Stay in place if the slot is private and can hold the new size
+	int units = PACK_UNITS(size);
+	Pack *p = blk == FAT_EOC ? NULL : pack_find(blk);
+	uint64_t cur = p ? pack_mask(r->packSlot, PACK_UNITS(r->size)) : 0;
+	if (p && !pack_shared(p) && r->packSlot + units <= 64 &&
+	    !(p->used & ~cur & pack_mask(r->packSlot, units))) {
+		p->used = (p->used & ~cur) | pack_mask(r->packSlot, units);
+	} else {
+		Root old = *r;
+		if (pack_alloc(r, units) != 0) {
+			buf_put(bBuf, 1);
+			buf_put(data, 1);
+			return 0; // disk full
+		}
+		// Other files may share the new block, keep their content
+		if (r->indexFirstBlock != blk &&
+		    data_read(r->indexFirstBlock, bBuf) != 0) {
+			Root nr = *r;
+			nr.size = size;
+			pack_free(&nr); // give the new slot back
+			*r = old;
+			buf_put(bBuf, 1);
+			buf_put(data, 1);
+			return -1;
+		}
+		pack_free(&old);
+		blk = r->indexFirstBlock;
+	}
+
+	memcpy(bBuf + r->packSlot*PACK_UNIT, data, size);
+	int err = data_write(blk, bBuf);
+	buf_put(bBuf, 1);
+	buf_put(data, 1);
+	if (err != 0)
+		return -1;
+
+	r->size = size;
+	filedes[fdInd].offset += count;
+	return count;
+}
+
+static int do_statfs(struct fs_statfs *st)
+{
+	// Check the presence of an underlying virtual disk
+	if (block_disk_count() == -1 || !st)
+		return -1;
+
+	st->block_size = BLK_SIZE;
+	st->total_blocks = sblk->numBlocks;
+	st->fat_blocks = sblk->numFAT;
+	st->rdir_block = sblk->rootIndex;
+	st->data_start = sblk->dataIndex;
+	st->data_blocks = sblk->numDataBlocks;
+	st->free_blocks = num_free_fat();
+	st->files = FS_FILE_MAX_COUNT - num_free_rdir();
+	st->free_files = num_free_rdir();
+	return 0;
+}
+
+static int do_info(void)
+{
+	struct fs_statfs st;
+	if (do_statfs(&st) != 0)
+		return -1;
+
+	// Printing information
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", st.total_blocks);
+	printf("fat_blk_count=%u\n", st.fat_blocks);
+	printf("rdir_blk=%u\n", st.rdir_block);
+	printf("data_blk=%u\n", st.data_start);
+	printf("data_blk_count=%u\n", st.data_blocks);
+
+	printf("fat_free_ratio=%u/%u\n", st.free_blocks, st.data_blocks);
+	printf("rdir_free_ratio=%u/%d\n", st.free_files, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+
+/*
+ * sb_init 
+ * Extract the file system information into internal (global) data struct
+ * Also perform error check
+ * Return -1 if error is found. 0 otherwise.
+ */
+int sb_init() {
+	// The block size is in the superblock, read through the smallest block
+	char head[BLOCK_SIZE_MIN];
+	Superblock *hsb = (Superblock*)head;
+	if (block_disk_block_size(BLOCK_SIZE_MIN) != 0 || block_read(0, head) != 0)
+		return -1;
+	if (strncmp((char*)(hsb->sig), "ECS150FS", 8) != 0) {
+		fprintf(stderr, "Incorrect signature\n");
+		return -1;
+	}
+	int shift = hsb->blockShift ? hsb->blockShift : 12;
+	if ((1 << shift) < BLOCK_SIZE_MIN || (1 << shift) > BLOCK_SIZE_MAX ||
+	    block_disk_block_size(1 << shift) != 0) {
+		fprintf(stderr, "Incorrect block size\n");
+		return -1;
+	}
+	blkShift = shift;
+
+	// Reading superblock (first block of the file system)
+	sblk = meta_alloc(sizeof(Superblock) > BLK_SIZE ? sizeof(Superblock) : BLK_SIZE);
+	block_read(0, sblk);
+
+	// Check if total amount of blocks is correct
+	if (sblk->numBlocks != block_disk_count()) {
+		fprintf(stderr, "Incorrect total number of blocks\n");
+		return -1;
+	}
+	
+	// Check if number of blocks for FAT is correct 
+	// uint8_t trueNumFAT = block_disk_count()*2.0/BLK_SIZE;
+	// printf("true %d, actual: %d \n", trueNumFAT, sblk->numFAT);
+	// if (sblk->numFAT != trueNumFAT) {
+	// 	fprintf(stderr, "Incorrect number of blocks for FAT\n");
+	// 	return -1;
+	// }
+
+	// Check if root index is correct
+	if (sblk->rootIndex != (sblk->numFAT + 1)) {
+		fprintf(stderr, "Incorrect root index\n");
+		return -1;
+	}
+
+	// Check if data index is correct
+	if (sblk->dataIndex != (sblk->rootIndex + root_blocks())) {
+		fprintf(stderr, "Incorrect data index\n");
+		return -1;
+	}
+
+	return 0; // No error found
+}
+
+/* read in FAT */
+int fat_init() {
+	fat = meta_alloc((sblk->numFAT)*BLK_SIZE); //get size of FAT array
+	int i;
+	for(i = 1; i <= sblk->numFAT; i++) {
+		block_read(i, (char*)fat + BLK_SIZE*(i-1));
+	}
+	
+
+	if(fat[0].content != FAT_EOC) // first entry is always invalid
+		return -1;
+
+	return 0; 
+}
+
+/* read in root */
+int root_init() {
+	root = meta_alloc(root_blocks()*BLK_SIZE);
+	block_read_n(sblk->rootIndex, root_blocks(), root);
+	root_pad_names();
+	return 0; // all good
+}
+
+/* read in the block hash table, if the image has one */
+int csum_init() {
+	memset(&csumStats, 0, sizeof(csumStats));
+	csumReads = 0;
+	csumPolicy = FS_CSUM_ALWAYS;
+	if (sblk->csumIndex == 0)
+		return 0;
+
+	uint32_t *table = meta_alloc(csum_blocks()*BLK_SIZE);
+	if (chain_io(sblk->csumIndex, table, csum_blocks(), 0) != 0) {
+		fprintf(stderr, "Corrupted checksum table\n");
+		return -1;
+	}
+	csum = table;
+	return 0;
+}
+
+int hash_init() {
+	dedupHits = dedupWrites = 0;
+	if (sblk->hashIndex == 0)
+		return 0;
+
+	blkHash = meta_alloc(hash_blocks()*BLK_SIZE);
+	if (!refcnt || chain_io(sblk->hashIndex, blkHash, hash_blocks(), 0) != 0) {
+		fprintf(stderr, "Corrupted block hash table\n");
+		return -1;
+	}
+	hash_build();
+	return 0;
+}
+
+/* read in the refcount table, if the image has one */
+int refcnt_init() {
+	if (sblk->refIndex == 0)
+		return 0;
+
+	refcnt = meta_alloc(refcnt_blocks()*BLK_SIZE);
+	if (chain_io(sblk->refIndex, refcnt, refcnt_blocks(), 0) != 0) {
+		fprintf(stderr, "Corrupted refcount table\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+int fd_init() {
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		filedes[i].id = -1;
+		filedes[i].offset = 0;
+		filedes[i].index = -1;
+		buf_put(filedes[i].wbuf, WBUF_BLOCKS);
+		filedes[i].wbuf = NULL;
+		filedes[i].wbufLen = 0;
+		filedes[i].wbufBlocks = 0;
+	}
+	wbufTotal = 0;
+	wbufReserved = 0;
+	return 0;
+}
+	
+/* drop everything allocated since the mount */
+static void mem_release() {
+	sblk = NULL;
+	fat = NULL;
+	root = NULL;
+	refcnt = NULL;
+	blkHash = NULL;
+	hashHead = hashNext = NULL;
+	csum = NULL;
+	arena_release(&mountArena);
+	memset(&blkPool, 0, sizeof(blkPool));
+}
+
+static int mount_fail() {
+	mem_release();
+	block_disk_close();
+	return -1;
+}
+
+/*
+ * Read-only mounts of a mappable disk use the tables in the disk's shared
+ * mapping instead of reading them: the superblock, the FAT and, if stored on
+ * consecutive blocks, the refcount and checksum tables. Every process
+ * mounting the image then shares them through the page cache, and the mount
+ * reads nothing but the root directory, which is copied as names are padded
+ * at mount. Block hashes only matter to writes and are not loaded; refcounts
+ * are, blocks held only by snapshots are not free.
+ */
+static int mount_shared(const char *map) {
+	sblk = (Superblock*)map;
+	fat = (FAT*)(map + BLK_SIZE);
+	if (fat[0].content != FAT_EOC)
+		return -1;
+	root_init();
+	pack_init();
+
+	uint16_t ref = sblk->refIndex;
+	if (ref != 0 && chain_is_run(ref, refcnt_blocks()))
+		refcnt = (uint16_t*)(map + (size_t)(sblk->dataIndex + ref)*BLK_SIZE);
+	else if (refcnt_init() != 0)
+		return -1;
+
+	memset(&csumStats, 0, sizeof(csumStats));
+	csumReads = 0;
+	csumPolicy = FS_CSUM_ALWAYS;
+	uint16_t first = sblk->csumIndex;
+	if (first != 0 && chain_is_run(first, csum_blocks()))
+		csum = (uint32_t*)(map + (size_t)(sblk->dataIndex + first)*BLK_SIZE);
+	else if (csum_init() != 0)
+		return -1;
+	return 0;
+}
+
+static void warm_start(const char *diskname);
+static void warm_end();
+static void warm_stop();
+
+static int do_mount(const char *diskname, int flags)
+{
+	if (flags & ~(FS_MOUNT_RDONLY | FS_MOUNT_WARM))
+		return -1;
+	if (block_disk_open_flags(diskname, flags & FS_MOUNT_RDONLY ? BLOCK_RDONLY : 0) != 0)
+		return -1; // Open failed
+
+	// Read in metadata in order
+	if (sb_init() != 0) // 1. superblock 
+		return mount_fail(); // Error checking failed
+
+	// Scratch buffers, the metadata below is read through them
+	if (pool_init(&blkPool, &mountArena, BLK_SIZE > 4096 ? BLK_SIZE : 4096) != 0)
+		return mount_fail();
+	memset(chainEnd, 0, sizeof(chainEnd));
+	const char *map = (flags & FS_MOUNT_RDONLY) ? block_disk_map() : NULL;
+	if (map) {
+		if (mount_shared(map) != 0)
+			return mount_fail();
+	} else {
+		if (fat_init() != 0) // 2. FAT
+			return mount_fail();
+		root_init(); // 3. root directory
+		pack_init();
+		if (refcnt_init() != 0) // 4. block refcounts
+			return mount_fail();
+		if (!(flags & FS_MOUNT_RDONLY) && hash_init() != 0) // 5. block hashes
+			return mount_fail();
+		if (csum_init() != 0) // 6. block checksums
+			return mount_fail();
+	}
+
+	// initialize file descriptors
+	fd_init();
+	chunk_cache_init();
+
+	readOnly = flags & FS_MOUNT_RDONLY;
+	if (flags & FS_MOUNT_WARM)
+		warm_start(diskname);
+	return 0;
+}
+
+int fs_format(const char *diskname, size_t block_size)
+{
+	if (sblk || block_disk_open(diskname) != 0)
+		return -1; // mounted, or cannot open
+	if (block_disk_block_size(block_size) != 0) {
+		block_disk_close();
+		return -1;
+	}
+	int shift = 0;
+	while (((size_t)1 << shift) < block_size)
+		shift++;
+	blkShift = shift;
+
+	// The FAT has an entry per data block, whatever is left after it
+	int total = block_disk_count(), numFAT, numData = 0;
+	for (numFAT = 1; numFAT <= UINT8_MAX; numFAT++) {
+		numData = total - 1 - numFAT - root_blocks();
+		if (numData * sizeof(FAT) <= numFAT*BLK_SIZE)
+			break;
+	}
+	if (total > UINT16_MAX || numFAT > UINT8_MAX || numData < 1) {
+		block_disk_close();
+		return -1;
+	}
+
+	size_t sbSize = sizeof(Superblock) > BLK_SIZE ? sizeof(Superblock) : BLK_SIZE;
+	Superblock *sb = calloc(1, sbSize);
+	memcpy(sb->sig, "ECS150FS", 8);
+	sb->numBlocks = total;
+	sb->numFAT = numFAT;
+	sb->rootIndex = numFAT + 1;
+	sb->dataIndex = sb->rootIndex + root_blocks();
+	sb->numDataBlocks = numData;
+	sb->blockShift = shift == 12 ? 0 : shift; // as the reference tools do
+	FAT *table = calloc(numFAT, BLK_SIZE);
+	table[0].content = FAT_EOC;
+	char *dir = calloc(root_blocks(), BLK_SIZE);
+
+	int ret = block_write(0, sb) || block_write_n(1, numFAT, table) ||
+		  block_write_n(sb->rootIndex, root_blocks(), dir) ? -1 : 0;
+	free(dir);
+	free(table);
+	free(sb);
+	if (block_disk_close() != 0)
+		ret = -1;
+	return ret;
+}
+
+static int fd_flush(int fdInd);
+static void fd_drop(int fdInd);
+static int file_flush(int rootInd, int skip);
+static int file_size(int rootInd);
+
+static int do_sync(void)
+{
+	if (block_disk_count() == -1 || readOnly)
+		return -1;
+
+	int ret = 0;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fd_flush(i) != 0)
+			ret = -1;
+	}
+	if (chunk_flush_file(-1, 0) != 0)
+		ret = -1;
+
+	// Write back to disk the meta-information
+	block_write(0, sblk);
+
+	int i;
+	for(i = 1; i <= sblk->numFAT; i++) {
+		block_write(i, (char*)fat + BLK_SIZE*(i-1));
+	} // fat
+
+	// root directory
+	block_write_n(sblk->rootIndex, root_blocks(), root);
+
+	if (blkHash)
+		chain_io(sblk->hashIndex, blkHash, hash_blocks(), 1);
+	if (refcnt)
+		chain_io(sblk->refIndex, refcnt, refcnt_blocks(), 1);
+	if (csum) {
+		// Written from a copy, the table must not change while written
+		uint32_t *table = buf_get(csum_blocks());
+		memcpy(table, csum, csum_blocks()*BLK_SIZE);
+		chain_io(sblk->csumIndex, table, csum_blocks(), 1);
+		buf_put(table, csum_blocks());
+	}
+
+	return ret;
+}
+
+static void ckpt_reset();
+
+static int do_umount(void)
+{
+	if (readOnly) {
+		// Snapshots and read-only mounts have nothing to write back
+		readOnly = 0;
+		warm_end();
+		fd_init();
+		chunk_cache_init();
+		mem_release();
+		return block_disk_close();
+	}
+
+	// Buffered data and compressed chunks allocate blocks when stored. If
+	// they cannot be, the file system is unmounted all the same.
+	ckpt_reset();
+	int ret = do_sync();
+	warm_end();
+	fd_init();
+	chunk_cache_init();
+
+	// Metadata tables and buffers all live in the mount's arena
+	mem_release();
+
+	if (block_disk_close() != 0)
+		return -1; // Close failed
+
+	return ret;
+}
+
+/* helper function to check valid filename */
+int valid_filename(const char *filename){
+	char bad_chars[] = "!@%^*~|";
+	for (int i = 0; i < strlen(bad_chars); i++) {
+		if(strchr(filename, bad_chars[i]) != NULL)
+			return -1;
+	} //check valid filename
+	
+	return 0;
+}
+
+
+static int do_create_flags(const char *filename, int flags)
+{
+	if (readOnly)
+		return -1;
+
+	int indexed = FS_CREATE_COMPRESSED | FS_CREATE_DEDUP | FS_CREATE_SPARSE;
+	int layouts = flags & (indexed | FS_CREATE_PACKED);
+	if (layouts & (layouts - 1))
+		return -1; // layouts are exclusive
+
+	if(strlen(filename)*sizeof(char) >= FS_FILENAME_LEN || *filename == '\0') 
+		return -1; //filename too long (or empty)
+
+	if(valid_filename(filename) == -1)
+		return -1;
+
+	if (root_find(filename) != -1) // filename already exists;
+		return -1; 	
+
+	// The index block, and the hash table, must not take buffered data's room
+	if ((flags & indexed) &&
+	    wbuf_make_room(1 + (blkHash ? 0 : hash_blocks())) != 0)
+		return -1;
+
+	if ((flags & FS_CREATE_DEDUP) && !blkHash && hash_enable() != 0)
+		return -1; // no room for the hash table
+
+	int k;
+	for(k = 0; k < FS_FILE_MAX_COUNT; k++) {
+		if((char) *(root[k].name) == '\0') { //empty entry 
+			root[k].size = 0; 
+			root[k].indexFirstBlock = FAT_EOC; // no data yet
+			root[k].flags = (flags & FS_CREATE_PACKED) ? FILE_PACKED : 0;
+			root[k].packSlot = 0;
+			chainEnd[k].len = 0;
+			if (flags & indexed) {
+				// the first block is an empty index
+				int first = blk_alloc();
+				if (first == -1)
+					return -1; // disk full
+				root[k].indexFirstBlock = first;
+				void *zero = memset(buf_get(1), 0, BLK_SIZE);
+				data_write(first, zero);
+				buf_put(zero, 1);
+				root[k].flags = (flags & FS_CREATE_DEDUP) ? FILE_DEDUP :
+						(flags & FS_CREATE_SPARSE) ? FILE_SPARSE :
+						FILE_COMPRESSED;
+			}
+			memset(root[k].name, 0, FS_FILENAME_LEN);
+			strcpy((char*) root[k].name, filename);
+			break;
+		}
+	}
+
+	if(k == FS_FILE_MAX_COUNT) // no empty entries
+		return -1;
+
+	return 0;
+}
+
+static int do_delete(const char *filename)
+{
+	if (readOnly)
+		return -1;
+
+	if(valid_filename(filename) == -1)
+		return -1;
+
+	int j = root_find(filename);
+	if(j == -1)
+		return -1; //file not found
+
+	*(root[j].name) = (int) '\0'; // just clear the name
+	chainEnd[j].len = 0;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (filedes[i].index == j) // drop buffered writes
+			fd_drop(i);
+	}
+	chunk_flush_file(j, 1);
+	file_release(&root[j]); //clear FAT blocks
+	
+	return 0;
+}
+
+static int do_ls(void)
+{
+	//check underlying virtual disk
+	if (block_disk_count() == -1)
+		return -1;
+
+	printf("FS Ls:\n");
+	int i;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if((char)*(root[i].name) != '\0') //if name not empty
+			printf("file: %s, size: %d, data_blk: %d\n", root[i].name, file_size(i), root[i].indexFirstBlock); //print it out
+	}
+
+	return 0;
+}
+
+/* describe file rootInd in ent */
+static void dirent_fill(int rootInd, struct fs_dirent *ent) {
+	memcpy(ent->name, root[rootInd].name, FS_FILENAME_LEN);
+	ent->name[FS_FILENAME_LEN - 1] = '\0';
+	ent->size = file_size(rootInd);
+	ent->first_blk = root[rootInd].indexFirstBlock;
+	ent->blocks = file_blocks(&root[rootInd]);
+}
+
+static int do_readdir(struct fs_dirent *ents, int max)
+{
+	//check underlying virtual disk
+	if (block_disk_count() == -1)
+		return -1;
+
+	int n = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT && n < max; i++) {
+		if((char)*(root[i].name) == '\0') // skip empty entries
+			continue;
+		dirent_fill(i, &ents[n++]);
+	}
+
+	return n;
+}
+
+static int do_stat_name(const char *filename, struct fs_dirent *ent)
+{
+	if (block_disk_count() == -1 || !filename)
+		return -1;
+
+	int rootInd = root_find(filename);
+	if (rootInd == -1)
+		return -1; // no such file
+	if (ent)
+		dirent_fill(rootInd, ent);
+	return file_size(rootInd);
+}
+
+static int do_open(const char *filename, int flags)
+{
+	if(valid_filename(filename) == -1 || (flags & ~FS_OPEN_APPEND))
+		return -1;
+
+	if (numFilesOpen > FS_OPEN_MAX_COUNT)
+		return -1; //too many files open
+	
+	int j = root_find(filename);
+	if (j == -1)
+		return -1; //file not found	
+
+	// iterate through file descriptors to find empty entry
+	for(int k = 0; k < FS_OPEN_MAX_COUNT; k++){ 
+		
+		if(filedes[k].id == -1) { // if empty
+
+			// initialize variables
+			filedes[k].id = idCount;
+			filedes[k].index = j;
+			filedes[k].offset = 0;
+			filedes[k].flags = flags;
+
+			idCount++;
+			numFilesOpen++;
+			
+			return filedes[k].id;
+		}	
+	}
+	return -1; //too many files open
+}
+
+
+static int do_close(int fd)
+{
+	if (fd > idCount || fd < 0)
+		return -1; //invalid fd
+
+	int i;
+	for(i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(filedes[i].id == fd){ //found fd
+			int ret = fd_flush(i);
+			if (root[filedes[i].index].flags & FILE_COMPRESSED)
+				chunk_flush_file(filedes[i].index, 0);
+			fd_drop(i); // whatever could not be written is lost
+			buf_put(filedes[i].wbuf, WBUF_BLOCKS);
+			filedes[i].wbuf = NULL;
+			filedes[i].id = -1;
+			filedes[i].offset = 0;
+			filedes[i].index = -1;
+			numFilesOpen--;
+			return ret;
+		}
+	}
+	return -1; // file not found	
+}
+
+static int do_stat(int fd)
+{
+	if (fd > idCount || fd < 0)
+		return -1; //invalid fd
+
+	int i;
+	for (i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(filedes[i].id == fd) //found fd
+			return file_size(filedes[i].index);
+	}
+	return -1; // fd not found
+}
+
+static int do_lseek(int fd, size_t offset)
+{
+	int size = do_stat(fd);
+	if(size == -1 || offset > INT_MAX)
+		return -1; // seeking past the end is fine, writing there leaves a hole
+
+	int i;
+	for(i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(filedes[i].id == fd){ //found fd
+			filedes[i].offset = offset;
+			return 0;
+		}
+	}
+	return -1; // file not found	
+}
+
+
+/* Return the index of the entry in filedes corresponding to fd */
+int filedes_index(int fd)
+{
+	if (fd > idCount || fd < 0)
+		return -1; //invalid fd
+
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(filedes[i].id == fd){ //found fd
+			return i;	
+		}
+	}
+	return -1; // fd not found
+}
+
+/* Extend the file corresponding to the specified file descriptor up to its offset */
+void set_file_size(int fd) {
+	int fdInd = filedes_index(fd); // get filedes index 
+	int rootInd = filedes[fdInd].index; // get root dir index
+	if (filedes[fdInd].offset > root[rootInd].size)
+		root[rootInd].size = filedes[fdInd].offset;
+}
+
+
+/*
+ * Vectored I/O
+ *
+ * Reads and writes move data between the file and an array of iovecs, walked
+ * with an IovCur. fs_read() and fs_write() are the single-iovec case.
+ */
+
+/* scratch space of chain_readv(), in blocks */
+#define STAGE_BLOCKS 16
+
+typedef struct IovCur {
+	const struct iovec *iov;
+	int cnt;
+	int i; // current iovec
+	size_t off; // offset in the current iovec
+}IovCur;
+
+/* skip exhausted iovecs, returns the number of bytes left in the current one */
+static size_t iov_avail(IovCur *c) {
+	while (c->i < c->cnt && c->off == c->iov[c->i].iov_len) {
+		c->i++;
+		c->off = 0;
+	}
+	return c->i < c->cnt ? c->iov[c->i].iov_len - c->off : 0;
+}
+
+static char *iov_ptr(IovCur *c) {
+	return (char*)c->iov[c->i].iov_base + c->off;
+}
+
+/* copy n bytes of mem to the iovecs (out) or from them, advancing the cursor */
+static void iov_copy(IovCur *c, char *mem, size_t n, int out) {
+	while (n > 0) {
+		size_t k = iov_avail(c);
+		if (k > n)
+			k = n;
+		if (out)
+			memcpy(iov_ptr(c), mem, k);
+		else
+			memcpy(mem, iov_ptr(c), k);
+		c->off += k;
+		mem += k;
+		n -= k;
+	}
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+/*
+ * Read count bytes of chain file rootInd at offset off into the iovecs of c.
+ * The chain is walked once from the offset, and runs of consecutive blocks
+ * are read in a single operation, straight into the caller's memory when it
+ * lines up with the blocks. Only reads the file system's state.
+ */
+static int chain_readv(int rootInd, int off, IovCur *c, size_t count) {
+	uint16_t blk = root[rootInd].indexFirstBlock;
+	for (int i = off / BLK_SIZE; i > 0 && blk != FAT_EOC; i--)
+		blk = fat[blk].content;
+
+	char *stage = buf_get(STAGE_BLOCKS);
+	size_t done = 0;
+	while (done < count && blk != FAT_EOC) {
+		size_t in = (off + done) % BLK_SIZE;
+		int want = (in + count - done + BLK_SIZE - 1) / BLK_SIZE;
+		int run = 1;
+		uint16_t next = fat[blk].content;
+		while (run < want && run < STAGE_BLOCKS && next == blk + run) {
+			next = fat[next].content;
+			run++;
+		}
+
+		size_t n = run*BLK_SIZE - in;
+		if (n > count - done)
+			n = count - done;
+		int direct = in == 0 && n == run*BLK_SIZE && iov_avail(c) >= n;
+		if (data_read_n(blk, run, direct ? iov_ptr(c) : stage) != 0) {
+			fprintf(stderr, "Error in block reading\n");
+			break;
+		}
+		if (direct)
+			c->off += n;
+		else
+			iov_copy(c, stage + in, n, 1);
+
+		done += n;
+		blk = next;
+	}
+	buf_put(stage, STAGE_BLOCKS);
+
+	if (done == 0 && count > 0)
+		return -1; // nothing could be read
+	return done;
+}
+
+/* returns count, shortened so that reading at off stops at the end of file rootInd */
+static size_t read_clamp(int rootInd, size_t off, size_t count) {
+	if (off >= root[rootInd].size)
+		return 0;
+	if (count > root[rootInd].size - off)
+		count = root[rootInd].size - off;
+	return count;
+}
+
+/* fs_read() into iovcnt iovecs at the offset of filedes entry fdInd */
+static int file_readv(int fdInd, const struct iovec *iov, int iovcnt) {
+	// Buffered writes must be visible
+	int rootInd = filedes[fdInd].index;
+	if (file_flush(rootInd, -1) != 0)
+		return -1;
+
+	size_t count = read_clamp(rootInd, filedes[fdInd].offset,
+				  iov_total(iov, iovcnt));
+	if (count == 0)
+		return 0;
+
+	if (!(root[rootInd].flags & (FILE_INDEXED | FILE_PACKED))) {
+		IovCur c = { iov, iovcnt, 0, 0 };
+		int ret = chain_readv(rootInd, filedes[fdInd].offset, &c, count);
+		if (ret > 0)
+			filedes[fdInd].offset += ret;
+		return ret;
+	}
+
+	// Other layouts read one iovec at a time
+	if (iovcnt > 1) {
+		size_t done = 0;
+		for (int i = 0; i < iovcnt && done < count; i++) {
+			int ret = file_readv(fdInd, &iov[i], 1);
+			if (ret < 0)
+				return done ? done : -1;
+			done += ret;
+			if (ret < iov[i].iov_len)
+				break; // end of file
+		}
+		return done;
+	}
+
+	char *buf = iov[0].iov_base;
+	if (root[rootInd].flags & FILE_COMPRESSED)
+		return zfile_read(fdInd, buf, count);
+	if (root[rootInd].flags & FILE_BLKINDEX)
+		return bfile_read(fdInd, buf, count);
+	return pfile_read(fdInd, buf, count);
+}
+
+static int do_read(int fd, void *buf, size_t count)
+{	
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1)
+		return -1; // fd invalid or not found
+
+	struct iovec iov = { buf, count };
+	return file_readv(fdInd, &iov, 1);
+}
+
+static int do_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1 || iovcnt < 0)
+		return -1; // fd invalid or not found
+
+	return file_readv(fdInd, iov, iovcnt);
+}
+
+int fs_pread_shareable(int fd)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1)
+		return 0;
+
+	int rootInd = filedes[fdInd].index;
+	if (root[rootInd].flags & (FILE_INDEXED | FILE_PACKED))
+		return 0; // caches, or the descriptor's offset, are updated
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (filedes[i].index == rootInd && filedes[i].wbufLen)
+			return 0; // to be flushed first
+	}
+	return 1;
+}
+
+static int do_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1 || offset > INT_MAX)
+		return -1; // fd invalid or not found
+
+	// Plain files are read without touching any state
+	struct iovec iov = { buf, count };
+	if (fs_pread_shareable(fd)) {
+		IovCur c = { &iov, 1, 0, 0 };
+		count = read_clamp(filedes[fdInd].index, offset, count);
+		return count ? chain_readv(filedes[fdInd].index, offset, &c, count) : 0;
+	}
+
+	// The descriptor's offset is only borrowed
+	int saved = filedes[fdInd].offset;
+	filedes[fdInd].offset = offset;
+	int ret = file_readv(fdInd, &iov, 1);
+	filedes[fdInd].offset = saved;
+	return ret;
+}
+
+/*
+ * Zero-copy mapping
+ *
+ * fs_map() points into the read-only mapping of the disk (block_disk_map())
+ * instead of copying. Pieces of the file are added one block at a time, and
+ * merged when they follow each other in memory.
+ */
+
+static int do_unmap(struct fs_map *map);
+
+/* what holes of sparse files map to */
+static char zeroBlk[BLOCK_SIZE_MAX];
+
+/* add n bytes at addr to map, which has room for cap segments */
+static int map_add(struct fs_map *map, const char *addr, size_t n, int cap) {
+	if (map->nsegs == 0) {
+		map->addr = addr;
+		map->nsegs = 1;
+	} else if (!map->segs && (const char*)map->addr + map->len != addr) {
+		// No longer contiguous, switch to segments
+		map->segs = malloc(cap * sizeof(*map->segs));
+		if (!map->segs)
+			return -1;
+		map->segs[0] = (struct fs_seg){ map->addr, map->len };
+		map->segs[1] = (struct fs_seg){ addr, n };
+		map->addr = NULL;
+		map->nsegs = 2;
+	} else if (map->segs) {
+		struct fs_seg *last = &map->segs[map->nsegs - 1];
+		if ((const char*)last->addr + last->len == addr)
+			last->len += n;
+		else
+			map->segs[map->nsegs++] = (struct fs_seg){ addr, n };
+	}
+	map->len += n;
+	return 0;
+}
+
+static int do_map(int fd, size_t offset, size_t len, struct fs_map *map)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1 || !map || offset > INT_MAX)
+		return -1; // fd invalid or not found
+	memset(map, 0, sizeof(*map));
+
+	int rootInd = filedes[fdInd].index;
+	Root *r = &root[rootInd];
+	if (r->flags & FILE_COMPRESSED)
+		return -1; // not stored as is
+	const char *data = block_disk_map();
+	if (!data || file_flush(rootInd, -1) != 0)
+		return -1;
+	data += (size_t)sblk->dataIndex * BLK_SIZE;
+	len = read_clamp(rootInd, offset, len);
+	if (len == 0)
+		return 0;
+
+	if (r->flags & FILE_PACKED) {
+		const char *blk = data + r->indexFirstBlock*BLK_SIZE;
+		if (csum_check(r->indexFirstBlock, 1, blk) != 0)
+			return -1;
+		return map_add(map, blk + r->packSlot*PACK_UNIT + offset, len, 1);
+	}
+
+	// Chain files are walked once, block-indexed ones looked up per block
+	int cap = (offset % BLK_SIZE + len + BLK_SIZE - 1) / BLK_SIZE;
+	uint16_t blk = r->indexFirstBlock;
+	if (!(r->flags & FILE_BLKINDEX)) {
+		for (int i = offset / BLK_SIZE; i > 0 && blk != FAT_EOC; i--)
+			blk = fat[blk].content;
+	}
+	for (size_t done = 0; done < len; ) {
+		size_t off = offset + done;
+		size_t in = off % BLK_SIZE;
+		size_t n = BLK_SIZE - in;
+		if (n > len - done)
+			n = len - done;
+
+		if (r->flags & FILE_BLKINDEX)
+			blk = index_get(r, off / BLK_SIZE);
+		else if (blk == FAT_EOC)
+			break;
+
+		const char *p = zeroBlk; // never written
+		if (blk != 0) {
+			p = data + blk*BLK_SIZE;
+			if (csum_check(blk, 1, p) != 0)
+				break;
+		}
+		if (map_add(map, p + in, n, cap) != 0)
+			break;
+		if (!(r->flags & FILE_BLKINDEX))
+			blk = fat[blk].content;
+		done += n;
+	}
+
+	if (map->len < len) {
+		do_unmap(map);
+		return -1;
+	}
+	return 0;
+}
+
+static int do_unmap(struct fs_map *map)
+{
+	if (!map)
+		return -1;
+
+	free(map->segs);
+	memset(map, 0, sizeof(*map));
+	return 0;
+}
+
+/*
+ * Write count bytes of buf at the offset of filedes entry fdInd, which is
+ * right after the last block of its (chain) file. The new blocks are
+ * allocated together, on consecutive blocks if possible, and written in one
+ * batch. Returns the number of bytes written.
+ */
+static size_t chain_append(int fdInd, const char *buf, size_t count) {
+	int rootInd = filedes[fdInd].index;
+	int n = (count + BLK_SIZE - 1) / BLK_SIZE;
+	int nFree = num_free_fat();
+	if (n > nFree) { // write what fits
+		n = nFree;
+		count = n*BLK_SIZE;
+	}
+	int first = chain_alloc_run(n);
+	if (first == -1)
+		return 0; // disk full
+
+	uint16_t prev = FAT_EOC, last = first;
+	for (int i = 1; i < n; i++) {
+		prev = last;
+		last = fat[last].content;
+	}
+
+	// Whole blocks go out from buf, the last partial one is padded
+	int full = count / BLK_SIZE;
+	if (chain_io(first, (void*)buf, full, 1) != 0) {
+		chain_release(first);
+		return 0;
+	}
+	if (full < n) {
+		size_t rem = count % BLK_SIZE;
+		char *bBuf = buf_get(1);
+		memcpy(bBuf, buf + full*BLK_SIZE, rem);
+		memset(bBuf + rem, 0, BLK_SIZE - rem);
+		int err = data_write(last, bBuf);
+		buf_put(bBuf, 1);
+		if (err != 0 && full == 0) {
+			chain_release(first);
+			return 0;
+		} else if (err != 0) { // keep the whole blocks
+			fat[prev].content = FAT_EOC;
+			chain_release(last);
+			last = prev;
+			n = full;
+			count = full*BLK_SIZE;
+		}
+	}
+
+	uint16_t tail;
+	int len = chain_end(rootInd, &tail);
+	if (len == 0) // empty file
+		root[rootInd].indexFirstBlock = first;
+	else
+		fat[tail].content = first;
+	chainEnd[rootInd] = (ChainEnd){ last, len + n };
+
+	filedes[fdInd].offset += count;
+	return count;
+}
+
+static int file_extend(int fdInd, size_t length);
+
+/* fs_write() without the write buffer */
+static int file_write(int fdInd, const char *buf, size_t count)
+{
+	int fd = filedes[fdInd].id;
+
+	// Fill the gap if writing past the end of the file
+	if (filedes[fdInd].offset > root[filedes[fdInd].index].size &&
+	    file_extend(fdInd, filedes[fdInd].offset) != 0)
+		return 0;
+
+	if (root[filedes[fdInd].index].flags & FILE_COMPRESSED)
+		return zfile_write(fdInd, buf, count);
+	if (root[filedes[fdInd].index].flags & FILE_BLKINDEX)
+		return bfile_write(fdInd, buf, count);
+	if (root[filedes[fdInd].index].flags & FILE_PACKED) {
+		if (filedes[fdInd].offset + count <= PACK_MAX)
+			return pfile_write(fdInd, buf, count);
+		if (file_unpack(filedes[fdInd].index) != 0)
+			return 0; // disk full
+	}
+
+	// Blocks past the end of the chain are allocated by chain_append()
+	int rootInd = filedes[fdInd].index;
+	uint16_t tail;
+	int len = chain_end(rootInd, &tail);
+	size_t inChain = len*BLK_SIZE - filedes[fdInd].offset;
+	size_t count1 = count < inChain ? count : inChain;
+
+	// Overwrite the blocks in the chain, walked once from the offset. Appends
+	// start from the cached tail instead (prev only matters for unsharing).
+	uint16_t prev = FAT_EOC;
+	uint16_t cur = root[rootInd].indexFirstBlock;
+	if (count1 == 0) {
+		cur = FAT_EOC;
+	} else if (filedes[fdInd].offset / BLK_SIZE == len - 1 && !blk_shared(tail)) {
+		cur = tail;
+	} else {
+		for (int off = filedes[fdInd].offset; off >= BLK_SIZE; off -= BLK_SIZE) {
+			prev = cur;
+			cur = fat[cur].content;
+		}
+	}
+
+	void *bBuf = buf_get(1); // bounce buffer for partial blocks
+	size_t done = 0;
+	int err = 0;
+	while (done < count1) {
+		size_t in = filedes[fdInd].offset % BLK_SIZE;
+		size_t n = BLK_SIZE - in;
+		if (n > count1 - done)
+			n = count1 - done;
+
+		// Partial blocks are merged with their current content
+		const void *src = buf + done;
+		if (n != BLK_SIZE) {
+			if (data_read(cur, bBuf) != 0) {
+				err = 1; // don't seal bad data under a fresh CRC
+				break;
+			}
+			memcpy((char*)bBuf + in, src, n);
+			src = bBuf;
+		}
+
+		// Blocks shared with a snapshot are copied first
+		if (refcnt) {
+			int blk = blk_unshare(rootInd, prev, cur);
+			if (blk == -1)
+				break; // no room for a private copy
+			cur = blk;
+		}
+
+		// Whole private blocks following cur on disk go out with it
+		int run = 1;
+		uint16_t next = fat[cur].content;
+		while (n == BLK_SIZE && (run + 1)*BLK_SIZE <= count1 - done &&
+		       next == cur + run && (!refcnt || refcnt[next] <= 1)) {
+			next = fat[next].content;
+			run++;
+		}
+		if (data_write_n(cur, run, src) != 0) {
+			err = 1;
+			break;
+		}
+
+		n = run > 1 ? run*BLK_SIZE : n;
+		filedes[fdInd].offset += n;
+		done += n;
+		prev = cur + run - 1;
+		cur = next;
+	}
+	buf_put(bBuf, 1);
+
+	size_t written = done;
+	if (done == count1 && count > count1)
+		written += chain_append(fdInd, (const char*)buf + count1, count - count1);
+
+	set_file_size(fd);
+	if (err && written == 0)
+		return -1;
+	return written; // return the number of bytes sucessfully written
+}
+
+
+
+/*
+ * Write buffering
+ *
+ * Small writes are collected in a per-descriptor buffer holding one
+ * contiguous dirty range, and only reach file_write() (and thus allocate
+ * blocks) when the buffer fills up, when a write does not extend the range,
+ * when the file is read, truncated or closed, or on fs_sync(). Appending one
+ * byte at a time thus costs a few block writes per WBUF_SIZE bytes instead of
+ * a read and a write per call.
+ */
+
+/*
+ * Data blocks that writing back len bytes buffered at offset start of file
+ * rootInd may allocate. Every block of the range counts, even one the file
+ * already has: it may be shared with a snapshot, or be the file's pack slot.
+ * Indexed files may also need the index blocks up to the end of the range.
+ */
+static int wbuf_blocks(int rootInd, int start, int len) {
+	if (len == 0)
+		return 0;
+	int end = (start + len + BLK_SIZE - 1) / BLK_SIZE;
+	int n = end - start / BLK_SIZE;
+	if (root[rootInd].flags & FILE_BLKINDEX)
+		n += end / INDEX_ENTRIES + 1;
+	return n;
+}
+
+/* forget the buffered data of filedes entry fdInd */
+static void fd_drop(int fdInd) {
+	FD *f = &filedes[fdInd];
+	wbufTotal -= f->wbufLen;
+	wbufReserved -= f->wbufBlocks;
+	f->wbufLen = 0;
+	f->wbufBlocks = 0;
+}
+
+/*
+ * write the buffered data of filedes entry fdInd to the file. On a short
+ * write, what was not written stays in the buffer.
+ */
+static int fd_flush(int fdInd) {
+	FD *f = &filedes[fdInd];
+	if (f->wbufLen == 0)
+		return 0;
+
+	int offset = f->offset;
+	int len = f->wbufLen;
+	f->offset = f->wbufStart;
+	int ret = file_write(fdInd, f->wbuf, len);
+	f->offset = offset;
+	if (ret == len) {
+		fd_drop(fdInd);
+		return 0;
+	}
+
+	if (ret > 0) { // keep the rest, with its reservation
+		memmove(f->wbuf, f->wbuf + ret, len - ret);
+		f->wbufStart += ret;
+		f->wbufLen -= ret;
+		wbufTotal -= ret;
+		int n = wbuf_blocks(f->index, f->wbufStart, f->wbufLen);
+		wbufReserved += n - f->wbufBlocks;
+		f->wbufBlocks = n;
+	}
+	return -1; // disk full
+}
+
+/* flush every buffer if taking n more blocks would eat into their reservations */
+static int wbuf_make_room(int n) {
+	if (wbufReserved == 0 || num_free_fat() >= wbufReserved + n)
+		return 0;
+	int ret = 0;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fd_flush(i) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+/* flush the buffers of every descriptor of file rootInd but filedes entry skip */
+static int file_flush(int rootInd, int skip) {
+	int ret = 0;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (i != skip && filedes[i].index == rootInd && fd_flush(i) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+/* returns the size of file rootInd, counting buffered writes */
+static int file_size(int rootInd) {
+	int size = root[rootInd].size;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		FD *f = &filedes[i];
+		if (f->index == rootInd && f->wbufLen && f->wbufStart + f->wbufLen > size)
+			size = f->wbufStart + f->wbufLen;
+	}
+	return size;
+}
+
+static int do_write(int fd, void *buf, size_t count)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1 || readOnly)
+		return -1; // fd invalid or not found	
+
+	FD *f = &filedes[fdInd];
+	if (count == 0)
+		return 0;
+
+	// Other descriptors' buffers may overlap, keep writes in order
+	if (file_flush(f->index, fdInd) != 0)
+		return -1;
+	if (f->flags & FS_OPEN_APPEND)
+		f->offset = file_size(f->index);
+
+	// Only a contiguous range is buffered
+	if (f->wbufLen && (f->offset < f->wbufStart ||
+	    f->offset > f->wbufStart + f->wbufLen ||
+	    f->offset + count - f->wbufStart > WBUF_SIZE) && fd_flush(fdInd) != 0)
+		return -1;
+
+	int start = f->wbufLen ? f->wbufStart : f->offset;
+	int grow = f->offset + count - (start + f->wbufLen);
+	if (grow < 0)
+		grow = 0;
+
+	// Compressed files have their own cache, large writes need no buffer.
+	// Neither do writes past the end: filling the hole may take index blocks.
+	if ((root[f->index].flags & FILE_COMPRESSED) || count >= WBUF_SIZE ||
+	    start > root[f->index].size ||
+	    (!f->wbuf && !(f->wbuf = buf_get(WBUF_BLOCKS))))
+		goto direct;
+
+	// Memory pressure: make room by flushing everything
+	if (wbufTotal + grow > WBUF_TOTAL) {
+		for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+			if (fd_flush(i) != 0)
+				return -1;
+		}
+		start = f->offset;
+		grow = count;
+	}
+
+	// Growing the range must not promise more blocks than the disk holds
+	int need = wbuf_blocks(f->index, start, f->wbufLen + grow);
+	if (need > f->wbufBlocks &&
+	    num_free_fat() < wbufReserved - f->wbufBlocks + need)
+		goto direct;
+
+	f->wbufStart = start;
+	memcpy(f->wbuf + f->offset - start, buf, count);
+	f->wbufLen += grow;
+	wbufTotal += grow;
+	wbufReserved += need - f->wbufBlocks;
+	f->wbufBlocks = need;
+	f->offset += count;
+
+	if (f->wbufLen == WBUF_SIZE && fd_flush(fdInd) != 0)
+		return -1;
+	return count;
+
+direct:
+	// Buffered data was promised its blocks first, plain files also fill
+	// the gap up to the offset
+	start = f->offset;
+	if (start > root[f->index].size && !(root[f->index].flags & FILE_INDEXED))
+		start = root[f->index].size;
+	need = wbuf_blocks(f->index, start, f->offset + count - start);
+	if (fd_flush(fdInd) != 0 || wbuf_make_room(need) != 0)
+		return -1;
+	return file_write(fdInd, buf, count);
+}
+
+static int do_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (filedes_index(fd) == -1 || iovcnt < 0 || readOnly)
+		return -1; // fd invalid or not found
+	if (iovcnt == 1)
+		return do_write(fd, iov[0].iov_base, iov[0].iov_len);
+
+	// Small iovecs are gathered into pieces of the write buffer's size, so
+	// that each piece is a single fs_write()
+	IovCur c = { iov, iovcnt, 0, 0 };
+	size_t total = iov_total(iov, iovcnt);
+	char *stage = NULL;
+	size_t done = 0;
+	while (done < total) {
+		size_t n = iov_avail(&c);
+		char *src = iov_ptr(&c);
+		if (n >= WBUF_SIZE) {
+			c.off += n; // large enough on its own
+		} else {
+			n = total - done < WBUF_SIZE ? total - done : WBUF_SIZE;
+			if (!stage)
+				stage = buf_get(WBUF_BLOCKS);
+			iov_copy(&c, stage, n, 0);
+			src = stage;
+		}
+
+		int ret = do_write(fd, src, n);
+		if (ret < 0) {
+			buf_put(stage, WBUF_BLOCKS);
+			return done ? done : -1;
+		}
+		done += ret;
+		if (ret < n)
+			break; // disk full
+	}
+	buf_put(stage, WBUF_BLOCKS);
+	return done;
+}
+
+static int do_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1 || offset > INT_MAX)
+		return -1; // fd invalid or not found
+
+	// The descriptor's offset is only borrowed
+	int saved = filedes[fdInd].offset;
+	filedes[fdInd].offset = offset;
+	int ret = do_write(fd, buf, count);
+	filedes[fdInd].offset = saved;
+	return ret;
+}
+
+/*
+ * Grow the file of filedes entry fdInd to length bytes, the new bytes reading
+ * as zeros. Indexed files only get the end of their current last block (chunk
+ * for compressed files) written, the rest is a hole. A plain chain cannot have
+ * holes: the whole gap is written, once the free blocks are known to cover it.
+ */
+static int file_extend(int fdInd, size_t length) {
+	int rootInd = filedes[fdInd].index;
+	if ((root[rootInd].flags & FILE_PACKED) && length > PACK_MAX &&
+	    file_unpack(rootInd) != 0)
+		return -1;
+
+	size_t size = root[rootInd].size;
+	size_t unit = (root[rootInd].flags & FILE_COMPRESSED) ? CHUNK_SIZE : BLK_SIZE;
+
+	// Bytes past the end of the file are left over from earlier writes. The
+	// slot of a packed file grows with it, so all of the new bytes are written.
+	size_t n = (unit - size % unit) % unit;
+	if (n > length - size || !(root[rootInd].flags & FILE_INDEXED))
+		n = length - size;
+	if (!(root[rootInd].flags & (FILE_INDEXED | FILE_PACKED)) &&
+	    (int)((length + BLK_SIZE - 1) / BLK_SIZE) - chain_end(rootInd, NULL) >
+	    num_free_fat())
+		return -1; // disk full
+
+	int offset = filedes[fdInd].offset;
+	void *zero = memset(buf_get(CHUNK_BLOCKS), 0, CHUNK_SIZE);
+	filedes[fdInd].offset = size;
+	while (n > 0) {
+		size_t piece = n < CHUNK_SIZE ? n : CHUNK_SIZE;
+		int ret = file_write(fdInd, zero, piece);
+		if (ret != piece)
+			break;
+		n -= piece;
+	}
+	filedes[fdInd].offset = offset;
+	buf_put(zero, CHUNK_BLOCKS);
+	if (n > 0)
+		return -1;
+
+	root[rootInd].size = length;
+	return 0;
+}
+
+static int do_truncate(int fd, size_t length)
+{
+	int fdInd = filedes_index(fd);
+	if (fdInd == -1 || readOnly || length > INT_MAX)
+		return -1;
+
+	int rootInd = filedes[fdInd].index;
+	Root *r = &root[rootInd];
+	if (file_flush(rootInd, -1) != 0)
+		return -1;
+	if (length == r->size)
+		return 0;
+	if (length > r->size) {
+		// Holes take index blocks, plain files the whole gap, after
+		// buffered data's
+		int need = (r->flags & FILE_INDEXED) ?
+			   length / BLK_SIZE / INDEX_ENTRIES + 2 :
+			   wbuf_blocks(rootInd, r->size, length - r->size);
+		if (wbuf_make_room(need) != 0)
+			return -1;
+		return file_extend(fdInd, length);
+	}
+
+	int keep = (length + BLK_SIZE - 1) / BLK_SIZE;
+	if (r->flags & FILE_COMPRESSED) {
+		// Cached chunks past the new end must not be written back
+		keep = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		for (int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+			if (chunkCache[i].rootInd == rootInd && chunkCache[i].chunk >= keep)
+				chunkCache[i].rootInd = -1;
+		}
+	}
+
+	if (r->flags & FILE_PACKED) {
+		// Give back the units past the new end
+		Pack *p = pack_find(r->indexFirstBlock);
+		if (length == 0)
+			pack_free(r);
+		else if (p)
+			p->used &= ~pack_mask(r->packSlot, PACK_UNITS(r->size)) |
+				   pack_mask(r->packSlot, PACK_UNITS(length));
+	} else if (r->flags & FILE_INDEXED) {
+		if (index_truncate(rootInd, keep) != 0)
+			return -1;
+	} else if (keep == 0) {
+		chain_release(r->indexFirstBlock);
+		r->indexFirstBlock = FAT_EOC;
+		chainEnd[rootInd] = (ChainEnd){ 0, 0 };
+	} else {
+		// Cut the chain after its last needed block, free the tail
+		uint16_t itr = r->indexFirstBlock;
+		for (int i = 1; i < keep; i++)
+			itr = fat[itr].content;
+		uint16_t tail = fat[itr].content;
+		fat[itr].content = FAT_EOC;
+		chain_release(tail);
+		chainEnd[rootInd] = (ChainEnd){ itr, keep };
+	}
+
+	r->size = length;
+	return 0;
+}
+
+/* returns the snapshot table slot of the snapshot called name, or -1 */
+static int snapshot_find(const char *name) {
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (sblk->snaps[i].metaIndex != 0 &&
+		    strncmp((char*)sblk->snaps[i].name, name, FS_FILENAME_LEN) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* number of blocks saved by a snapshot: the root directory, then the FAT */
+static int snapshot_blocks() {
+	return root_blocks() + sblk->numFAT;
+}
+
+/* read back the root directory and FAT saved by snapshot slot */
+static void *snapshot_load(int slot) {
+	void *buf = buf_get(snapshot_blocks());
+	if (chain_io(sblk->snaps[slot].metaIndex, buf, snapshot_blocks(), 0) != 0) {
+		fprintf(stderr, "Corrupted snapshot\n");
+		buf_put(buf, snapshot_blocks());
+		return NULL;
+	}
+	return buf;
+}
+
+static int do_snapshot_create(const char *name)
+{
+	if (block_disk_count() == -1 || readOnly)
+		return -1;
+
+	if (strlen(name) >= FS_FILENAME_LEN || valid_filename(name) == -1)
+		return -1;
+
+	if (snapshot_find(name) != -1)
+		return -1; // name already taken
+
+	int slot;
+	for (slot = 0; slot < FS_SNAPSHOT_MAX_COUNT; slot++) {
+		if (sblk->snaps[slot].metaIndex == 0)
+			break;
+	}
+	if (slot == FS_SNAPSHOT_MAX_COUNT)
+		return -1; // snapshot table full
+
+	// Buffered data belongs in the snapshot
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fd_flush(i) != 0)
+			return -1;
+	}
+
+	if (!refcnt && refcnt_enable() != 0)
+		return -1; // no room for the refcount table
+	if (chunk_flush_file(-1, 0) != 0)
+		return -1;
+
+	int meta = chain_alloc(snapshot_blocks());
+	if (meta == -1)
+		return -1;
+
+	// Save the metadata; data blocks are shared, not copied
+	char *buf = buf_get(snapshot_blocks());
+	memcpy(buf, root, root_blocks()*BLK_SIZE);
+	memcpy(buf + root_blocks()*BLK_SIZE, fat, sblk->numFAT*BLK_SIZE);
+	if (chain_io(meta, buf, snapshot_blocks(), 1) != 0) {
+		buf_put(buf, snapshot_blocks());
+		chain_release(meta);
+		return -1;
+	}
+	buf_put(buf, snapshot_blocks());
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if ((char)*(root[i].name) == '\0' || file_ref(&root[i], fat, 1) == 0)
+			continue;
+		while (--i >= 0) { // unreadable index, take the references back
+			if ((char)*(root[i].name) != '\0')
+				file_ref(&root[i], fat, -1);
+		}
+		chain_release(meta);
+		return -1;
+	}
+
+	memset(sblk->snaps[slot].name, 0, FS_FILENAME_LEN);
+	strcpy((char*)sblk->snaps[slot].name, name);
+	sblk->snaps[slot].metaIndex = meta;
+	return 0;
+}
+
+static int do_snapshot_delete(const char *name)
+{
+	if (block_disk_count() == -1 || readOnly)
+		return -1;
+
+	int slot = snapshot_find(name);
+	if (slot == -1)
+		return -1;
+
+	char *buf = snapshot_load(slot);
+	if (!buf)
+		return -1;
+
+	// Drop the snapshot's references, blocks nobody else uses become free
+	Root *sroot = (Root*)buf;
+	FAT *sfat = (FAT*)(buf + root_blocks()*BLK_SIZE);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if((char)*(sroot[i].name) != '\0')
+			file_ref(&sroot[i], sfat, -1); // unreadable: its blocks stay held
+	}
+	buf_put(buf, snapshot_blocks());
+
+	chain_release(sblk->snaps[slot].metaIndex);
+	memset(&sblk->snaps[slot], 0, sizeof(Snapshot));
+	return 0;
+}
+
+static int do_snapshot_ls(void)
+{
+	if (block_disk_count() == -1)
+		return -1;
+
+	printf("FS Snapshots:\n");
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (sblk->snaps[i].metaIndex != 0)
+			printf("snapshot: %.16s, meta_blk: %d\n",
+			       sblk->snaps[i].name, sblk->snaps[i].metaIndex);
+	}
+
+	return 0;
+}
+
+static int do_mount_snapshot(const char *diskname, const char *name)
+{
+	if (do_mount(diskname, 0) != 0)
+		return -1;
+
+	int slot = snapshot_find(name);
+	char *buf = slot == -1 ? NULL : snapshot_load(slot);
+	if (!buf) {
+		do_umount();
+		return -1;
+	}
+
+	// Swap in the saved metadata, the image itself is left untouched
+	memcpy(root, buf, root_blocks()*BLK_SIZE);
+	memcpy(fat, buf + root_blocks()*BLK_SIZE, sblk->numFAT*BLK_SIZE);
+	buf_put(buf, snapshot_blocks());
+	root_pad_names();
+	readOnly = 1;
+	return 0;
+}
+
+/*
+ * Background checkpoints
+ *
+ * The checkpointer thread takes ckptLock exclusively to copy the metadata
+ * blocks that differ from what it last wrote, then writes the copies with the
+ * lock released. No disk I/O is done while calls are held back: buffered data
+ * is flushed by the next call instead, when it enters (see ckpt_enter()), and
+ * reaches the following checkpoint. While the checkpointer runs, the public
+ * calls hold ckptLock shared (see TRACE()), which is all the exclusion they
+ * need from it, libfs being single-threaded otherwise. Metadata blocks are
+ * only ever written from the checkpointer while it runs, fs_sync() flushing
+ * the buffers and then turning into a request to it.
+ */
+
+/* Metadata kept in memory and written back by checkpoints */
+enum { CK_SBLK, CK_FAT, CK_ROOT, CK_HASH, CK_REF, CK_CSUM, CK_AREAS };
+
+typedef struct CkptArea {
+	char *shadow; // content last written, NULL until first written
+	char *copy; // content being written
+}CkptArea;
+
+typedef struct CkptBlock {
+	uint16_t blk; // disk block
+	char *data;
+}CkptBlock;
+
+static pthread_rwlock_t ckptLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t ckptMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ckptWake = PTHREAD_COND_INITIALIZER; // to the thread
+static pthread_cond_t ckptDone = PTHREAD_COND_INITIALIZER; // from the thread
+static pthread_t ckptThread;
+static int ckptOn; // the thread is running
+static int ckptQuit;
+static unsigned int ckptInterval; // ms, 0 for none
+static size_t ckptThreshold; // dirty bytes, 0 for none
+static size_t ckptDirty; // bytes changed since the last copy, atomic
+static int ckptFlush; // buffers to flush by the next call, atomic
+static uint64_t ckptReqGen, ckptDoneGen; // fs_sync() requests, served
+static uint64_t ckptRounds; // checkpoints completed
+static int ckptRet; // result of the last checkpoint
+static CkptArea ckptAreas[CK_AREAS];
+static CkptBlock *ckptBatch;
+static struct fs_checkpoint_stats ckptStats;
+
+static uint64_t trace_clock();
+
+/* area a in memory and its number of blocks, NULL if it does not exist */
+static char *ckpt_area(int a, int *n) {
+	switch (a) {
+	case CK_SBLK: *n = 1; return (char*)sblk;
+	case CK_FAT: *n = sblk->numFAT; return (char*)fat;
+	case CK_ROOT: *n = root_blocks(); return (char*)root;
+	case CK_HASH: *n = hash_blocks(); return (char*)blkHash;
+	case CK_REF: *n = refcnt_blocks(); return (char*)refcnt;
+	default: *n = csum_blocks(); return (char*)csum;
+	}
+}
+
+/* disk block of block j of area a, j growing by one from 0 in the chains */
+static uint16_t ckpt_disk_block(int a, int j, uint16_t *itr) {
+	if (a == CK_SBLK)
+		return 0;
+	if (a == CK_FAT)
+		return 1 + j;
+	if (a == CK_ROOT)
+		return sblk->rootIndex + j;
+	if (j == 0)
+		*itr = a == CK_HASH ? sblk->hashIndex
+			: a == CK_REF ? sblk->refIndex : sblk->csumIndex;
+	else
+		*itr = fat[*itr].content;
+	return sblk->dataIndex + *itr;
+}
+
+/* copy the changed metadata blocks to ckptBatch, ckptLock held exclusively */
+static int ckpt_collect() {
+	int count = 0;
+	// Tables in the data area have checksums, computed before csum is copied
+	for (int a = 0; a < CK_AREAS; a++) {
+		int n;
+		char *mem = ckpt_area(a, &n);
+		if (!mem)
+			continue;
+		CkptArea *ar = &ckptAreas[a];
+		int first = !ar->shadow;
+		if (first) {
+			ar->shadow = meta_alloc(n*BLK_SIZE);
+			ar->copy = meta_alloc(n*BLK_SIZE);
+		}
+
+		uint16_t itr = 0;
+		for (int j = 0; j < n; j++) {
+			uint16_t blk = ckpt_disk_block(a, j, &itr);
+			char *cur = mem + j*BLK_SIZE;
+			char *shadow = ar->shadow + j*BLK_SIZE;
+			if (!first && !memcmp(cur, shadow, BLK_SIZE))
+				continue;
+			memcpy(shadow, cur, BLK_SIZE);
+			memcpy(ar->copy + j*BLK_SIZE, cur, BLK_SIZE);
+			if (csum && (a == CK_HASH || a == CK_REF))
+				csum[itr] = csum_of(cur);
+			ckptBatch[count++] = (CkptBlock){ blk, ar->copy + j*BLK_SIZE };
+		}
+	}
+	return count;
+}
+
+static int ckpt_cmp(const void *a, const void *b) {
+	return ((const CkptBlock*)a)->blk - ((const CkptBlock*)b)->blk;
+}
+
+/* write the n collected blocks, merging contiguous ones, counted in st */
+static int ckpt_write(int n, struct fs_checkpoint_stats *st) {
+	qsort(ckptBatch, n, sizeof(CkptBlock), ckpt_cmp);
+	int ret = 0;
+	for (int i = 0; i < n; ) {
+		int run = 1;
+		while (i + run < n && ckptBatch[i + run].blk == ckptBatch[i].blk + run &&
+		       ckptBatch[i + run].data == ckptBatch[i].data + run*BLK_SIZE)
+			run++;
+		if (block_write_n(ckptBatch[i].blk, run, ckptBatch[i].data) != 0)
+			ret = -1;
+		st->writes++;
+		i += run;
+	}
+	st->blocks = n;
+	st->checkpoints = n > 0;
+	return ret;
+}
+
+/* flush the write buffers and compressed chunks, ckptLock held */
+static int ckpt_flush() {
+	int ret = 0;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fd_flush(i) != 0)
+			ret = -1;
+	}
+	if (chunk_flush_file(-1, 0) != 0)
+		ret = -1;
+	return ret;
+}
+
+static int ckpt_run(struct fs_checkpoint_stats *st) {
+	// Only the copy holds the calls back, the next one flushes the buffers
+	__atomic_store_n(&ckptFlush, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_wrlock(&ckptLock);
+	uint64_t t0 = trace_clock();
+	int n = ckpt_collect();
+	__atomic_store_n(&ckptDirty, 0, __ATOMIC_RELAXED);
+	st->hold_ns = trace_clock() - t0;
+	pthread_rwlock_unlock(&ckptLock);
+
+	return ckpt_write(n, st);
+}
+
+static void *ckpt_main(void *arg) {
+	pthread_mutex_lock(&ckptMutex);
+	while (!ckptQuit) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		uint64_t ns = deadline.tv_nsec + ckptInterval * 1000000ULL;
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+
+		// Woken up past the threshold, on a request or at the deadline
+		int timeout = 0;
+		while (!ckptQuit && ckptReqGen == ckptDoneGen && !timeout &&
+		       (!ckptThreshold ||
+			__atomic_load_n(&ckptDirty, __ATOMIC_RELAXED) < ckptThreshold)) {
+			if (ckptInterval)
+				timeout = pthread_cond_timedwait(&ckptWake, &ckptMutex,
+								 &deadline) != 0;
+			else
+				pthread_cond_wait(&ckptWake, &ckptMutex);
+		}
+		if (ckptQuit)
+			break;
+		if (ckptReqGen == ckptDoneGen &&
+		    __atomic_load_n(&ckptDirty, __ATOMIC_RELAXED) == 0)
+			continue; // nothing changed since last time
+
+		uint64_t gen = ckptReqGen;
+		struct fs_checkpoint_stats st = {0};
+		pthread_mutex_unlock(&ckptMutex);
+		int ret = ckpt_run(&st);
+		pthread_mutex_lock(&ckptMutex);
+		ckptStats.checkpoints += st.checkpoints;
+		ckptStats.blocks += st.blocks;
+		ckptStats.writes += st.writes;
+		ckptStats.hold_ns += st.hold_ns;
+		if (st.hold_ns > ckptStats.hold_max_ns)
+			ckptStats.hold_max_ns = st.hold_ns;
+		ckptRet = ret;
+		ckptDoneGen = gen;
+		ckptRounds++;
+		pthread_cond_broadcast(&ckptDone);
+	}
+	pthread_mutex_unlock(&ckptMutex);
+	return arg;
+}
+
+/* fs_sync() while the checkpointer runs: wait for a whole checkpoint */
+static int ckpt_sync() {
+	pthread_rwlock_rdlock(&ckptLock);
+	int flushed = ckpt_flush();
+	pthread_rwlock_unlock(&ckptLock);
+
+	pthread_mutex_lock(&ckptMutex);
+	uint64_t gen = ++ckptReqGen;
+	pthread_cond_signal(&ckptWake);
+	while (ckptDoneGen < gen)
+		pthread_cond_wait(&ckptDone, &ckptMutex);
+	int ret = ckptRet;
+	pthread_mutex_unlock(&ckptMutex);
+	return flushed != 0 ? -1 : ret;
+}
+
+/* enter a public call op, returns 1 if ckptLock was taken */
+static int ckpt_enter(int op) {
+	if (op == FS_TR_SYNC || op == FS_TR_UMOUNT || op == FS_TR_MOUNT ||
+	    op == FS_TR_MOUNT_SNAP)
+		return 0; // these never run along with the checkpointer
+
+	// Back-pressure, the checkpointer is too far behind
+	if (ckptThreshold &&
+	    __atomic_load_n(&ckptDirty, __ATOMIC_RELAXED) >=
+	    FS_CHECKPOINT_HARD_FACTOR * ckptThreshold) {
+		uint64_t t0 = trace_clock();
+		pthread_mutex_lock(&ckptMutex);
+		uint64_t rounds = ckptRounds;
+		pthread_cond_signal(&ckptWake);
+		while (ckptRounds == rounds &&
+		       __atomic_load_n(&ckptDirty, __ATOMIC_RELAXED) >=
+		       FS_CHECKPOINT_HARD_FACTOR * ckptThreshold)
+			pthread_cond_wait(&ckptDone, &ckptMutex);
+		ckptStats.stalls++;
+		ckptStats.stall_ns += trace_clock() - t0;
+		pthread_mutex_unlock(&ckptMutex);
+	}
+	pthread_rwlock_rdlock(&ckptLock);
+	if (__atomic_exchange_n(&ckptFlush, 0, __ATOMIC_RELAXED))
+		ckpt_flush(); // what fails stays buffered
+	return 1;
+}
+
+/* leave a public call op that returned ret, counting what it changed */
+static void ckpt_leave(int locked, int op, int ret) {
+	if (!locked)
+		return;
+	pthread_rwlock_unlock(&ckptLock);
+
+	size_t dirty = 0;
+	switch (op) {
+	case FS_TR_WRITE: case FS_TR_WRITEV: case FS_TR_PWRITE:
+		dirty = ret > 0 ? ret : 0;
+		break;
+	case FS_TR_CREATE: case FS_TR_DELETE: case FS_TR_TRUNCATE:
+	case FS_TR_SNAP_CREATE: case FS_TR_SNAP_DELETE: case FS_TR_CSUM_ENABLE:
+		dirty = ret == 0 ? BLK_SIZE : 0;
+		break;
+	}
+	if (!dirty)
+		return;
+
+	size_t old = __atomic_fetch_add(&ckptDirty, dirty, __ATOMIC_RELAXED);
+	if (ckptThreshold && old < ckptThreshold && old + dirty >= ckptThreshold) {
+		pthread_mutex_lock(&ckptMutex);
+		pthread_cond_signal(&ckptWake);
+		pthread_mutex_unlock(&ckptMutex);
+	}
+}
+
+int fs_checkpoint_start(unsigned int interval_ms, size_t dirty_bytes)
+{
+	if (block_disk_count() == -1 || readOnly || ckptOn ||
+	    (!interval_ms && !dirty_bytes))
+		return -1;
+
+	// Room for every metadata block, tables included once they exist
+	int n = 2 + sblk->numFAT + hash_blocks() + refcnt_blocks() + csum_blocks();
+	if (!ckptBatch)
+		ckptBatch = meta_alloc(n*sizeof(CkptBlock));
+	ckptInterval = interval_ms;
+	ckptThreshold = dirty_bytes;
+	ckptDirty = 0;
+	ckptQuit = 0;
+	ckptReqGen = ckptDoneGen = 0;
+	memset(&ckptStats, 0, sizeof(ckptStats));
+	if (pthread_create(&ckptThread, NULL, ckpt_main, NULL) != 0)
+		return -1;
+	ckptOn = 1;
+	return 0;
+}
+
+int fs_checkpoint_stop(void)
+{
+	if (!ckptOn)
+		return -1;
+
+	pthread_mutex_lock(&ckptMutex);
+	ckptQuit = 1;
+	pthread_cond_signal(&ckptWake);
+	pthread_mutex_unlock(&ckptMutex);
+	pthread_join(ckptThread, NULL);
+	ckptOn = 0;
+	return 0;
+}
+
+int fs_checkpoint_stats(struct fs_checkpoint_stats *st)
+{
+	if (block_disk_count() == -1)
+		return -1;
+
+	pthread_mutex_lock(&ckptMutex);
+	*st = ckptStats;
+	pthread_mutex_unlock(&ckptMutex);
+	return 0;
+}
+
+/* forget what the checkpointer wrote, the mount's memory is released */
+static void ckpt_reset() {
+	fs_checkpoint_stop();
+	memset(ckptAreas, 0, sizeof(ckptAreas));
+	ckptBatch = NULL;
+}
+
+/*
+ * Growing
+ *
+ * fs_grow() adds data blocks at the end of the image. Block numbers are
+ * relative to the data region, so they stay valid as long as the data region
+ * is not moved. When the FAT has room for the new blocks, which it has after
+ * a first growth, nothing moves: the new FAT entries are free already. A FAT
+ * too small is made large enough for twice the new size, and the data region
+ * is moved past it, one run of used blocks at a time from the end.
+ * Afterwards the per-block tables and the snapshots, whose saved FAT has the
+ * size of the FAT, move to chains of their new size.
+ */
+
+/* move the used blocks of the data region shift blocks further on disk */
+static int data_shift(int shift) {
+	char *buf = buf_get(CHUNK_BLOCKS);
+	int ret = 0;
+	for (int end = sblk->numDataBlocks; end > 1 && ret == 0; ) {
+		if (blk_free(end - 1)) {
+			end--;
+			continue;
+		}
+		int start = end - 1;
+		while (start > 1 && end - start < CHUNK_BLOCKS && !blk_free(start - 1))
+			start--;
+
+		// Runs are moved from the end, so sources are never overwritten
+		size_t from = sblk->dataIndex + start;
+		if (block_read_n(from, end - start, buf) != 0 ||
+		    block_write_n(from + shift, end - start, buf) != 0)
+			ret = -1;
+		end = start;
+	}
+	buf_put(buf, CHUNK_BLOCKS);
+	return ret;
+}
+
+/* per-block table of oldN blocks at table, in memory of n blocks */
+static void *table_resize(void *table, int oldN, int n) {
+	if (!table || n == oldN)
+		return table;
+	return memcpy(meta_alloc(n*BLK_SIZE), table, oldN*BLK_SIZE);
+}
+
+/* new chain of n blocks for a table stored in the chain at first */
+static int table_rechain(int first, int oldN, int n) {
+	if (first == 0 || n == oldN)
+		return first;
+	int blk = chain_alloc(n);
+	if (blk == -1)
+		return first; // cannot happen, the room was checked
+	chain_release(first);
+	return blk;
+}
+
+static int do_grow(size_t data_blocks)
+{
+	if (block_disk_count() == -1 || readOnly || ckptOn)
+		return -1;
+	int oldData = sblk->numDataBlocks;
+	if (data_blocks <= oldData)
+		return data_blocks == oldData ? 0 : -1;
+
+	// A FAT too small gets room for twice the new size
+	int numFAT = sblk->numFAT;
+	if (data_blocks*sizeof(FAT) > numFAT*BLK_SIZE) {
+		size_t entries = 2*data_blocks < UINT16_MAX ? 2*data_blocks : UINT16_MAX;
+		numFAT = (entries*sizeof(FAT) + BLK_SIZE - 1) / BLK_SIZE;
+		if (numFAT > UINT8_MAX)
+			numFAT = UINT8_MAX;
+		if (data_blocks*sizeof(FAT) > numFAT*BLK_SIZE)
+			return -1;
+	}
+	int shift = numFAT - sblk->numFAT;
+	size_t total = 1 + numFAT + root_blocks() + data_blocks;
+	if (total > UINT16_MAX)
+		return -1;
+
+	// Block counts of what moves to a chain of a new size
+	int oldRef = refcnt_blocks(), oldHash = hash_blocks();
+	int oldCsum = csum_blocks(), oldSnap = snapshot_blocks();
+	int numSnaps = 0;
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++)
+		numSnaps += sblk->snaps[i].metaIndex != 0;
+	sblk->numDataBlocks = data_blocks;
+	int newRef = refcnt_blocks(), newHash = hash_blocks();
+	int newCsum = csum_blocks(), newSnap = oldSnap + shift;
+	sblk->numDataBlocks = oldData;
+	int need = (sblk->refIndex ? newRef : 0) + (sblk->hashIndex ? newHash : 0) +
+		   (sblk->csumIndex ? newCsum : 0) + (shift ? numSnaps*newSnap : 0);
+	if (num_free_fat() + (int)data_blocks - oldData < need)
+		return -1;
+
+	// Everything buffered goes to disk first, where it gets moved
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fd_flush(i) != 0)
+			return -1;
+	}
+	warm_stop(); // the disk is about to change under it
+	if (chunk_flush_file(-1, 0) != 0 || block_disk_grow(total) != 0)
+		return -1;
+	if (shift && data_shift(shift) != 0)
+		return -1;
+	ckpt_reset(); // shadows of the old sizes
+
+	sblk->numBlocks = total;
+	sblk->numFAT = numFAT;
+	sblk->rootIndex += shift;
+	sblk->dataIndex += shift;
+	sblk->numDataBlocks = data_blocks;
+	fat = table_resize(fat, numFAT - shift, numFAT);
+	refcnt = table_resize(refcnt, oldRef, newRef);
+	blkHash = table_resize(blkHash, oldHash, newHash);
+	csum = table_resize(csum, oldCsum, newCsum);
+	if (blkHash)
+		hash_build();
+
+	// Tables and snapshots move to chains of the new size
+	sblk->refIndex = table_rechain(sblk->refIndex, oldRef, newRef);
+	sblk->hashIndex = table_rechain(sblk->hashIndex, oldHash, newHash);
+	sblk->csumIndex = table_rechain(sblk->csumIndex, oldCsum, newCsum);
+	for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT && shift; i++) {
+		int meta = sblk->snaps[i].metaIndex;
+		if (meta == 0)
+			continue;
+		char *buf = memset(buf_get(newSnap), 0, newSnap*BLK_SIZE);
+		int blk = chain_io(meta, buf, oldSnap, 0) == 0 ? chain_alloc(newSnap) : -1;
+		if (blk != -1 && chain_io(blk, buf, newSnap, 1) == 0) {
+			chain_release(meta);
+			sblk->snaps[i].metaIndex = blk;
+		}
+		buf_put(buf, newSnap);
+	}
+
+	return do_sync();
+}
+
+/*
+ * Warm-up
+ *
+ * With FS_MOUNT_WARM, the data blocks read are marked in warmHot, and listed
+ * at unmount in a sidecar file as runs of blocks. Gaps of up to WARM_GAP bytes
+ * are made part of the runs, as reading through them costs less than a seek.
+ * The next mount starts a thread reading those runs in increasing order,
+ * WARM_IO bytes at a time, into a buffer of its own, so that the disk's
+ * caches are warm by the time the file system gets to the blocks. It only
+ * uses the block layer, which takes concurrent calls, and needs no lock.
+ */
+
+/* Gaps read through, and most read at once, in bytes */
+#define WARM_GAP (64*1024)
+#define WARM_IO (1024*1024)
+
+typedef struct __attribute__((__packed__)) WarmHeader {
+	char sig[8]; // "FSWARM01"
+	uint32_t blockSize;
+	uint16_t numBlocks; // the layout of the image must not have changed
+	uint16_t dataIndex;
+	uint32_t runs; // number of WarmRun following
+} WarmHeader;
+
+typedef struct WarmRun {
+	uint16_t first; // data block
+	uint16_t len;
+} WarmRun;
+
+static char *warmPath; // sidecar, NULL if not mounted with FS_MOUNT_WARM
+static pthread_t warmThread;
+static int warmOn; // the thread is running
+static int warmQuit;
+static WarmRun *warmRuns; // runs the thread reads
+static int warmNumRuns;
+static size_t warmDataIndex;
+static uint64_t warmStart;
+static struct fs_warm_stats warmStats; // read, reads, done, ns are atomic
+
+static void *warm_main(void *arg) {
+	size_t max = WARM_IO > BLK_SIZE ? WARM_IO / BLK_SIZE : 1;
+	char *buf = malloc(max * BLK_SIZE);
+	for (int r = 0; buf && r < warmNumRuns; r++) {
+		size_t n;
+		for (size_t off = 0; off < warmRuns[r].len; off += n) {
+			if (__atomic_load_n(&warmQuit, __ATOMIC_RELAXED))
+				goto out;
+			n = warmRuns[r].len - off < max ? warmRuns[r].len - off : max;
+			if (block_read_n(warmDataIndex + warmRuns[r].first + off, n, buf) != 0)
+				goto out; // only a warm-up, nothing is lost
+			__atomic_fetch_add(&warmStats.read, n, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&warmStats.reads, 1, __ATOMIC_RELAXED);
+		}
+	}
+out:
+	free(buf);
+	__atomic_store_n(&warmStats.ns, trace_clock() - warmStart, __ATOMIC_RELAXED);
+	__atomic_store_n(&warmStats.done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* load the runs of the sidecar, checked against the image; -1 if none */
+static int warm_load(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	WarmHeader h;
+	WarmRun *runs = NULL;
+	int ok = fread(&h, sizeof(h), 1, f) == 1 && !memcmp(h.sig, "FSWARM01", 8) &&
+		 h.blockSize == BLK_SIZE && h.numBlocks == sblk->numBlocks &&
+		 h.dataIndex == sblk->dataIndex && h.runs > 0 &&
+		 h.runs <= sblk->numDataBlocks;
+	if (ok) {
+		runs = malloc(h.runs * sizeof(WarmRun));
+		ok = runs && fread(runs, sizeof(WarmRun), h.runs, f) == h.runs;
+	}
+	fclose(f);
+
+	size_t blocks = 0;
+	for (int r = 0; ok && r < h.runs; r++) {
+		ok = runs[r].len > 0 && runs[r].first + runs[r].len <= sblk->numDataBlocks;
+		blocks += runs[r].len;
+	}
+	if (!ok) {
+		free(runs);
+		return -1;
+	}
+	warmRuns = runs;
+	warmNumRuns = h.runs;
+	warmStats.blocks = blocks;
+	return 0;
+}
+
+/* record the blocks read, and warm up from the sidecar of diskname if any */
+static void warm_start(const char *diskname) {
+	const char *image = strrchr(diskname, ':'); // after the backend prefixes
+	image = image ? image + 1 : diskname;
+	warmPath = meta_alloc(strlen(image) + sizeof(".warm"));
+	sprintf(warmPath, "%s.warm", image);
+	warmHot = meta_alloc((UINT16_MAX + 1) / 8);
+	memset(&warmStats, 0, sizeof(warmStats));
+	warmStart = trace_clock();
+	warmQuit = 0;
+
+	warmDataIndex = sblk->dataIndex;
+	if (warm_load(warmPath) != 0 ||
+	    pthread_create(&warmThread, NULL, warm_main, NULL) != 0) {
+		free(warmRuns);
+		warmRuns = NULL;
+		warmStats.done = 1; // nothing to warm up
+		return;
+	}
+	warmOn = 1;
+}
+
+/* stop the warm-up thread, if still running */
+static void warm_stop() {
+	if (!warmOn)
+		return;
+	__atomic_store_n(&warmQuit, 1, __ATOMIC_RELAXED);
+	pthread_join(warmThread, NULL);
+	warmOn = 0;
+	free(warmRuns);
+	warmRuns = NULL;
+}
+
+/* list the blocks read since mount in the sidecar, replaced at once */
+static int warm_save() {
+	int any = 0;
+	for (int i = 0; i < (sblk->numDataBlocks + 7) / 8 && !any; i++)
+		any = warmHot[i] != 0;
+	if (!any)
+		return 0; // the last list is better than none
+
+	char *tmp = malloc(strlen(warmPath) + sizeof(".tmp"));
+	sprintf(tmp, "%s.tmp", warmPath);
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		free(tmp);
+		return -1;
+	}
+
+	WarmHeader h = { "FSWARM01", BLK_SIZE, sblk->numBlocks, sblk->dataIndex, 0 };
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	int gap = WARM_GAP / BLK_SIZE;
+	WarmRun run = { 0, 0 };
+	for (int i = 0; i <= sblk->numDataBlocks && ok; i++) {
+		int hot = i < sblk->numDataBlocks && (warmHot[i >> 3] & (1 << (i & 7)));
+		if (hot && run.len && i - (run.first + run.len) <= gap) {
+			run.len = i + 1 - run.first; // continues the run, gap included
+			continue;
+		}
+		if (run.len && (hot || i == sblk->numDataBlocks)) {
+			ok = fwrite(&run, sizeof(run), 1, f) == 1;
+			h.runs++;
+			run.len = 0;
+		}
+		if (hot)
+			run = (WarmRun){ i, 1 };
+	}
+	ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+	ok = fclose(f) == 0 && ok && rename(tmp, warmPath) == 0;
+	if (!ok)
+		remove(tmp);
+	free(tmp);
+	return ok ? 0 : -1;
+}
+
+/* at unmount, before the mount's memory is released */
+static void warm_end() {
+	if (!warmPath)
+		return;
+	warm_stop();
+	warm_save();
+	warmPath = NULL;
+	warmHot = NULL;
+}
+
+int fs_warm_stats(struct fs_warm_stats *st)
+{
+	if (block_disk_count() == -1 || !warmPath)
+		return -1;
+
+	st->blocks = warmStats.blocks;
+	st->read = __atomic_load_n(&warmStats.read, __ATOMIC_RELAXED);
+	st->reads = __atomic_load_n(&warmStats.reads, __ATOMIC_RELAXED);
+	st->done = __atomic_load_n(&warmStats.done, __ATOMIC_ACQUIRE);
+	st->ns = st->done ? warmStats.ns : 0;
+	st->recorded = 0;
+	for (int i = 0; i < sblk->numDataBlocks; i++)
+		st->recorded += (warmHot[i >> 3] >> (i & 7)) & 1;
+	return 0;
+}
+
+/*
+ * Tracing
+ *
+ * While a trace is recorded, every public call is timed and appended to it as
+ * a struct fs_trace_rec, through a buffered stream. The recorder has a lock
+ * of its own, fs_pread() being callable from several threads.
+ */
+
+static FILE *traceFile; // NULL if not tracing
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t traceStart;
+static int traceErr; // some record could not be written
+
+/* Size of the trace stream's buffer */
+#define TRACE_BUF (64*1024)
+
+static uint64_t trace_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* file offset of fd, for the calls using it */
+static size_t trace_offset(int fd) {
+	int fdInd = filedes_index(fd);
+	return fdInd == -1 ? 0 : filedes[fdInd].offset;
+}
+
+/* append the record of a call that started at t0 */
+static void trace_rec(int op, int fd, size_t off, size_t size, int arg,
+		      const char *name, uint64_t t0, int ret) {
+	uint64_t dur = trace_clock() - t0;
+	struct fs_trace_rec rec = {
+		.op = op, .arg = arg, .fd = fd, .ret = ret, .size = size,
+		.offset = off, .dur_ns = dur > UINT32_MAX ? UINT32_MAX : dur,
+		.start_ns = t0 - traceStart,
+	};
+	rec.name_len = name ? strnlen(name, UINT8_MAX) : 0;
+
+	pthread_mutex_lock(&traceLock);
+	if (traceFile && (fwrite(&rec, sizeof(rec), 1, traceFile) != 1 ||
+	    (rec.name_len && fwrite(name, rec.name_len, 1, traceFile) != 1)))
+		traceErr = 1;
+	pthread_mutex_unlock(&traceLock);
+}
+
+/*
+ * return the result of call, recorded as op if tracing; off is taken before.
+ * The checkpointer is also kept out while call runs, see ckpt_enter().
+ */
+#define TRACE(op, fd, off, size, arg, name, call) do {	\
+	if (!traceFile && !ckptOn)				\
+		return call;					\
+	int ckpt_ = ckptOn && ckpt_enter(op);			\
+	int trace_ = traceFile != NULL;				\
+	size_t off_ = trace_ ? (off) : 0;			\
+	uint64_t t0_ = trace_ ? trace_clock() : 0;		\
+	int ret_ = call;					\
+	if (trace_)						\
+		trace_rec(op, fd, off_, size, arg, name, t0_, ret_); \
+	ckpt_leave(ckpt_, op, ret_);				\
+	return ret_;						\
+} while (0)
+
+int fs_trace_start(const char *path)
+{
+	if (traceFile || !path)
+		return -1;
+
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return -1;
+	setvbuf(f, NULL, _IOFBF, TRACE_BUF);
+	if (fwrite(FS_TRACE_MAGIC, strlen(FS_TRACE_MAGIC), 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+
+	traceErr = 0;
+	traceStart = trace_clock();
+	traceFile = f;
+	return 0;
+}
+
+int fs_trace_stop(void)
+{
+	pthread_mutex_lock(&traceLock);
+	FILE *f = traceFile;
+	traceFile = NULL;
+	pthread_mutex_unlock(&traceLock);
+	if (!f)
+		return -1;
+
+	if (fclose(f) != 0)
+		traceErr = 1;
+	return traceErr ? -1 : 0;
+}
+
+int fs_mount(const char *diskname)
+{
+	TRACE(FS_TR_MOUNT, -1, 0, 0, 0, diskname, do_mount(diskname, 0));
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+	TRACE(FS_TR_MOUNT, -1, 0, 0, flags, diskname, do_mount(diskname, flags));
+}
+
+int fs_umount(void)
+{
+	TRACE(FS_TR_UMOUNT, -1, 0, 0, 0, NULL, do_umount());
+}
+
+int fs_grow(size_t data_blocks)
+{
+	TRACE(FS_TR_GROW, -1, 0, data_blocks, 0, NULL, do_grow(data_blocks));
+}
+
+int fs_sync(void)
+{
+	TRACE(FS_TR_SYNC, -1, 0, 0, 0, NULL, ckptOn ? ckpt_sync() : do_sync());
+}
+
+int fs_info(void)
+{
+	TRACE(FS_TR_INFO, -1, 0, 0, 0, NULL, do_info());
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+	TRACE(FS_TR_STATFS, -1, 0, 0, 0, NULL, do_statfs(st));
+}
+
+int fs_create(const char *filename)
+{
+	TRACE(FS_TR_CREATE, -1, 0, 0, 0, filename, do_create_flags(filename, 0));
+}
+
+int fs_create_flags(const char *filename, int flags)
+{
+	TRACE(FS_TR_CREATE, -1, 0, 0, flags, filename,
+	      do_create_flags(filename, flags));
+}
+
+int fs_delete(const char *filename)
+{
+	TRACE(FS_TR_DELETE, -1, 0, 0, 0, filename, do_delete(filename));
+}
+
+int fs_ls(void)
+{
+	TRACE(FS_TR_LS, -1, 0, 0, 0, NULL, do_ls());
+}
+
+int fs_readdir(struct fs_dirent *ents, int max)
+{
+	TRACE(FS_TR_READDIR, -1, 0, 0, max, NULL, do_readdir(ents, max));
+}
+
+int fs_stat_name(const char *filename, struct fs_dirent *ent)
+{
+	TRACE(FS_TR_STAT_NAME, -1, 0, 0, 0, filename,
+	      do_stat_name(filename, ent));
+}
+
+int fs_open(const char *filename)
+{
+	TRACE(FS_TR_OPEN, -1, 0, 0, 0, filename, do_open(filename, 0));
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	TRACE(FS_TR_OPEN, -1, 0, 0, flags, filename, do_open(filename, flags));
+}
+
+int fs_close(int fd)
+{
+	TRACE(FS_TR_CLOSE, fd, 0, 0, 0, NULL, do_close(fd));
+}
+
+int fs_stat(int fd)
+{
+	TRACE(FS_TR_STAT, fd, 0, 0, 0, NULL, do_stat(fd));
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	TRACE(FS_TR_LSEEK, fd, offset, 0, 0, NULL, do_lseek(fd, offset));
+}
+
+int fs_truncate(int fd, size_t length)
+{
+	TRACE(FS_TR_TRUNCATE, fd, 0, length, 0, NULL, do_truncate(fd, length));
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	TRACE(FS_TR_READ, fd, trace_offset(fd), count, 0, NULL,
+	      do_read(fd, buf, count));
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	TRACE(FS_TR_READV, fd, trace_offset(fd), iov_total(iov, iovcnt), iovcnt,
+	      NULL, do_readv(fd, iov, iovcnt));
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	TRACE(FS_TR_PREAD, fd, offset, count, 0, NULL,
+	      do_pread(fd, buf, count, offset));
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	TRACE(FS_TR_WRITE, fd, trace_offset(fd), count, 0, NULL,
+	      do_write(fd, buf, count));
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	TRACE(FS_TR_WRITEV, fd, trace_offset(fd), iov_total(iov, iovcnt), iovcnt,
+	      NULL, do_writev(fd, iov, iovcnt));
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	TRACE(FS_TR_PWRITE, fd, offset, count, 0, NULL,
+	      do_pwrite(fd, buf, count, offset));
+}
+
+int fs_map(int fd, size_t offset, size_t len, struct fs_map *map)
+{
+	TRACE(FS_TR_MAP, fd, offset, len, 0, NULL, do_map(fd, offset, len, map));
+}
+
+int fs_unmap(struct fs_map *map)
+{
+	TRACE(FS_TR_UNMAP, -1, 0, 0, 0, NULL, do_unmap(map));
+}
+
+int fs_snapshot_create(const char *name)
+{
+	TRACE(FS_TR_SNAP_CREATE, -1, 0, 0, 0, name, do_snapshot_create(name));
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	TRACE(FS_TR_SNAP_DELETE, -1, 0, 0, 0, name, do_snapshot_delete(name));
+}
+
+int fs_snapshot_ls(void)
+{
+	TRACE(FS_TR_SNAP_LS, -1, 0, 0, 0, NULL, do_snapshot_ls());
+}
+
+int fs_mount_snapshot(const char *diskname, const char *name)
+{
+	TRACE(FS_TR_MOUNT_SNAP, -1, 0, 0, 0, name,
+	      do_mount_snapshot(diskname, name));
+}
+
+int fs_csum_enable(void)
+{
+	TRACE(FS_TR_CSUM_ENABLE, -1, 0, 0, 0, NULL, do_csum_enable());
+}
+
+int fs_csum_policy(int policy)
+{
+	TRACE(FS_TR_CSUM_POLICY, -1, 0, 0, policy, NULL, do_csum_policy(policy));
+}
@@ -2,6 +2,11 @@
 #define _FS_H
 
 #include <stdint.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +17,9 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots per file system */
+#define FS_SNAPSHOT_MAX_COUNT 8
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,17 +33,101 @@
  */
 int fs_mount(const char *diskname);
 
+/** fs_mount_flags() flag: mount read-only, sharing metadata between processes */
+#define FS_MOUNT_RDONLY 0x01
+/** fs_mount_flags() flag: warm up from the blocks read by the last mount */
+#define FS_MOUNT_WARM 0x02
+
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of FS_MOUNT_* flags
+ *
+ * Like fs_mount(), with the following options:
+ * - %FS_MOUNT_RDONLY: the virtual disk file is opened for reading only, and
+ *   fs_create(), fs_delete(), fs_write(), fs_truncate() and snapshot
+ *   management fail, as with fs_mount_snapshot(). Unless the disk's backend
+ *   cannot be mapped, the superblock, the FAT and the checksum table are not
+ *   read but used in place from a shared mapping of the image, so that the
+ *   mount costs next to nothing and processes mounting the same image share
+ *   them through the page cache. The image must not be mounted read-write by
+ *   another process meanwhile.
+ * - %FS_MOUNT_WARM: the data blocks read until fs_umount(), if any, are
+ *   recorded in a sidecar file, named after the image with ".warm" appended
+ *   (the disk name after its last ':', so that backend prefixes do not
+ *   matter). If the sidecar of a previous mount exists, a thread reads the
+ *   blocks it lists in increasing order, a run of contiguous blocks at a time,
+ *   to bring them into the caches of the disk (the page cache for image files)
+ *   while the file system is in use. See fs_warm_stats().
+ *
+ * Return: -1 in the same cases as fs_mount(), or if @flags is invalid. 0
+ * otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file
+ * @block_size: Block size in bytes, a power of two from 512 to 1048576
+ *
+ * Lay out an empty file system over the whole of virtual disk @diskname,
+ * which must not be mounted. The block size is recorded in the superblock,
+ * and used by every later mount. With 4096-byte blocks, the image is the same
+ * as the reference tools make. Larger blocks make a smaller FAT and fewer
+ * blocks per file, smaller ones waste less space on small files.
+ *
+ * Return: -1 if @diskname cannot be opened, if @block_size is invalid or its
+ * size is not a multiple of it, or if the image would have more than 65535
+ * blocks or too few for the FAT, the root directory and one data block. 0
+ * otherwise.
+ */
+int fs_format(const char *diskname, size_t block_size);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
  * disk file.
  *
- * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * Return: -1 if no underlying virtual disk was opened, if the virtual disk
+ * cannot be closed, or if buffered writes could not be written back (the
+ * file system is unmounted all the same). 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_grow - Add data blocks to the mounted file system
+ * @data_blocks: New number of data blocks
+ *
+ * Extend the virtual disk and the file system on it to @data_blocks data
+ * blocks, without touching the files. If the FAT has no room for the new
+ * entries, it is enlarged to have room for twice @data_blocks, and the data
+ * blocks in use are moved past it; otherwise (and so after a first growth)
+ * only metadata is written. Buffered data is written first, and the file
+ * system is synced as by fs_sync(). Mappings made by fs_map() must be
+ * released beforehand. The image is inconsistent until fs_grow() returns.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * read-only or checkpointed (see fs_checkpoint_start()), if @data_blocks is
+ * smaller than the current number of data blocks, if the image would have
+ * more than 65535 blocks, if its backend cannot grow, or if there is no room
+ * left for the tables moved to a new chain. 0 otherwise.
+ */
+int fs_grow(size_t data_blocks);
+
+/**
+ * fs_sync - Write back buffered data and metadata
+ *
+ * Write the data buffered by fs_write() for every open file descriptor, then
+ * the file system's metadata, to the underlying virtual disk. The file system
+ * stays mounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * mounted read-only, or if some buffered data could not be written. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +137,30 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/** File system information, as reported by fs_statfs() */
+struct fs_statfs {
+	uint32_t block_size;	/* Size of a block in bytes */
+	uint32_t total_blocks;	/* Number of blocks of the virtual disk */
+	uint32_t fat_blocks;	/* Number of blocks of the FAT */
+	uint32_t rdir_block;	/* Index of the root directory block */
+	uint32_t data_start;	/* Index of the first data block */
+	uint32_t data_blocks;	/* Number of data blocks */
+	uint32_t free_blocks;	/* ... not in use by files or snapshots */
+	uint32_t files;		/* Number of files in the root directory */
+	uint32_t free_files;	/* ... that can still be created */
+};
+
+/**
+ * fs_statfs - Get information about file system
+ * @st: Structure to be filled
+ *
+ * Fill @st with the information that fs_info() displays.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @st is NULL. 0
+ * otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -60,6 +176,45 @@ int fs_info(void);
  */
 int fs_create(const char *filename);
 
+/** fs_create_flags() flag: store the file's data compressed */
+#define FS_CREATE_COMPRESSED 0x01
+/** fs_create_flags() flag: share identical data blocks with other files */
+#define FS_CREATE_DEDUP 0x02
+/** fs_create_flags() flag: leave holes when the file grows past its end */
+#define FS_CREATE_SPARSE 0x04
+/** fs_create_flags() flag: store the file in a block shared with small files */
+#define FS_CREATE_PACKED 0x08
+
+/**
+ * fs_create_flags - Create a new file with options
+ * @filename: File name
+ * @flags: Bitwise OR of FS_CREATE_* flags
+ *
+ * Like fs_create(), with the following options:
+ * - %FS_CREATE_COMPRESSED: the file's data is transparently compressed, in
+ *   independent chunks so that fs_lseek() followed by fs_read() or fs_write()
+ *   only touches the chunk around the new offset. Well suited to large,
+ *   compressible files such as logs.
+ * - %FS_CREATE_DEDUP: every block-sized, block-aligned write is matched
+ *   against the blocks of all deduplicated files, and an identical block is
+ *   shared instead of being allocated and written again. See
+ *   fs_dedup_stats().
+ * - %FS_CREATE_SPARSE: the file's blocks are listed in an index, so that
+ *   growing it with fs_truncate() or by writing past its end leaves a hole
+ *   that takes no data block. Sparse files are an extension the reference
+ *   tools do not know.
+ * - %FS_CREATE_PACKED: while the file holds at most half a block, its data
+ *   sits in a slot of a block shared with other small files, and an empty
+ *   file uses no block at all. A file that grows larger moves to blocks of
+ *   its own. Packed files are an extension the reference tools do not know.
+ *
+ * The flags cannot be combined.
+ *
+ * Return: -1 in the same cases as fs_create(), if @flags is invalid, or if
+ * there is no free data block left. 0 otherwise.
+ */
+int fs_create_flags(const char *filename, int flags);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
@@ -81,6 +236,43 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** Directory entry as reported by fs_readdir() */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];	/* NULL-terminated file name */
+	uint32_t size;			/* File size in bytes */
+	uint16_t first_blk;		/* Index of the first data block */
+	uint16_t blocks;		/* Number of data blocks it owns */
+};
+
+/**
+ * fs_readdir - Get the content of the root directory
+ * @ents: Array to be filled with directory entries
+ * @max: Number of entries that @ents can hold
+ *
+ * Fill @ents with up to @max entries describing the files located in the root
+ * directory. Unlike fs_ls(), nothing is printed.
+ *
+ * The block count of an entry includes index blocks, and counts blocks shared
+ * with other files or snapshots as well. Packed files own no block, and data
+ * still buffered by fs_write() is not counted until written.
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * number of entries stored in @ents.
+ */
+int fs_readdir(struct fs_dirent *ents, int max);
+
+/**
+ * fs_stat_name - Get file status by name
+ * @filename: File name
+ * @ent: Entry to be filled like by fs_readdir(), may be NULL
+ *
+ * Like fs_stat(), without opening the file.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is no file
+ * named @filename. Otherwise return the current size of the file.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *ent);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -99,14 +291,36 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/** fs_open_flags() flag: every write goes to the end of the file */
+#define FS_OPEN_APPEND 0x01
+
+/**
+ * fs_open_flags - Open a file with options
+ * @filename: File name
+ * @flags: Bitwise OR of FS_OPEN_* flags
+ *
+ * Like fs_open(), with the following options:
+ * - %FS_OPEN_APPEND: before each fs_write() or fs_writev(), the offset of the
+ *   file descriptor is moved to the end of the file, as part of the same call,
+ *   so that writes through several descriptors never overwrite each other.
+ *   fs_pwrite() also writes at the end of the file, ignoring its offset
+ *   argument, and leaves the descriptor's offset unchanged. Reads still start
+ *   at the descriptor's offset.
+ *
+ * Return: -1 in the same cases as fs_open(), or if @flags is invalid.
+ * Otherwise, return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, writing the data it buffered to the file.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if its buffered data could not be written (the descriptor is
+ * closed anyway). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -130,12 +344,32 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset may be beyond the end of the file. Reading there returns 0 bytes,
+ * while writing there extends the file: the gap reads back as zeros. It is a
+ * hole taking no data block in files created with %FS_CREATE_SPARSE (and
+ * compressed or deduplicated ones); other files have it written.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open), or if @offset is out of bounds (beyond the end of the file). 0
- * otherwise.
+ * open), or if @offset is larger than %INT_MAX. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @length: New size of the file in bytes
+ *
+ * Set the size of the file pointed by file descriptor @fd to @length bytes.
+ * Shrinking the file frees the data blocks past its new end. Growing it adds
+ * bytes reading back as zeros, written to new data blocks unless the file
+ * can hold holes (see fs_lseek()). The file offset of @fd is not changed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if the file system is mounted read-only, or if there is not enough
+ * space left to record the change. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -152,8 +386,15 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * Small writes are buffered per file descriptor and only allocate blocks and
+ * reach the disk when the buffer fills up, when the file is read, truncated or
+ * closed, or on fs_sync(). Buffering only happens while the disk has room for
+ * the buffered data, but a disk error at that point is reported by fs_close()
+ * or fs_sync() rather than by fs_write().
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+ * open), or if writing previously buffered data failed. Otherwise return the
+ * number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -177,4 +418,426 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: Offset in the file to write at
+ *
+ * Like fs_write(), but write at @offset and leave the file offset of @fd
+ * untouched, so that users of a shared descriptor need not fs_lseek() first.
+ *
+ * Return: -1 in the same cases as fs_write(), or if @offset is larger than
+ * %INT_MAX. Otherwise return the number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file to read from
+ *
+ * Like fs_read(), but read from @offset and leave the file offset of @fd
+ * untouched.
+ *
+ * Return: -1 in the same cases as fs_read(), or if @offset is larger than
+ * %INT_MAX. Otherwise return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread_shareable - Tell whether fs_pread() can run concurrently
+ * @fd: File descriptor
+ *
+ * libfs calls must not run concurrently, except for fs_pread() of plain
+ * files (neither compressed, deduplicated, sparse nor packed) that hold no
+ * buffered writes: such calls only read the file system's state, and may run
+ * at the same time in several threads as long as no other libfs call runs
+ * meanwhile.
+ *
+ * Return: 1 if fs_pread() on @fd can run concurrently, 0 otherwise.
+ */
+int fs_pread_shareable(int fd);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Like fs_write() of the concatenation of the @iovcnt buffers of @iov. Small
+ * buffers are gathered, so that a write made of many pieces costs about as
+ * much as a single fs_write() of the same size.
+ *
+ * Return: -1 in the same cases as fs_write(), or if @iovcnt is negative.
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Like fs_read() into the concatenation of the @iovcnt buffers of @iov. The
+ * file is read in a single pass, whatever the number of buffers.
+ *
+ * Return: -1 in the same cases as fs_read(), or if @iovcnt is negative.
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Piece of a mapped file, see fs_map() */
+struct fs_seg {
+	const void *addr;	/* First byte */
+	size_t len;		/* Length in bytes */
+};
+
+/** Mapping of part of a file, filled by fs_map() */
+struct fs_map {
+	const void *addr;	/* Whole range if contiguous, NULL otherwise */
+	size_t len;		/* Length of the range in bytes */
+	int nsegs;		/* Number of segments of the range */
+	struct fs_seg *segs;	/* Segments in file order, NULL if contiguous */
+};
+
+/**
+ * fs_map - Map part of a file in memory
+ * @fd: File descriptor
+ * @offset: Offset in the file of the first byte to map
+ * @len: Number of bytes to map
+ * @map: Mapping to fill
+ *
+ * Give read-only access to the data of the file, in place in a mapping of the
+ * virtual disk file, without copying it. The range is shortened to the end of
+ * the file. If its blocks follow each other on disk, @map->addr points to the
+ * whole range; otherwise @map->segs lists the @map->nsegs pieces of it.
+ * Holes of sparse files map to zeros.
+ *
+ * The mapped memory must not be written to. It keeps showing the blocks of
+ * the file at the time of the call: its content is undefined once the file
+ * is written, truncated or deleted, and it goes away with fs_umount().
+ * Buffered writes are flushed first, and blocks are checked against their
+ * checksums like fs_read() would.
+ *
+ * Return: -1 if @fd is invalid, if @offset is larger than %INT_MAX, if the
+ * file is compressed, if the virtual disk file cannot be mapped, or if a block
+ * fails its checksum. 0 otherwise, @map to be released with fs_unmap().
+ */
+int fs_map(int fd, size_t offset, size_t len, struct fs_map *map);
+
+/**
+ * fs_unmap - Release a mapping
+ * @map: Mapping filled by fs_map()
+ *
+ * Return: -1 if @map is NULL. 0 otherwise.
+ */
+int fs_unmap(struct fs_map *map);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ * @name: Snapshot name
+ *
+ * Record the current state of the root directory and FAT under @name. Data
+ * blocks are not copied: they are shared with the live file system through
+ * reference counts, and fs_write() copies a shared block before modifying it.
+ * Taking a snapshot therefore only costs the metadata blocks. String @name
+ * follows the same rules as file names.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * mounted read-only, if @name is invalid or already used, if there are already
+ * %FS_SNAPSHOT_MAX_COUNT snapshots, or if there is not enough space left to
+ * save the metadata. 0 otherwise.
+ */
+int fs_snapshot_create(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Delete snapshot @name. Data blocks that were only referenced by this
+ * snapshot are returned to the free pool.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * mounted read-only, or if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_ls - List snapshots
+ *
+ * List the snapshots recorded in the file system.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_snapshot_ls(void);
+
+/**
+ * fs_mount_snapshot - Mount a snapshot read-only
+ * @diskname: Name of the virtual disk file
+ * @name: Snapshot name
+ *
+ * Like fs_mount(), but expose the files as they were when snapshot @name was
+ * taken. The file system is read-only: fs_create(), fs_delete(), fs_write()
+ * and snapshot management fail, and fs_umount() leaves the disk untouched.
+ *
+ * Return: -1 if the file system cannot be mounted or if there is no snapshot
+ * named @name. 0 otherwise.
+ */
+int fs_mount_snapshot(const char *diskname, const char *name);
+
+/** Deduplication statistics, as reported by fs_dedup_stats() */
+struct fs_dedup_stats {
+	uint32_t logical_blocks;	/* Blocks referenced by dedup files */
+	uint32_t physical_blocks;	/* Distinct blocks backing them */
+	uint32_t block_writes;		/* Full-block writes since mount */
+	uint32_t dedup_hits;		/* ... that found an identical block */
+};
+
+/**
+ * fs_dedup_stats - Get deduplication statistics
+ * @st: Statistics to fill
+ *
+ * The dedup ratio of the file system is @st->logical_blocks divided by
+ * @st->physical_blocks, and @st->dedup_hits out of @st->block_writes writes
+ * were saved since the file system was mounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_dedup_stats(struct fs_dedup_stats *st);
+
+/* Checksum verification policies, see fs_csum_policy() */
+#define FS_CSUM_OFF	0	/* Never verify */
+#define FS_CSUM_SAMPLED	1	/* Verify one read out of 16 */
+#define FS_CSUM_ALWAYS	2	/* Verify every read (default) */
+
+/** Checksum statistics, as reported by fs_csum_stats() */
+struct fs_csum_stats {
+	uint32_t verified;	/* Blocks verified since mount */
+	uint32_t errors;	/* ... whose checksum did not match */
+};
+
+/**
+ * fs_csum_enable - Enable block checksums
+ *
+ * Compute the CRC-32C of every data block in use and store them in a table
+ * saved on disk, which is kept up to date by every later block write. The
+ * setting is permanent and recorded in the superblock, it applies to all the
+ * later mounts of the disk. Reads of a block whose checksum does not match
+ * fail, see fs_csum_policy().
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * read-only or if there is not enough free space for the table. 0 otherwise.
+ */
+int fs_csum_enable(void);
+
+/**
+ * fs_csum_policy - Choose when checksums are verified
+ * @policy: %FS_CSUM_OFF, %FS_CSUM_SAMPLED or %FS_CSUM_ALWAYS
+ *
+ * Set how often reads check the blocks they return, until the file system is
+ * unmounted. Checksums are always kept up to date, whatever the policy.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if checksums are not
+ * enabled or if @policy is invalid. 0 otherwise.
+ */
+int fs_csum_policy(int policy);
+
+/**
+ * fs_csum_stats - Get checksum statistics
+ * @st: Statistics to fill
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_csum_stats(struct fs_csum_stats *st);
+
+/** Memory statistics, as reported by fs_mem_stats() */
+struct fs_mem_stats {
+	uint32_t arena_bytes;	/* Memory held for the mount */
+	uint32_t arena_used;	/* ... handed out to metadata and buffers */
+	uint32_t pool_bytes;	/* Scratch buffer pool, part of the above */
+	uint32_t pool_hits;	/* Scratch buffers taken from the pool */
+	uint32_t pool_misses;	/* ... and from the heap, pool exhausted */
+};
+
+/**
+ * fs_mem_stats - Get memory statistics
+ * @st: Statistics to fill
+ *
+ * All the memory of a mounted file system, metadata and I/O buffers alike, is
+ * allocated from one arena and given back by fs_umount(). Buffers for block
+ * I/O come from a pool inside the arena; @st->pool_misses counts the requests
+ * that did not fit in it and went to the heap.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_mem_stats(struct fs_mem_stats *st);
+
+/** Foreground calls stall once this many times the checkpoint threshold is dirty */
+#define FS_CHECKPOINT_HARD_FACTOR 4
+
+/** Checkpoint statistics, as reported by fs_checkpoint_stats() */
+struct fs_checkpoint_stats {
+	uint32_t checkpoints;	/* Checkpoints that wrote something */
+	uint32_t blocks;	/* Metadata blocks written by them */
+	uint32_t writes;	/* ... in that many disk writes */
+	uint32_t stalls;	/* Foreground calls held back by back-pressure */
+	uint64_t stall_ns;	/* ... and the time they waited */
+	uint64_t hold_ns;	/* Time calls were held out by metadata copies */
+	uint64_t hold_max_ns;	/* ... at most for one checkpoint */
+};
+
+/**
+ * fs_checkpoint_start - Start writing back metadata in the background
+ * @interval_ms: Longest time between checkpoints, 0 for no timer
+ * @dirty_bytes: Bytes changed by foreground calls that start a checkpoint
+ *
+ * Until fs_checkpoint_stop() or fs_umount(), a thread periodically makes the
+ * image consistent: it writes the superblock, FAT, root directory and block
+ * tables. Only blocks changed since the previous checkpoint are written,
+ * sorted by block number and in runs of contiguous blocks. Metadata is copied
+ * while foreground calls are held back, but written while they run, so that
+ * they never wait for the disk. The write buffers and compressed chunks are
+ * flushed by the next call after a checkpoint, and reach the following one.
+ * Once %FS_CHECKPOINT_HARD_FACTOR times @dirty_bytes are waiting for a
+ * checkpoint, calls changing the file system wait until it completes.
+ * fs_sync() flushes the buffers, then waits for a checkpoint instead of
+ * writing on its own.
+ *
+ * While the checkpointer runs, calls that change the file system count their
+ * bytes (a block for those that change metadata only) and take a shared lock.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * read-only, if a checkpointer is already running, if both @interval_ms and
+ * @dirty_bytes are 0, or if the thread cannot be started. 0 otherwise.
+ */
+int fs_checkpoint_start(unsigned int interval_ms, size_t dirty_bytes);
+
+/**
+ * fs_checkpoint_stop - Stop the background checkpointer
+ *
+ * Nothing is written back; use fs_sync() before, or fs_umount() after.
+ *
+ * Return: -1 if no checkpointer is running. 0 otherwise.
+ */
+int fs_checkpoint_stop(void);
+
+/**
+ * fs_checkpoint_stats - Get checkpoint statistics
+ * @st: Statistics to fill
+ *
+ * Counters start from zero with each fs_checkpoint_start().
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_checkpoint_stats(struct fs_checkpoint_stats *st);
+
+/** Warm-up statistics, as reported by fs_warm_stats() */
+struct fs_warm_stats {
+	uint32_t blocks;	/* Blocks listed by the sidecar at mount */
+	uint32_t read;		/* ... read by the warm-up so far */
+	uint32_t reads;		/* ... in that many disk reads */
+	uint32_t done;		/* 1 once the warm-up is over */
+	uint64_t ns;		/* Time from the mount to the end of the warm-up */
+	uint32_t recorded;	/* Blocks read since mount, to be recorded */
+};
+
+/**
+ * fs_warm_stats - Get warm-up statistics
+ * @st: Statistics to fill
+ *
+ * See %FS_MOUNT_WARM. The warm-up is over once every block of the sidecar was
+ * read, or at once without a valid sidecar. It is stopped by fs_umount() and
+ * fs_grow(). A sidecar does not match an image whose block size or layout
+ * changed since it was written, and is then ignored.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if it was not
+ * mounted with %FS_MOUNT_WARM. 0 otherwise.
+ */
+int fs_warm_stats(struct fs_warm_stats *st);
+
+/** Operations of trace records, one per traced call */
+enum fs_trace_op {
+	FS_TR_MOUNT = 1,	/* name: disk name, arg: flags */
+	FS_TR_UMOUNT,
+	FS_TR_SYNC,
+	FS_TR_INFO,
+	FS_TR_STATFS,
+	FS_TR_CREATE,		/* name, arg: flags */
+	FS_TR_DELETE,		/* name */
+	FS_TR_LS,
+	FS_TR_READDIR,		/* arg: @max */
+	FS_TR_STAT_NAME,	/* name */
+	FS_TR_OPEN,		/* name, arg: flags */
+	FS_TR_CLOSE,		/* fd */
+	FS_TR_STAT,		/* fd */
+	FS_TR_LSEEK,		/* fd, offset */
+	FS_TR_TRUNCATE,		/* fd, size: length */
+	FS_TR_READ,		/* fd, offset: file offset, size */
+	FS_TR_READV,		/* ... and arg: iovcnt */
+	FS_TR_PREAD,		/* fd, offset, size */
+	FS_TR_WRITE,		/* fd, offset: file offset, size */
+	FS_TR_WRITEV,		/* ... and arg: iovcnt */
+	FS_TR_PWRITE,		/* fd, offset, size */
+	FS_TR_MAP,		/* fd, offset, size */
+	FS_TR_UNMAP,
+	FS_TR_SNAP_CREATE,	/* name */
+	FS_TR_SNAP_DELETE,	/* name */
+	FS_TR_SNAP_LS,
+	FS_TR_MOUNT_SNAP,	/* name: snapshot name */
+	FS_TR_CSUM_ENABLE,
+	FS_TR_CSUM_POLICY,	/* arg: policy */
+	FS_TR_GROW,		/* size: data blocks */
+};
+
+/** Signature starting a trace file */
+#define FS_TRACE_MAGIC "FSTRACE1"
+
+/**
+ * Trace record, as written by the recorder. A trace file is %FS_TRACE_MAGIC
+ * followed by records, each one followed by the @name_len bytes of its name
+ * argument (not NULL-terminated). Unused fields are 0.
+ */
+struct __attribute__((__packed__)) fs_trace_rec {
+	uint8_t op;		/* enum fs_trace_op */
+	uint8_t name_len;	/* Bytes of name following the record */
+	uint16_t arg;		/* Flags, iovec count... see enum fs_trace_op */
+	int32_t fd;		/* File descriptor */
+	int32_t ret;		/* Return value */
+	uint32_t size;		/* Number of bytes */
+	uint32_t offset;	/* Offset in the file */
+	uint32_t dur_ns;	/* Duration of the call */
+	uint64_t start_ns;	/* Start of the call since fs_trace_start() */
+};
+
+/**
+ * fs_trace_start - Start recording calls
+ * @path: Trace file to create
+ *
+ * Record every call to the file system operations of this interface (but not
+ * to the statistics functions) in the trace file @path, until
+ * fs_trace_stop(). Records are buffered, and only cost a test of a flag while
+ * no trace is being recorded. Tracing may start before fs_mount().
+ *
+ * Return: -1 if a trace is already being recorded, or if @path cannot be
+ * created. 0 otherwise.
+ */
+int fs_trace_start(const char *path);
+
+/**
+ * fs_trace_stop - Stop recording calls
+ *
+ * Return: -1 if no trace was being recorded, or if some records could not be
+ * written. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _FS_H */
@@ -0,0 +1,464 @@
+#ifndef _FS_HPP
+#define _FS_HPP
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "fs.h"
+
+/*
+ * C++ interface.
+ *
+ * RAII handles over the C API: a Volume is the mounted file system and a File
+ * an open file descriptor. Both are move-only, and unmount or close when
+ * destroyed. Failures come back as an fs::Error in an fs::Result instead of
+ * -1. Like the C API, there is one mounted Volume at a time, and its Files
+ * must go before it.
+ *
+ * Volume and File are templated on a Layout, which fixes the block size and
+ * the FAT entry width at compile time. The block arithmetic of the
+ * block-level calls (File::read_blocks(), File::blocks()...) then compiles to
+ * shifts and masks, and Volume::mount() refuses images of another layout. The
+ * other calls are inlined straight to the C function.
+ */
+
+namespace fs {
+
+/** Reasons for failure */
+enum class Error {
+	invalid,	/* Invalid argument or descriptor */
+	not_found,	/* No such file */
+	exists,		/* File name already taken */
+	no_space,	/* No data block or root directory entry left */
+	read_only,	/* Volume mounted read-only */
+	busy,		/* Already mounted, file open, or too many open files */
+	layout,		/* Image of another layout than the Volume's */
+	io,		/* Any other failure of the C call */
+};
+
+/**
+ * error_str - Describe an error
+ * @e: Error
+ *
+ * Return: a static string.
+ */
+const char *error_str(Error e);
+
+/**
+ * Value of type T, or the Error that kept it from being produced. value(),
+ * operator*() and operator->() must only be used on a Result holding a
+ * value.
+ */
+template <typename T>
+class [[nodiscard]] Result {
+public:
+	Result(T value) : v_(std::in_place_index<0>, std::move(value)) {}
+	Result(Error e) : v_(std::in_place_index<1>, e) {}
+	/* Value built in place from @args */
+	template <typename... Args>
+	explicit Result(std::in_place_t, Args &&...args)
+		: v_(std::in_place_index<0>, std::forward<Args>(args)...) {}
+
+	bool has_value() const { return v_.index() == 0; }
+	explicit operator bool() const { return has_value(); }
+
+	T &value() & { return *std::get_if<0>(&v_); }
+	const T &value() const & { return *std::get_if<0>(&v_); }
+	T &&value() && { return std::move(*std::get_if<0>(&v_)); }
+	T &operator*() & { return value(); }
+	const T &operator*() const & { return value(); }
+	T &&operator*() && { return std::move(value()); }
+	T *operator->() { return &value(); }
+	const T *operator->() const { return &value(); }
+	/* The value, or @other without one */
+	T value_or(T other) const & { return has_value() ? value() : other; }
+
+	/* The error, only valid without a value */
+	Error error() const { return *std::get_if<1>(&v_); }
+
+private:
+	std::variant<T, Error> v_;
+};
+
+/** Success, or the Error of a call without a result */
+template <>
+class [[nodiscard]] Result<void> {
+public:
+	Result() : ok_(true), err_(Error::io) {}
+	Result(Error e) : ok_(false), err_(e) {}
+
+	bool has_value() const { return ok_; }
+	explicit operator bool() const { return ok_; }
+	Error error() const { return err_; }
+
+private:
+	bool ok_;
+	Error err_;
+};
+
+/**
+ * On-disk layout: @BlockSize bytes per block, FAT entries of type @FatEntry.
+ * Images record their block size in the superblock (see fs_format()); the
+ * FAT of every image has 16-bit entries, the type is a parameter so that the
+ * FAT arithmetic below is written once.
+ */
+template <std::size_t BlockSize = 4096, typename FatEntry = std::uint16_t>
+struct Layout {
+	static_assert(std::has_single_bit(BlockSize) && BlockSize >= 512 &&
+		      BlockSize <= 1024 * 1024,
+		      "block sizes are powers of two from 512 B to 1 MiB");
+	static_assert(std::is_same_v<FatEntry, std::uint16_t>,
+		      "libfs images have 16-bit FAT entries");
+
+	using fat_entry = FatEntry;
+
+	static constexpr std::size_t block_size = BlockSize;
+	static constexpr unsigned block_shift = std::countr_zero(BlockSize);
+	/* FAT entry ending a chain */
+	static constexpr FatEntry eoc = static_cast<FatEntry>(~FatEntry{0});
+	static constexpr std::size_t fat_entries_per_block = BlockSize / sizeof(FatEntry);
+
+	/* block holding byte @offset of a file, and the offset in it */
+	static constexpr std::size_t block_of(std::size_t offset) { return offset >> block_shift; }
+	static constexpr std::size_t offset_in_block(std::size_t offset) { return offset & (BlockSize - 1); }
+	/* blocks needed for @bytes bytes */
+	static constexpr std::size_t blocks_for(std::size_t bytes) { return (bytes + BlockSize - 1) >> block_shift; }
+	/* FAT blocks needed for @data_blocks data blocks */
+	static constexpr std::size_t fat_blocks(std::size_t data_blocks)
+	{
+		return (data_blocks + fat_entries_per_block - 1) / fat_entries_per_block;
+	}
+
+	/* whether a mounted file system, as reported by fs_statfs(), has it */
+	static constexpr bool matches(const struct fs_statfs &st)
+	{
+		return st.block_size == BlockSize &&
+		       st.fat_blocks >= fat_blocks(st.data_blocks);
+	}
+};
+
+/* Common configurations */
+using Layout512 = Layout<512>;
+using Layout4K = Layout<4096>;
+using Layout64K = Layout<65536>;
+
+/** Entry of a Directory */
+class DirEntry {
+public:
+	explicit DirEntry(const fs_dirent &e) : e_(&e) {}
+
+	std::string_view name() const { return e_->name; }
+	std::size_t size() const { return e_->size; }
+	/* Data blocks the file owns */
+	std::size_t blocks() const { return e_->blocks; }
+
+private:
+	const fs_dirent *e_;
+};
+
+/** The entries of the root directory at the time it was read */
+class Directory {
+public:
+	class iterator {
+	public:
+		using value_type = DirEntry;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+		explicit iterator(const fs_dirent *p) : p_(p) {}
+		DirEntry operator*() const { return DirEntry(*p_); }
+		iterator &operator++() { ++p_; return *this; }
+		iterator operator++(int) { iterator it = *this; ++p_; return it; }
+		bool operator==(const iterator &) const = default;
+
+	private:
+		const fs_dirent *p_ = nullptr;
+	};
+
+	/* Empty, see read(). Not defaulted: the array is left uninitialized */
+	Directory() {}
+
+	/* Read the directory of the mounted file system */
+	static Result<Directory> read()
+	{
+		Result<Directory> r(std::in_place); // filled in place, not copied
+		int n = fs_readdir(r->ents_.data(), r->ents_.size());
+		if (n < 0)
+			r = Error::invalid; // nothing mounted
+		else
+			r->n_ = n;
+		return r;
+	}
+
+	iterator begin() const { return iterator(ents_.data()); }
+	iterator end() const { return iterator(ents_.data() + n_); }
+	std::size_t size() const { return n_; }
+	bool empty() const { return n_ == 0; }
+
+private:
+	std::array<fs_dirent, FS_FILE_MAX_COUNT> ents_;
+	std::size_t n_ = 0;
+};
+
+namespace detail {
+
+/* NULL-terminated copy of a file name, empty if too long */
+class Name {
+public:
+	explicit Name(std::string_view name)
+	{
+		buf_[0] = '\0';
+		if (name.size() >= sizeof(buf_) || name.find('\0') != name.npos)
+			return; // too long, or would be cut short
+		std::memcpy(buf_, name.data(), name.size());
+		buf_[name.size()] = '\0';
+	}
+	const char *c_str() const { return buf_; }
+	bool valid() const { return buf_[0] != '\0'; }
+
+private:
+	char buf_[FS_FILENAME_LEN];
+};
+
+/* Error of a failed call, found by looking at the file system */
+Error mount_error();
+Error create_error(const Name &name);
+Error open_error(const Name &name, int flags);
+Error delete_error(const Name &name);
+Error fd_error(int fd);
+
+} // namespace detail
+
+template <typename L>
+class Volume;
+
+/** Open file, closed when destroyed */
+template <typename L = Layout<>>
+class File {
+public:
+	File(File &&o) noexcept : fd_(std::exchange(o.fd_, -1)) {}
+	File &operator=(File &&o) noexcept
+	{
+		if (this != &o) {
+			release();
+			fd_ = std::exchange(o.fd_, -1);
+		}
+		return *this;
+	}
+	File(const File &) = delete;
+	File &operator=(const File &) = delete;
+	~File() { release(); }
+
+	/* Descriptor for the C API, -1 once closed */
+	int fd() const { return fd_; }
+
+	/* At the file offset, which moves past the bytes transferred */
+	Result<std::size_t> read(std::span<std::byte> buf)
+	{
+		return count(fs_read(fd_, buf.data(), buf.size()));
+	}
+	Result<std::size_t> write(std::span<const std::byte> buf)
+	{
+		return count(fs_write(fd_, const_cast<std::byte *>(buf.data()), buf.size()));
+	}
+
+	/* At @offset, the file offset is left alone */
+	Result<std::size_t> read_at(std::span<std::byte> buf, std::size_t offset)
+	{
+		return count(fs_pread(fd_, buf.data(), buf.size(), offset));
+	}
+	Result<std::size_t> write_at(std::span<const std::byte> buf, std::size_t offset)
+	{
+		return count(fs_pwrite(fd_, const_cast<std::byte *>(buf.data()), buf.size(), offset));
+	}
+
+	/* Whole blocks from block @first, @buf holds a whole number of blocks */
+	Result<std::size_t> read_blocks(std::size_t first, std::span<std::byte> buf)
+	{
+		if (L::offset_in_block(buf.size()) != 0)
+			return Error::invalid;
+		return read_at(buf, first << L::block_shift);
+	}
+	Result<std::size_t> write_blocks(std::size_t first, std::span<const std::byte> buf)
+	{
+		if (L::offset_in_block(buf.size()) != 0)
+			return Error::invalid;
+		return write_at(buf, first << L::block_shift);
+	}
+
+	Result<void> seek(std::size_t offset) { return status(fs_lseek(fd_, offset)); }
+	Result<void> truncate(std::size_t length) { return status(fs_truncate(fd_, length)); }
+
+	Result<std::size_t> size() const { return count(fs_stat(fd_)); }
+	/* Blocks spanned by the file's bytes */
+	Result<std::size_t> blocks() const
+	{
+		int size = fs_stat(fd_);
+		if (size < 0)
+			return detail::fd_error(fd_);
+		return L::blocks_for(size);
+	}
+
+	/* Close now, reporting a failure to write buffered data */
+	Result<void> close() { return status(fs_close(std::exchange(fd_, -1))); }
+
+private:
+	friend class Volume<L>;
+	explicit File(int fd) : fd_(fd) {}
+
+	void release() noexcept
+	{
+		if (fd_ >= 0)
+			fs_close(fd_);
+		fd_ = -1;
+	}
+	Result<std::size_t> count(int ret) const
+	{
+		if (ret < 0)
+			return detail::fd_error(fd_);
+		return static_cast<std::size_t>(ret);
+	}
+	Result<void> status(int ret) const
+	{
+		if (ret < 0)
+			return detail::fd_error(fd_);
+		return {};
+	}
+
+	int fd_;
+};
+
+/** Mounted file system, unmounted when destroyed */
+template <typename L = Layout<>>
+class Volume {
+public:
+	/* fs_mount_flags(), FS_MOUNT_* @flags */
+	static Result<Volume> mount(const char *diskname, int flags = 0)
+	{
+		if (fs_mount_flags(diskname, flags) != 0)
+			return detail::mount_error();
+		Volume v(flags);
+		struct fs_statfs st;
+		if (fs_statfs(&st) != 0 || !L::matches(st))
+			return Error::layout; // unmounted by v
+		return v;
+	}
+
+	Volume(Volume &&o) noexcept
+		: mounted_(std::exchange(o.mounted_, false)), flags_(o.flags_) {}
+	Volume &operator=(Volume &&o) noexcept
+	{
+		if (this != &o) {
+			release();
+			mounted_ = std::exchange(o.mounted_, false);
+			flags_ = o.flags_;
+		}
+		return *this;
+	}
+	Volume(const Volume &) = delete;
+	Volume &operator=(const Volume &) = delete;
+	~Volume() { release(); }
+
+	/* Unmount now, closing the descriptors of the Files still open */
+	Result<void> unmount()
+	{
+		if (!mounted_)
+			return Error::invalid;
+		mounted_ = false;
+		if (fs_umount() != 0)
+			return Error::io;
+		return {};
+	}
+
+	/* False once unmounted or moved from, every call then fails */
+	bool mounted() const { return mounted_; }
+
+	bool read_only() const { return flags_ & FS_MOUNT_RDONLY; }
+
+	Result<void> sync() { return status(mounted_ ? fs_sync() : -1); }
+	Result<void> grow(std::size_t data_blocks)
+	{
+		return status(mounted_ ? fs_grow(data_blocks) : -1);
+	}
+
+	Result<struct fs_statfs> statfs() const
+	{
+		struct fs_statfs st;
+		if (!mounted_ || fs_statfs(&st) != 0)
+			return Error::invalid;
+		return st;
+	}
+
+	/* fs_create_flags(), FS_CREATE_* @flags */
+	Result<void> create(std::string_view name, int flags = 0)
+	{
+		detail::Name n(name);
+		if (!mounted_ || !n.valid())
+			return Error::invalid;
+		if (fs_create_flags(n.c_str(), flags) != 0)
+			return read_only() ? Error::read_only : detail::create_error(n);
+		return {};
+	}
+
+	Result<void> remove(std::string_view name)
+	{
+		detail::Name n(name);
+		if (!mounted_ || !n.valid())
+			return Error::invalid;
+		if (fs_delete(n.c_str()) != 0)
+			return read_only() ? Error::read_only : detail::delete_error(n);
+		return {};
+	}
+
+	/* fs_open_flags(), FS_OPEN_* @flags */
+	Result<File<L>> open(std::string_view name, int flags = 0)
+	{
+		detail::Name n(name);
+		if (!mounted_ || !n.valid())
+			return Error::invalid;
+		int fd = fs_open_flags(n.c_str(), flags);
+		if (fd < 0)
+			return detail::open_error(n, flags);
+		return File<L>(fd);
+	}
+
+	Result<Directory> entries() const
+	{
+		if (!mounted_)
+			return Error::invalid;
+		return Directory::read();
+	}
+
+private:
+	explicit Volume(int flags) : mounted_(true), flags_(flags) {}
+
+	void release() noexcept
+	{
+		if (mounted_)
+			fs_umount();
+		mounted_ = false;
+	}
+	Result<void> status(int ret) const
+	{
+		if (!mounted_)
+			return Error::invalid;
+		if (ret != 0)
+			return read_only() ? Error::read_only : Error::io;
+		return {};
+	}
+
+	bool mounted_;
+	int flags_;
+};
+
+} // namespace fs
+
+#endif /* _FS_HPP */
@@ -0,0 +1,231 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "disk.h"
+#include "fs_aio.h"
+
+/*
+ * Requests are started one at a time, in submission order, while holding
+ * fsLock. Shareable reads then only keep dataLock shared while transferring,
+ * so that several of them overlap; any other request keeps both locks until
+ * done. A request thus sees the effects of all the requests before it.
+ */
+
+struct fs_aio {
+	pthread_mutex_t fsLock;		// held while starting a request
+	pthread_rwlock_t dataLock;	// shared by reads in progress
+
+	pthread_mutex_t qLock;		// protects everything below
+	pthread_cond_t work;		// signaled when a request is queued
+	pthread_cond_t done;		// signaled when a request completes
+	struct fsa_req sq[FSA_QUEUE_DEPTH]; // submitted, not started
+	int sqHead, sqLen;
+	struct fsa_result cq[FSA_QUEUE_DEPTH]; // completed, not reaped
+	int cqHead, cqLen;
+	int inflight;			// submitted, not reaped
+	int stop;
+
+	int efd;
+	int nthreads;
+	pthread_t *threads;
+};
+
+/* returns the oldest queued request in req, 0 if there is none */
+static int pop(struct fs_aio *a, struct fsa_req *req)
+{
+	pthread_mutex_lock(&a->qLock);
+	int found = a->sqLen > 0;
+	if (found) {
+		*req = a->sq[a->sqHead];
+		a->sqHead = (a->sqHead + 1) % FSA_QUEUE_DEPTH;
+		a->sqLen--;
+	}
+	pthread_mutex_unlock(&a->qLock);
+	return found;
+}
+
+static void complete(struct fs_aio *a, const struct fsa_req *req, int ret)
+{
+	pthread_mutex_lock(&a->qLock);
+	struct fsa_result *res = &a->cq[(a->cqHead + a->cqLen) % FSA_QUEUE_DEPTH];
+	res->data = req->data;
+	res->ret = ret;
+	a->cqLen++;
+	pthread_cond_broadcast(&a->done);
+	pthread_mutex_unlock(&a->qLock);
+
+	uint64_t one = 1;
+	if (write(a->efd, &one, sizeof(one)) != sizeof(one))
+		return; // counter saturated, readable anyway
+}
+
+/* run req, fsLock is held and released here */
+static int execute(struct fs_aio *a, const struct fsa_req *req)
+{
+	int ret;
+	if (req->op == FSA_READ && fs_pread_shareable(req->fd)) {
+		pthread_rwlock_rdlock(&a->dataLock);
+		pthread_mutex_unlock(&a->fsLock);
+		ret = fs_pread(req->fd, req->buf, req->count, req->offset);
+		pthread_rwlock_unlock(&a->dataLock);
+		return ret;
+	}
+
+	pthread_rwlock_wrlock(&a->dataLock);
+	if (req->op == FSA_READ)
+		ret = fs_pread(req->fd, req->buf, req->count, req->offset);
+	else if (req->op == FSA_WRITE)
+		ret = fs_pwrite(req->fd, req->buf, req->count, req->offset);
+	else if (req->op == FSA_SYNC)
+		ret = fs_sync();
+	else
+		ret = -1;
+	pthread_rwlock_unlock(&a->dataLock);
+	pthread_mutex_unlock(&a->fsLock);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	struct fs_aio *a = arg;
+	for (;;) {
+		pthread_mutex_lock(&a->qLock);
+		while (a->sqLen == 0 && !a->stop)
+			pthread_cond_wait(&a->work, &a->qLock);
+		int quit = a->sqLen == 0;
+		pthread_mutex_unlock(&a->qLock);
+		if (quit)
+			return NULL; // stopping, and nothing left to do
+
+		// Another worker may have been faster
+		struct fsa_req req;
+		pthread_mutex_lock(&a->fsLock);
+		if (!pop(a, &req)) {
+			pthread_mutex_unlock(&a->fsLock);
+			continue;
+		}
+		complete(a, &req, execute(a, &req));
+	}
+}
+
+struct fs_aio *fsa_create(int nthreads)
+{
+	if (block_disk_count() == -1 || nthreads <= 0)
+		return NULL;
+
+	struct fs_aio *a = calloc(1, sizeof(*a));
+	a->threads = calloc(nthreads, sizeof(pthread_t));
+	a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (a->efd < 0) {
+		free(a->threads);
+		free(a);
+		return NULL;
+	}
+	pthread_mutex_init(&a->fsLock, NULL);
+	pthread_rwlock_init(&a->dataLock, NULL);
+	pthread_mutex_init(&a->qLock, NULL);
+	pthread_cond_init(&a->work, NULL);
+	pthread_cond_init(&a->done, NULL);
+
+	for (a->nthreads = 0; a->nthreads < nthreads; a->nthreads++) {
+		if (pthread_create(&a->threads[a->nthreads], NULL, worker, a) != 0)
+			break;
+	}
+	if (a->nthreads == 0) {
+		fsa_destroy(a);
+		return NULL;
+	}
+	return a;
+}
+
+int fsa_destroy(struct fs_aio *a)
+{
+	if (!a)
+		return -1;
+
+	pthread_mutex_lock(&a->qLock);
+	a->stop = 1;
+	pthread_cond_broadcast(&a->work);
+	pthread_mutex_unlock(&a->qLock);
+	for (int i = 0; i < a->nthreads; i++)
+		pthread_join(a->threads[i], NULL);
+
+	pthread_cond_destroy(&a->done);
+	pthread_cond_destroy(&a->work);
+	pthread_mutex_destroy(&a->qLock);
+	pthread_rwlock_destroy(&a->dataLock);
+	pthread_mutex_destroy(&a->fsLock);
+	close(a->efd);
+	free(a->threads);
+	free(a);
+	return 0;
+}
+
+int fsa_submit(struct fs_aio *a, const struct fsa_req *reqs, int n)
+{
+	if (!a || n < 0)
+		return -1;
+
+	pthread_mutex_lock(&a->qLock);
+	if (n > FSA_QUEUE_DEPTH - a->inflight)
+		n = FSA_QUEUE_DEPTH - a->inflight;
+	for (int i = 0; i < n; i++)
+		a->sq[(a->sqHead + a->sqLen++) % FSA_QUEUE_DEPTH] = reqs[i];
+	a->inflight += n;
+	if (n > 0)
+		pthread_cond_broadcast(&a->work);
+	pthread_mutex_unlock(&a->qLock);
+	return n;
+}
+
+int fsa_reap(struct fs_aio *a, struct fsa_result *res, int min, int max)
+{
+	if (!a || min < 0 || max < min)
+		return -1;
+
+	pthread_mutex_lock(&a->qLock);
+	if (min > a->inflight) {
+		pthread_mutex_unlock(&a->qLock);
+		return -1; // would wait forever
+	}
+	while (a->cqLen < min)
+		pthread_cond_wait(&a->done, &a->qLock);
+
+	int n = a->cqLen < max ? a->cqLen : max;
+	for (int i = 0; i < n; i++) {
+		res[i] = a->cq[a->cqHead];
+		a->cqHead = (a->cqHead + 1) % FSA_QUEUE_DEPTH;
+	}
+	a->cqLen -= n;
+	a->inflight -= n;
+	pthread_mutex_unlock(&a->qLock);
+	return n;
+}
+
+int fsa_eventfd(struct fs_aio *a)
+{
+	return a ? a->efd : -1;
+}
+
+int fsa_lock(struct fs_aio *a)
+{
+	if (!a)
+		return -1;
+
+	pthread_mutex_lock(&a->fsLock);
+	pthread_rwlock_wrlock(&a->dataLock);
+	return 0;
+}
+
+int fsa_unlock(struct fs_aio *a)
+{
+	if (!a)
+		return -1;
+
+	pthread_rwlock_unlock(&a->dataLock);
+	pthread_mutex_unlock(&a->fsLock);
+	return 0;
+}
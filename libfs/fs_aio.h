@@ -0,0 +1,134 @@
+#ifndef _FS_AIO_H
+#define _FS_AIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Asynchronous file I/O.
+ *
+ * Requests are submitted in batches to a context, executed by its pool of
+ * worker threads as fs_pread() and fs_pwrite() calls, and their completions
+ * reaped later, by polling or after an eventfd notification. Reads of plain
+ * files run in parallel (see fs_pread_shareable()), anything else runs one at
+ * a time.
+ */
+
+/** Maximum number of requests in flight (submitted, not reaped yet) */
+#define FSA_QUEUE_DEPTH 256
+
+/** Operations of a request */
+enum fsa_op {
+	FSA_READ,	/* fs_pread() */
+	FSA_WRITE,	/* fs_pwrite() */
+	FSA_SYNC,	/* fs_sync() */
+};
+
+/** Request, as given to fsa_submit() */
+struct fsa_req {
+	int op;		/* Operation, one of enum fsa_op */
+	int fd;		/* File descriptor */
+	void *buf;	/* Data to write, or buffer to fill */
+	size_t count;	/* Number of bytes */
+	size_t offset;	/* Offset in the file */
+	void *data;	/* Caller's data, reported back at completion */
+};
+
+/** Completion of a request, as reported by fsa_reap() */
+struct fsa_result {
+	void *data;	/* @data of the request */
+	int ret;	/* Return value of the libfs call */
+};
+
+/** Context executing requests */
+struct fs_aio;
+
+/**
+ * fsa_create - Create a context
+ * @nthreads: Number of worker threads
+ *
+ * While a context has requests in flight, other libfs calls must be made
+ * between fsa_lock() and fsa_unlock().
+ *
+ * Return: NULL if no file system is mounted, if @nthreads is not positive, or
+ * if the context cannot be set up. Otherwise return a context to be released
+ * with fsa_destroy().
+ */
+struct fs_aio *fsa_create(int nthreads);
+
+/**
+ * fsa_destroy - Release a context
+ * @a: Context
+ *
+ * Wait for the requests in flight to complete, then stop the worker threads.
+ * Completions not reaped yet are lost.
+ *
+ * Return: -1 if @a is invalid. 0 otherwise.
+ */
+int fsa_destroy(struct fs_aio *a);
+
+/**
+ * fsa_submit - Queue requests
+ * @a: Context
+ * @reqs: Requests
+ * @n: Number of requests in @reqs
+ *
+ * Requests start in submission order, and each one sees the effects of all
+ * the requests submitted before it. Reads of plain files overlap with each
+ * other, so completions may come back in any order. Buffers must stay valid
+ * until the request is reaped.
+ *
+ * Return: -1 if @a is invalid. Otherwise return the number of requests
+ * queued, which is smaller than @n if %FSA_QUEUE_DEPTH requests would
+ * otherwise be in flight.
+ */
+int fsa_submit(struct fs_aio *a, const struct fsa_req *reqs, int n);
+
+/**
+ * fsa_reap - Collect completions
+ * @a: Context
+ * @res: Array to be filled with completions
+ * @min: Number of completions to wait for, 0 to poll
+ * @max: Number of entries that @res can hold
+ *
+ * Return: -1 if @a is invalid or if waiting for @min completions would never
+ * end (fewer requests in flight). Otherwise return the number of completions
+ * stored in @res.
+ */
+int fsa_reap(struct fs_aio *a, struct fsa_result *res, int min, int max);
+
+/**
+ * fsa_eventfd - Get the notification descriptor of a context
+ * @a: Context
+ *
+ * The returned eventfd is readable while completions wait to be reaped: its
+ * counter is incremented for each one. Reading it resets the counter, but
+ * does not reap anything; event loops should read it, then fsa_reap() with a
+ * @min of 0.
+ *
+ * Return: -1 if @a is invalid. Otherwise return the eventfd, owned by @a.
+ */
+int fsa_eventfd(struct fs_aio *a);
+
+/**
+ * fsa_lock - Suspend request execution
+ * @a: Context
+ *
+ * Wait for the requests being executed, and keep the workers from starting
+ * new ones until fsa_unlock(), so that other libfs calls can be made safely.
+ *
+ * Return: -1 if @a is invalid. 0 otherwise.
+ */
+int fsa_lock(struct fs_aio *a);
+
+/**
+ * fsa_unlock - Resume request execution
+ * @a: Context
+ *
+ * Return: -1 if @a is invalid. 0 otherwise.
+ */
+int fsa_unlock(struct fs_aio *a);
+
+#endif /* _FS_AIO_H */
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs_client.h"
+
+#define client_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+struct fs_client {
+	int sock;
+	uint32_t nextTag;
+	int inFlight; // requests sent or queued but not reaped yet
+
+	// requests queued but not sent yet
+	char *out;
+	size_t outLen;
+	size_t outCap;
+};
+
+/* write all of buf, retrying on short writes */
+static int write_full(int sock, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(sock, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* read exactly len bytes, NULL buf discards them */
+static int read_full(int sock, void *buf, size_t len)
+{
+	char scratch[4096];
+	char *p = buf;
+	while (len > 0) {
+		size_t want = len;
+		char *dst = p;
+		if (!buf) {
+			dst = scratch;
+			if (want > sizeof(scratch))
+				want = sizeof(scratch);
+		}
+		ssize_t n = read(sock, dst, want);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return -1;
+		}
+		if (n == 0) {
+			client_error("connection closed by server");
+			return -1;
+		}
+		if (buf)
+			p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct fs_client *fsc_connect(const char *sockpath)
+{
+	struct sockaddr_un addr;
+
+	if (!sockpath || strlen(sockpath) >= sizeof(addr.sun_path)) {
+		client_error("invalid socket path");
+		return NULL;
+	}
+
+	struct fs_client *c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->sock < 0) {
+		perror("socket");
+		free(c);
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+	if (connect(c->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		close(c->sock);
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+int fsc_disconnect(struct fs_client *c)
+{
+	if (!c)
+		return -1;
+
+	close(c->sock);
+	free(c->out);
+	free(c);
+	return 0;
+}
+
+int fsc_submit(struct fs_client *c, int op, int fd, uint32_t arg,
+	       const void *data, size_t len)
+{
+	if (!c || len > FSP_MAX_PAYLOAD)
+		return -1;
+
+	// Grow the send buffer if needed
+	size_t need = c->outLen + sizeof(struct fsp_req) + len;
+	if (need > c->outCap) {
+		size_t cap = c->outCap ? c->outCap : 4096;
+		while (cap < need)
+			cap *= 2;
+		char *out = realloc(c->out, cap);
+		if (!out)
+			return -1;
+		c->out = out;
+		c->outCap = cap;
+	}
+
+	struct fsp_req req = {
+		.len = len,
+		.tag = c->nextTag++,
+		.op = op,
+		.fd = fd,
+		.arg = arg,
+	};
+	memcpy(c->out + c->outLen, &req, sizeof(req));
+	if (len)
+		memcpy(c->out + c->outLen + sizeof(req), data, len);
+	c->outLen = need;
+	c->inFlight++;
+
+	return req.tag;
+}
+
+int fsc_flush(struct fs_client *c)
+{
+	if (!c)
+		return -1;
+
+	if (c->outLen == 0)
+		return 0;
+
+	if (write_full(c->sock, c->out, c->outLen) != 0)
+		return -1;
+	c->outLen = 0;
+	return 0;
+}
+
+int fsc_reap(struct fs_client *c, struct fsc_result *res, void *buf,
+	     size_t size)
+{
+	struct fsp_resp resp;
+
+	if (!c || c->inFlight == 0)
+		return -1;
+
+	// Make sure the request we are waiting for has actually been sent
+	if (fsc_flush(c) != 0)
+		return -1;
+
+	if (read_full(c->sock, &resp, sizeof(resp)) != 0)
+		return -1;
+
+	size_t keep = resp.len;
+	if (!buf || keep > size)
+		keep = buf ? size : 0;
+	if (keep && read_full(c->sock, buf, keep) != 0)
+		return -1;
+	if (resp.len > keep && read_full(c->sock, NULL, resp.len - keep) != 0)
+		return -1;
+
+	c->inFlight--;
+	res->tag = resp.tag;
+	res->ret = resp.ret;
+	res->len = keep;
+	return 0;
+}
+
+/* submit a single request and wait for its completion */
+static int call(struct fs_client *c, int op, int fd, uint32_t arg,
+		const void *data, size_t len, void *buf, size_t size)
+{
+	struct fsc_result res;
+
+	if (fsc_submit(c, op, fd, arg, data, len) < 0)
+		return -1;
+
+	// Drain older pipelined completions first
+	do {
+		if (fsc_reap(c, &res, buf, size) != 0)
+			return -1;
+	} while (c->inFlight > 0);
+
+	return res.ret;
+}
+
+int fsc_create(struct fs_client *c, const char *filename)
+{
+	return call(c, FSP_CREATE, -1, 0, filename, strlen(filename) + 1,
+		    NULL, 0);
+}
+
+int fsc_delete(struct fs_client *c, const char *filename)
+{
+	return call(c, FSP_DELETE, -1, 0, filename, strlen(filename) + 1,
+		    NULL, 0);
+}
+
+int fsc_open(struct fs_client *c, const char *filename)
+{
+	return call(c, FSP_OPEN, -1, 0, filename, strlen(filename) + 1,
+		    NULL, 0);
+}
+
+int fsc_close(struct fs_client *c, int fd)
+{
+	return call(c, FSP_CLOSE, fd, 0, NULL, 0, NULL, 0);
+}
+
+int fsc_stat(struct fs_client *c, int fd)
+{
+	return call(c, FSP_STAT, fd, 0, NULL, 0, NULL, 0);
+}
+
+int fsc_lseek(struct fs_client *c, int fd, size_t offset)
+{
+	return call(c, FSP_LSEEK, fd, offset, NULL, 0, NULL, 0);
+}
+
+int fsc_read(struct fs_client *c, int fd, void *buf, size_t count)
+{
+	if (count > FSP_MAX_PAYLOAD)
+		count = FSP_MAX_PAYLOAD;
+	return call(c, FSP_READ, fd, count, NULL, 0, buf, count);
+}
+
+int fsc_write(struct fs_client *c, int fd, const void *buf, size_t count)
+{
+	if (count > FSP_MAX_PAYLOAD)
+		count = FSP_MAX_PAYLOAD;
+	return call(c, FSP_WRITE, fd, 0, buf, count, NULL, 0);
+}
+
+int fsc_ls(struct fs_client *c, struct fs_dirent *ents, int max)
+{
+	int n = call(c, FSP_LS, -1, 0, NULL, 0, ents, max * sizeof(*ents));
+	return n > max ? max : n;
+}
@@ -0,0 +1,96 @@
+#ifndef _FS_CLIENT_H
+#define _FS_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+#include "fs_proto.h"
+
+/** Connection to a running fs_server */
+struct fs_client;
+
+/** Completion of a pipelined request, as reported by fsc_reap() */
+struct fsc_result {
+	uint32_t tag;	/* Tag returned by fsc_submit() */
+	int ret;	/* Return value of the remote libfs call */
+	size_t len;	/* Number of payload bytes copied out */
+};
+
+/**
+ * fsc_connect - Connect to a file system server
+ * @sockpath: Path of the server's Unix domain socket
+ *
+ * Return: NULL if the connection cannot be established. Otherwise return a
+ * client handle to be released with fsc_disconnect().
+ */
+struct fs_client *fsc_connect(const char *sockpath);
+
+/**
+ * fsc_disconnect - Close a connection
+ * @c: Client handle
+ *
+ * Close the connection and release @c. File descriptors still open on the
+ * server on behalf of this connection are closed by the server.
+ *
+ * Return: -1 if @c is invalid. 0 otherwise.
+ */
+int fsc_disconnect(struct fs_client *c);
+
+/**
+ * fsc_submit - Queue a request without waiting for its completion
+ * @c: Client handle
+ * @op: Operation (one of enum fsp_op)
+ * @fd: File descriptor for fd based operations, ignored otherwise
+ * @arg: Byte count or offset, depending on @op
+ * @data: Payload (filename or data to write), may be NULL if @len is 0
+ * @len: Number of payload bytes
+ *
+ * Queue a request in the connection's send buffer. Queued requests are sent
+ * in a single batch by fsc_flush(), or implicitly by fsc_reap(). Any number
+ * of requests can be in flight; their completions come back in order.
+ *
+ * Return: -1 if @c is invalid or the payload is too large. Otherwise return
+ * the tag identifying the request.
+ */
+int fsc_submit(struct fs_client *c, int op, int fd, uint32_t arg,
+	       const void *data, size_t len);
+
+/**
+ * fsc_flush - Send all queued requests
+ * @c: Client handle
+ *
+ * Return: -1 if the connection failed. 0 otherwise.
+ */
+int fsc_flush(struct fs_client *c);
+
+/**
+ * fsc_reap - Wait for the completion of the oldest in-flight request
+ * @c: Client handle
+ * @res: Completion information
+ * @buf: Buffer receiving the response payload (read data, listing), or NULL
+ * @size: Size of @buf in bytes
+ *
+ * Payload bytes that do not fit into @buf are discarded.
+ *
+ * Return: -1 if no request is in flight or if the connection failed. 0
+ * otherwise.
+ */
+int fsc_reap(struct fs_client *c, struct fsc_result *res, void *buf,
+	     size_t size);
+
+/*
+ * Synchronous helpers. Each one submits a single request and waits for its
+ * completion; they behave like their fs_*() counterparts in fs.h.
+ */
+int fsc_create(struct fs_client *c, const char *filename);
+int fsc_delete(struct fs_client *c, const char *filename);
+int fsc_open(struct fs_client *c, const char *filename);
+int fsc_close(struct fs_client *c, int fd);
+int fsc_stat(struct fs_client *c, int fd);
+int fsc_lseek(struct fs_client *c, int fd, size_t offset);
+int fsc_read(struct fs_client *c, int fd, void *buf, size_t count);
+int fsc_write(struct fs_client *c, int fd, const void *buf, size_t count);
+int fsc_ls(struct fs_client *c, struct fs_dirent *ents, int max);
+
+#endif /* _FS_CLIENT_H */
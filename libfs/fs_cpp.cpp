@@ -0,0 +1,77 @@
+#include "fs.hpp"
+
+/*
+ * Out-of-line parts of the C++ interface: the C API only reports -1, so the
+ * cause of a failure is found by looking at the file system afterwards. This
+ * is off the fast path, which stays inline in fs.hpp.
+ */
+
+namespace fs {
+
+const char *error_str(Error e)
+{
+	switch (e) {
+	case Error::invalid:	return "invalid argument";
+	case Error::not_found:	return "no such file";
+	case Error::exists:	return "file exists";
+	case Error::no_space:	return "no space left";
+	case Error::read_only:	return "read-only file system";
+	case Error::busy:	return "busy";
+	case Error::layout:	return "unexpected layout";
+	case Error::io:		return "I/O error";
+	}
+	return "unknown error";
+}
+
+namespace detail {
+
+static bool mounted()
+{
+	struct fs_statfs st;
+	return fs_statfs(&st) == 0;
+}
+
+Error mount_error()
+{
+	// a failed mount leaves nothing mounted, unless something already was
+	return mounted() ? Error::busy : Error::io;
+}
+
+Error create_error(const Name &name)
+{
+	struct fs_statfs st;
+	if (fs_statfs(&st) != 0)
+		return Error::invalid;
+	if (fs_stat_name(name.c_str(), NULL) >= 0)
+		return Error::exists;
+	if (st.free_files == 0 || st.free_blocks == 0)
+		return Error::no_space;
+	return Error::invalid;
+}
+
+Error open_error(const Name &name, int flags)
+{
+	if (!mounted() || (flags & ~FS_OPEN_APPEND))
+		return Error::invalid;
+	if (fs_stat_name(name.c_str(), NULL) < 0)
+		return Error::not_found;
+	return Error::busy; // out of descriptors
+}
+
+Error delete_error(const Name &name)
+{
+	if (!mounted())
+		return Error::invalid;
+	if (fs_stat_name(name.c_str(), NULL) < 0)
+		return Error::not_found;
+	return Error::io;
+}
+
+Error fd_error(int fd)
+{
+	return fs_stat(fd) < 0 ? Error::invalid : Error::io;
+}
+
+} // namespace detail
+
+} // namespace fs
@@ -0,0 +1,49 @@
+#ifndef _FS_PROTO_H
+#define _FS_PROTO_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Wire protocol spoken between fs_server and the client library.
+ *
+ * Every message is a fixed-size header optionally followed by @len bytes of
+ * payload. A client may send any number of requests before reading back the
+ * responses (pipelining); the server executes them in order and answers each
+ * one with a response carrying the same @tag, also in order. All fields are
+ * in host byte order since both ends live on the same machine.
+ */
+
+/** Largest payload accepted in a single request or response */
+#define FSP_MAX_PAYLOAD (1 << 20)
+
+/** Request opcodes */
+enum fsp_op {
+	FSP_OPEN = 1,	/* payload: filename */
+	FSP_CLOSE,	/* fd */
+	FSP_CREATE,	/* payload: filename */
+	FSP_DELETE,	/* payload: filename */
+	FSP_STAT,	/* fd */
+	FSP_LSEEK,	/* fd, arg: offset */
+	FSP_READ,	/* fd, arg: count; response payload: data */
+	FSP_WRITE,	/* fd, payload: data */
+	FSP_LS,		/* response payload: array of struct fs_dirent */
+};
+
+struct __attribute__((__packed__)) fsp_req {
+	uint32_t len;	/* payload bytes following the header */
+	uint32_t tag;	/* echoed back in the response */
+	uint8_t op;	/* enum fsp_op */
+	uint8_t padding[3];
+	int32_t fd;	/* file descriptor, for fd based operations */
+	uint32_t arg;	/* byte count or offset, depending on @op */
+};
+
+struct __attribute__((__packed__)) fsp_resp {
+	uint32_t len;	/* payload bytes following the header */
+	uint32_t tag;	/* tag of the request being answered */
+	int32_t ret;	/* return value of the libfs call */
+};
+
+#endif /* _FS_PROTO_H */
@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Size of the match finder's hash table, as a power of two */
+#define HASH_BITS 12
+
+/* The last bytes of the input are always emitted as literals */
+#define LAST_LITERALS 5
+
+/* Matches cannot reach further back than a 16-bit offset */
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* append the extension bytes of a length whose nibble saturated */
+static uint8_t *put_len(uint8_t *op, int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* read the extension bytes of a length, returns -1 on truncated input */
+static int get_len(const uint8_t **ipp, const uint8_t *iend, int len)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t b;
+	do {
+		if (ip >= iend)
+			return -1;
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+	*ipp = ip;
+	return len;
+}
+
+/*
+ * Emit one sequence: nlit literals, then a match of mlen bytes (not counting
+ * LZ_MIN_MATCH) at distance off. A negative mlen ends the stream.
+ */
+static int emit(uint8_t **opp, uint8_t *oend, const uint8_t *lit, int nlit,
+		int off, int mlen)
+{
+	uint8_t *op = *opp;
+	int need = 1 + nlit / 255 + 1 + nlit;
+	if (mlen >= 0)
+		need += 2 + mlen / 255 + 1;
+	if (need > oend - op)
+		return -1;
+
+	uint8_t *token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (mlen >= 0) {
+		*op++ = off & 0xff;
+		*op++ = off >> 8;
+		*token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15)
+			op = put_len(op, mlen - 15);
+	}
+
+	*opp = op;
+	return 0;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap)
+{
+	const uint8_t *base = src;
+	const uint8_t *ip = base, *anchor = base;
+	const uint8_t *limit = base + len - LAST_LITERALS;
+	uint8_t *op = dst, *oend = op + cap;
+	int table[1 << HASH_BITS];
+
+	memset(table, 0xff, sizeof(table)); // all positions invalid
+
+	while (ip + LZ_MIN_MATCH <= limit) {
+		uint32_t v = read32(ip);
+		int h = hash(v);
+		int ref = table[h];
+		table[h] = ip - base;
+
+		if (ref < 0 || ip - base - ref > MAX_OFFSET ||
+		    read32(base + ref) != v) {
+			ip++;
+			continue;
+		}
+
+		// Extend the match as far as possible
+		const uint8_t *m = base + ref;
+		const uint8_t *s = ip + LZ_MIN_MATCH;
+		const uint8_t *r = m + LZ_MIN_MATCH;
+		while (s < limit && *s == *r) {
+			s++;
+			r++;
+		}
+
+		if (emit(&op, oend, anchor, ip - anchor, ip - m,
+			 s - ip - LZ_MIN_MATCH) != 0)
+			return 0;
+		ip = anchor = s;
+	}
+
+	// Whatever is left goes out as literals
+	if (emit(&op, oend, anchor, base + len - anchor, 0, -1) != 0)
+		return 0;
+
+	return op - (uint8_t*)dst;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + cap;
+
+	while (ip < iend) {
+		int token = *ip++;
+
+		int nlit = token >> 4;
+		if (nlit == 15 && (nlit = get_len(&ip, iend, nlit)) < 0)
+			return -1;
+		if (nlit > iend - ip || nlit > oend - op)
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+
+		if (ip == iend)
+			break; // last sequence has no match
+
+		if (iend - ip < 2)
+			return -1;
+		int off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > op - (uint8_t*)dst)
+			return -1;
+
+		int mlen = token & 15;
+		if (mlen == 15 && (mlen = get_len(&ip, iend, mlen)) < 0)
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (mlen > oend - op)
+			return -1;
+
+		// Matches may overlap their own output, copy forward
+		const uint8_t *m = op - off;
+		if (off >= mlen) {
+			memcpy(op, m, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *m++;
+		}
+	}
+
+	return op - (uint8_t*)dst;
+}
@@ -0,0 +1,51 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+/*
+ * Small self-contained LZ77 codec, in the spirit of LZ4's block format.
+ *
+ * The compressed stream is a sequence of (literals, match) pairs. Each pair
+ * starts with a token byte whose high nibble is the number of literals and
+ * low nibble the match length minus %LZ_MIN_MATCH; a nibble of 15 is extended
+ * by extra bytes that are added to it until one of them is not 255. The
+ * literals follow, then a 16-bit little-endian match offset. The last pair of
+ * a stream only has literals.
+ */
+
+/** Shortest match worth encoding */
+#define LZ_MIN_MATCH 4
+
+/**
+ * lz_bound - Worst case compressed size
+ * @len: Size of the input in bytes
+ *
+ * Return: the largest size lz_compress() can produce for an input of @len
+ * bytes.
+ */
+#define lz_bound(len) ((len) + (len) / 255 + 16)
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Size of @src in bytes
+ * @dst: Output buffer
+ * @cap: Size of @dst in bytes
+ *
+ * Return: 0 if the compressed data does not fit in @cap bytes. Otherwise
+ * return the compressed size.
+ */
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed data
+ * @len: Size of @src in bytes
+ * @dst: Output buffer
+ * @cap: Size of @dst in bytes
+ *
+ * Return: -1 if @src is malformed or decompresses to more than @cap bytes.
+ * Otherwise return the decompressed size.
+ */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+/* Size of the chunks the arena gets from the heap */
+#define ARENA_CHUNK (256 * 1024)
+
+/* Alignment of the chunks, and largest alignment served */
+#define PAGE 4096
+
+/* Heading of every chunk, allocations start after it */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t off; // first byte not handed out yet
+};
+
+static struct arena_chunk *chunk_new(size_t size)
+{
+	struct arena_chunk *c;
+	if (posix_memalign((void**)&c, PAGE, size) != 0)
+		return NULL;
+	c->size = size;
+	c->off = sizeof(*c);
+	return c;
+}
+
+/* returns the offset of the first byte aligned on align from off in c */
+static size_t chunk_align(struct arena_chunk *c, size_t off, size_t align)
+{
+	uintptr_t p = (uintptr_t)c + off;
+	return off + (-p & (align - 1));
+}
+
+/* arena_alloc() without the zeroing */
+static void *arena_take(struct arena *a, size_t size, size_t align)
+{
+	struct arena_chunk *c = a->head;
+	size_t off = c ? chunk_align(c, c->off, align) : 0;
+
+	if (!c || off + size > c->size) {
+		// Large requests get a chunk of their own, linked behind head
+		size_t need = chunk_align(NULL, sizeof(*c), align) + size;
+		int own = need > ARENA_CHUNK / 4;
+		c = chunk_new(own ? need : ARENA_CHUNK);
+		if (!c)
+			return NULL;
+		a->reserved += c->size;
+		if (own && a->head) {
+			c->next = a->head->next;
+			a->head->next = c;
+		} else {
+			c->next = a->head;
+			a->head = c;
+		}
+		off = chunk_align(c, c->off, align);
+	}
+
+	c->off = off + size;
+	a->used += size;
+	return (char*)c + off;
+}
+
+void *arena_alloc(struct arena *a, size_t size, size_t align)
+{
+	void *p = arena_take(a, size, align);
+	return p ? memset(p, 0, size) : NULL;
+}
+
+void arena_release(struct arena *a)
+{
+	while (a->head) {
+		struct arena_chunk *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+	a->reserved = a->used = 0;
+}
+
+int pool_init(struct buf_pool *p, struct arena *a, size_t bufSize)
+{
+	memset(p, 0, sizeof(*p));
+	p->bufSize = bufSize;
+	p->nbufs = POOL_BUFS * PAGE / bufSize;
+	if (p->nbufs < POOL_MIN_BUFS)
+		p->nbufs = POOL_MIN_BUFS;
+	// Left untouched, pages are only faulted in as buffers get used
+	p->base = arena_take(a, p->nbufs * bufSize, PAGE);
+
+	// Buffers past the end are taken for good
+	for (int i = p->nbufs; i < POOL_BUFS; i++)
+		p->map[i / 64] |= 1ULL << i % 64;
+	return p->base ? 0 : -1;
+}
+
+/* mask of n bits, n in [1, 64] */
+static uint64_t bits(int n)
+{
+	return n == 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+/* claim n consecutive free buffers in word w of the map, -1 if none */
+static int claim(struct buf_pool *p, int w, int n)
+{
+	uint64_t old = __atomic_load_n(&p->map[w], __ATOMIC_RELAXED);
+	for (;;) {
+		int shift = -1;
+		for (int s = 0; s + n <= 64; s++) {
+			if (!(old & bits(n) << s)) {
+				shift = s;
+				break;
+			}
+		}
+		if (shift == -1)
+			return -1;
+
+		// On failure old is reloaded, and the search starts over
+		if (__atomic_compare_exchange_n(&p->map[w], &old,
+						old | bits(n) << shift, 1,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return w * 64 + shift;
+	}
+}
+
+void *pool_get(struct buf_pool *p, int n)
+{
+	if (p->base && n <= 64) {
+		for (int w = 0; w < POOL_BUFS / 64; w++) {
+			int i = claim(p, w, n);
+			if (i != -1) {
+				__atomic_fetch_add(&p->hits, 1, __ATOMIC_RELAXED);
+				return p->base + i * p->bufSize;
+			}
+		}
+	}
+
+	__atomic_fetch_add(&p->misses, 1, __ATOMIC_RELAXED);
+	void *buf;
+	if (posix_memalign(&buf, PAGE, n * p->bufSize) != 0)
+		return NULL;
+	return buf;
+}
+
+void pool_put(struct buf_pool *p, void *buf, int n)
+{
+	char *b = buf;
+	if (!p->base || b < p->base || b >= p->base + p->nbufs * p->bufSize) {
+		free(buf); // from the heap
+		return;
+	}
+
+	int i = (b - p->base) / p->bufSize;
+	__atomic_fetch_and(&p->map[i / 64], ~(bits(n) << i % 64),
+			   __ATOMIC_RELEASE);
+}
@@ -0,0 +1,94 @@
+#ifndef _MEM_H
+#define _MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory of a mounted file system.
+ *
+ * Metadata that lives as long as the mount (superblock, FAT, refcount and
+ * hash tables...) comes from an arena, a list of large chunks handed out
+ * linearly and only released all at once. Scratch buffers for block I/O come
+ * from a pool of aligned buffers carved out of the arena, tracked by a bitmap
+ * that threads claim and release with atomic operations, without locking.
+ * When the pool is exhausted, buffers fall back to the heap.
+ */
+
+/** Mount-lifetime allocator */
+struct arena {
+	struct arena_chunk *head;	/* Chunk being handed out, NULL if none */
+	size_t reserved;		/* Bytes obtained from the heap */
+	size_t used;			/* Bytes handed out */
+};
+
+/** Most buffers in a pool, a multiple of 64 */
+#define POOL_BUFS 128
+/** Fewest buffers in a pool, whatever their size */
+#define POOL_MIN_BUFS 8
+
+/** Pool of scratch buffers */
+struct buf_pool {
+	char *base;			/* First buffer, NULL if not set up */
+	size_t bufSize;			/* Size of a buffer in bytes */
+	int nbufs;			/* Number of buffers */
+	uint64_t map[POOL_BUFS / 64];	/* Bit set for each buffer in use */
+	uint32_t hits;			/* Requests served from the pool */
+	uint32_t misses;		/* ... and from the heap */
+};
+
+/**
+ * arena_alloc - Allocate mount-lifetime memory
+ * @a: Arena to allocate from
+ * @size: Size in bytes
+ * @align: Alignment in bytes, a power of two no larger than 4096
+ *
+ * Return: zeroed memory, valid until arena_release(). NULL if the heap is
+ * exhausted.
+ */
+void *arena_alloc(struct arena *a, size_t size, size_t align);
+
+/**
+ * arena_release - Free everything allocated from an arena
+ * @a: Arena to release
+ *
+ * @a is left empty and can be used again.
+ */
+void arena_release(struct arena *a);
+
+/**
+ * pool_init - Set up a pool of buffers
+ * @p: Pool to set up
+ * @a: Arena holding the buffers
+ * @bufSize: Size of each buffer, a multiple of 4096
+ *
+ * The buffers are aligned on 4096 bytes and go away with @a. The pool holds
+ * %POOL_BUFS buffers of 4096 bytes; larger buffers are fewer, so that the pool
+ * keeps the same size, but there are at least %POOL_MIN_BUFS of them.
+ *
+ * Return: -1 if memory could not be allocated. 0 otherwise.
+ */
+int pool_init(struct buf_pool *p, struct arena *a, size_t bufSize);
+
+/**
+ * pool_get - Get scratch buffers
+ * @p: Pool to take the buffers from
+ * @n: Number of consecutive buffers
+ *
+ * Safe to call from several threads at once. The content of the buffers is
+ * undefined.
+ *
+ * Return: @n * @p->bufSize bytes of memory aligned on 4096 bytes, to be given
+ * back with pool_put(). NULL if the heap is exhausted.
+ */
+void *pool_get(struct buf_pool *p, int n);
+
+/**
+ * pool_put - Give back scratch buffers
+ * @p: Pool the buffers were taken from
+ * @buf: Buffers returned by pool_get(), may be NULL
+ * @n: Number of buffers, as given to pool_get()
+ */
+void pool_put(struct buf_pool *p, void *buf, int n);
+
+#endif /* _MEM_H */
@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+struct kernels {
+	int (*count_zero16)(const uint16_t *v, int n);
+	int (*find_zero16)(const uint16_t *v, int n);
+	int (*count_empty)(const void *recs, int n, size_t stride);
+	int (*find_name)(const void *recs, int n, size_t stride, const void *name);
+};
+
+/*
+ * Scalar versions, also used for the leftover entries of the vector versions
+ */
+
+static int count_zero16_scalar(const uint16_t *v, int n)
+{
+	int count = 0;
+	for (int i = 0; i < n; i++)
+		count += v[i] == 0;
+	return count;
+}
+
+static int find_zero16_scalar(const uint16_t *v, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (v[i] == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int count_empty_scalar(const void *recs, int n, size_t stride)
+{
+	const uint8_t *p = recs;
+	int count = 0;
+	for (int i = 0; i < n; i++)
+		count += p[i * stride] == '\0';
+	return count;
+}
+
+static int find_name_scalar(const void *recs, int n, size_t stride,
+			    const void *name)
+{
+	const uint8_t *p = recs;
+	for (int i = 0; i < n; i++) {
+		if (memcmp(p + i * stride, name, 16) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static const struct kernels scalar = {
+	count_zero16_scalar,
+	find_zero16_scalar,
+	count_empty_scalar,
+	find_name_scalar,
+};
+
+#ifdef HAVE_X86
+
+/*
+ * SSE2 versions, 8 FAT entries or 1 name per instruction. movemask yields
+ * two bits per 16-bit entry.
+ */
+
+static int count_zero16_sse2(const uint16_t *v, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int count = 0, i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(v + i));
+		int m = _mm_movemask_epi8(_mm_cmpeq_epi16(x, zero));
+		count += __builtin_popcount(m) / 2;
+	}
+	return count + count_zero16_scalar(v + i, n - i);
+}
+
+static int find_zero16_sse2(const uint16_t *v, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(v + i));
+		int m = _mm_movemask_epi8(_mm_cmpeq_epi16(x, zero));
+		if (m)
+			return i + __builtin_ctz(m) / 2;
+	}
+	int j = find_zero16_scalar(v + i, n - i);
+	return j == -1 ? -1 : i + j;
+}
+
+static int find_name_sse2(const void *recs, int n, size_t stride,
+			  const void *name)
+{
+	const uint8_t *p = recs;
+	const __m128i key = _mm_loadu_si128(name);
+	for (int i = 0; i < n; i++) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(p + i * stride));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, key)) == 0xffff)
+			return i;
+	}
+	return -1;
+}
+
+static const struct kernels sse2 = {
+	count_zero16_sse2,
+	find_zero16_sse2,
+	count_empty_scalar, // one byte per record, nothing to gain
+	find_name_sse2,
+};
+
+/*
+ * AVX2 versions: 16 FAT entries, 2 names or 8 first name bytes (gathered) per
+ * instruction. Compiled for AVX2 regardless of the build flags, only called
+ * after checking the CPU.
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static int count_zero16_avx2(const uint16_t *v, int n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int count = 0, i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(v + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi16(x, zero));
+		count += __builtin_popcount(m) / 2;
+	}
+	return count + count_zero16_sse2(v + i, n - i);
+}
+
+AVX2 static int find_zero16_avx2(const uint16_t *v, int n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(v + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi16(x, zero));
+		if (m)
+			return i + __builtin_ctz(m) / 2;
+	}
+	int j = find_zero16_sse2(v + i, n - i);
+	return j == -1 ? -1 : i + j;
+}
+
+AVX2 static int count_empty_avx2(const void *recs, int n, size_t stride)
+{
+	const uint8_t *p = recs;
+	const __m256i lowByte = _mm256_set1_epi32(0xff);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i offs = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+					  _mm256_set1_epi32(stride));
+	int count = 0, i = 0;
+
+	// Gathers 4 bytes per record, records are always larger than that
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_i32gather_epi32((const int*)(p + i * stride),
+						   offs, 1);
+		x = _mm256_cmpeq_epi32(_mm256_and_si256(x, lowByte), zero);
+		count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(x)));
+	}
+	return count + count_empty_scalar(p + i * stride, n - i, stride);
+}
+
+AVX2 static int find_name_avx2(const void *recs, int n, size_t stride,
+			       const void *name)
+{
+	const uint8_t *p = recs;
+	const __m256i key = _mm256_broadcastsi128_si256(_mm_loadu_si128(name));
+	int i = 0;
+	for (; i + 2 <= n; i += 2) {
+		__m256i x = _mm256_loadu2_m128i((const __m128i*)(p + (i + 1) * stride),
+						(const __m128i*)(p + i * stride));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, key));
+		if ((m & 0xffff) == 0xffff)
+			return i;
+		if ((m >> 16) == 0xffff)
+			return i + 1;
+	}
+	int j = find_name_sse2(p + i * stride, n - i, stride, name);
+	return j == -1 ? -1 : i + j;
+}
+
+static const struct kernels avx2 = {
+	count_zero16_avx2,
+	find_zero16_avx2,
+	count_empty_avx2,
+	find_name_avx2,
+};
+
+#endif /* HAVE_X86 */
+
+/* kernels in use, picked on first use */
+static const struct kernels *cur;
+static int curLevel;
+
+static int best_level(void)
+{
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	return SIMD_SSE2;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+int simd_force(int level)
+{
+	if (level < SIMD_SCALAR || level > best_level())
+		return -1;
+
+	const struct kernels *k = &scalar;
+#ifdef HAVE_X86
+	if (level == SIMD_SSE2)
+		k = &sse2;
+	else if (level == SIMD_AVX2)
+		k = &avx2;
+#endif
+	cur = k;
+	curLevel = level;
+	return 0;
+}
+
+static const struct kernels *kernels(void)
+{
+	if (!cur)
+		simd_force(best_level());
+	return cur;
+}
+
+int simd_level(void)
+{
+	kernels();
+	return curLevel;
+}
+
+int simd_count_zero16(const uint16_t *v, int n)
+{
+	return kernels()->count_zero16(v, n);
+}
+
+int simd_find_zero16(const uint16_t *v, int n)
+{
+	return kernels()->find_zero16(v, n);
+}
+
+int simd_count_empty(const void *recs, int n, size_t stride)
+{
+	return kernels()->count_empty(recs, n, stride);
+}
+
+int simd_find_name(const void *recs, int n, size_t stride, const void *name)
+{
+	return kernels()->find_name(recs, n, stride, name);
+}
@@ -0,0 +1,82 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Vectorized scanning kernels for the FAT and the root directory.
+ *
+ * Each kernel has a scalar version, an SSE2 version and an AVX2 version. The
+ * best one supported by the CPU is picked the first time a kernel is called;
+ * builds for other architectures only have the scalar versions.
+ */
+
+/** Kernel implementations, from slowest to fastest */
+enum simd_level {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+};
+
+/**
+ * simd_level - Get the kernels in use
+ *
+ * Return: the &enum simd_level of the kernels currently in use.
+ */
+int simd_level(void);
+
+/**
+ * simd_force - Select the kernels to use
+ * @level: &enum simd_level to use
+ *
+ * Meant for benchmarks and tests comparing implementations.
+ *
+ * Return: -1 if @level is not supported by the CPU or by this build. 0
+ * otherwise.
+ */
+int simd_force(int level);
+
+/**
+ * simd_count_zero16 - Count zero entries
+ * @v: Array of 16-bit entries
+ * @n: Number of entries in @v
+ *
+ * Return: the number of entries of @v equal to 0.
+ */
+int simd_count_zero16(const uint16_t *v, int n);
+
+/**
+ * simd_find_zero16 - Find the first zero entry
+ * @v: Array of 16-bit entries
+ * @n: Number of entries in @v
+ *
+ * Return: the index of the first entry of @v equal to 0, -1 if there is none.
+ */
+int simd_find_zero16(const uint16_t *v, int n);
+
+/**
+ * simd_count_empty - Count empty names in an array of records
+ * @recs: Array of records, each starting with a NULL-terminated name
+ * @n: Number of records
+ * @stride: Size of a record in bytes
+ *
+ * Return: the number of records whose name is the empty string.
+ */
+int simd_count_empty(const void *recs, int n, size_t stride);
+
+/**
+ * simd_find_name - Find a name in an array of records
+ * @recs: Array of records, each starting with a 16-byte name
+ * @n: Number of records
+ * @stride: Size of a record in bytes
+ * @name: 16-byte name to look for
+ *
+ * The first 16 bytes of each record are compared with the 16 bytes of @name,
+ * so names must be padded with zeros past their NULL character.
+ *
+ * Return: the index of the first record named @name, -1 if there is none.
+ */
+int simd_find_name(const void *recs, int n, size_t stride, const void *name);
+
+#endif /* _SIMD_H */
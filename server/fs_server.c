@@ -0,0 +1,372 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_proto.h>
+
+#define server_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Maximum number of simultaneous client connections */
+#define MAX_CLIENTS 64
+
+/* Stop reading requests from a client whose responses pile up past this */
+#define OUT_HIGH_WATER (4 * FSP_MAX_PAYLOAD)
+
+struct buffer {
+	char *data;
+	size_t len;	/* valid bytes */
+	size_t off;	/* bytes already consumed */
+	size_t cap;
+};
+
+struct client {
+	int sock;
+	struct buffer in;
+	struct buffer out;
+	/* libfs file descriptors opened on behalf of this client */
+	int fds[FS_OPEN_MAX_COUNT];
+	int numFds;
+};
+
+static struct client *clients[MAX_CLIENTS];
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+/* make sure buf can hold extra more bytes after its valid content */
+static int buf_reserve(struct buffer *buf, size_t extra)
+{
+	// Drop consumed bytes before growing
+	if (buf->off > 0) {
+		memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+		buf->len -= buf->off;
+		buf->off = 0;
+	}
+
+	if (buf->len + extra <= buf->cap)
+		return 0;
+
+	size_t cap = buf->cap ? buf->cap : 65536;
+	while (cap < buf->len + extra)
+		cap *= 2;
+	char *data = realloc(buf->data, cap);
+	if (!data)
+		return -1;
+	buf->data = data;
+	buf->cap = cap;
+	return 0;
+}
+
+static int client_owns(struct client *c, int fd)
+{
+	for (int i = 0; i < c->numFds; i++) {
+		if (c->fds[i] == fd)
+			return i;
+	}
+	return -1;
+}
+
+/* check that a filename payload is NULL-terminated and not too long */
+static const char *payload_name(const char *payload, uint32_t len)
+{
+	if (len == 0 || len > FS_FILENAME_LEN || payload[len - 1] != '\0')
+		return NULL;
+	return payload;
+}
+
+/* execute one request and append its response to the output buffer */
+static int serve(struct client *c, const struct fsp_req *req,
+		 const char *payload)
+{
+	struct fsp_resp resp = { .len = 0, .tag = req->tag, .ret = -1 };
+	const char *name;
+	int ind;
+
+	// Room for the largest payload this request can produce
+	size_t extra = 0;
+	if (req->op == FSP_READ)
+		extra = req->arg > FSP_MAX_PAYLOAD ? FSP_MAX_PAYLOAD : req->arg;
+	else if (req->op == FSP_LS)
+		extra = FS_FILE_MAX_COUNT * sizeof(struct fs_dirent);
+	if (buf_reserve(&c->out, sizeof(resp) + extra) != 0)
+		return -1;
+	char *data = c->out.data + c->out.len + sizeof(resp);
+
+	switch (req->op) {
+	case FSP_CREATE:
+		if ((name = payload_name(payload, req->len)))
+			resp.ret = fs_create(name);
+		break;
+	case FSP_DELETE:
+		if ((name = payload_name(payload, req->len)))
+			resp.ret = fs_delete(name);
+		break;
+	case FSP_OPEN:
+		if (c->numFds == FS_OPEN_MAX_COUNT)
+			break;
+		if ((name = payload_name(payload, req->len)))
+			resp.ret = fs_open(name);
+		if (resp.ret >= 0)
+			c->fds[c->numFds++] = resp.ret;
+		break;
+	case FSP_CLOSE:
+		if ((ind = client_owns(c, req->fd)) < 0)
+			break;
+		resp.ret = fs_close(req->fd);
+		c->fds[ind] = c->fds[--c->numFds];
+		break;
+	case FSP_STAT:
+		if (client_owns(c, req->fd) >= 0)
+			resp.ret = fs_stat(req->fd);
+		break;
+	case FSP_LSEEK:
+		if (client_owns(c, req->fd) >= 0)
+			resp.ret = fs_lseek(req->fd, req->arg);
+		break;
+	case FSP_READ:
+		if (client_owns(c, req->fd) >= 0)
+			resp.ret = fs_read(req->fd, data, extra);
+		if (resp.ret > 0)
+			resp.len = resp.ret;
+		break;
+	case FSP_WRITE:
+		if (client_owns(c, req->fd) >= 0)
+			resp.ret = fs_write(req->fd, (void*)payload, req->len);
+		break;
+	case FSP_LS:
+		resp.ret = fs_readdir((struct fs_dirent*)data, FS_FILE_MAX_COUNT);
+		if (resp.ret > 0)
+			resp.len = resp.ret * sizeof(struct fs_dirent);
+		break;
+	default:
+		server_error("unknown opcode %d", req->op);
+		break;
+	}
+
+	memcpy(c->out.data + c->out.len, &resp, sizeof(resp));
+	c->out.len += sizeof(resp) + resp.len;
+	return 0;
+}
+
+/* execute every complete request sitting in the input buffer */
+static int serve_pending(struct client *c)
+{
+	struct fsp_req req;
+
+	while (c->in.len - c->in.off >= sizeof(req) &&
+	       c->out.len - c->out.off < OUT_HIGH_WATER) {
+		memcpy(&req, c->in.data + c->in.off, sizeof(req));
+		if (req.len > FSP_MAX_PAYLOAD) {
+			server_error("oversized request (%u bytes)", req.len);
+			return -1;
+		}
+		if (c->in.len - c->in.off < sizeof(req) + req.len)
+			break; // payload not fully received yet
+
+		if (serve(c, &req, c->in.data + c->in.off + sizeof(req)) != 0)
+			return -1;
+		c->in.off += sizeof(req) + req.len;
+	}
+	return 0;
+}
+
+static int client_read(struct client *c)
+{
+	if (buf_reserve(&c->in, 65536) != 0)
+		return -1;
+
+	ssize_t n = read(c->sock, c->in.data + c->in.len, c->in.cap - c->in.len);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if (n == 0)
+		return -1; // peer hung up
+	c->in.len += n;
+
+	return serve_pending(c);
+}
+
+static int client_write(struct client *c)
+{
+	while (c->out.off < c->out.len) {
+		ssize_t n = write(c->sock, c->out.data + c->out.off,
+				  c->out.len - c->out.off);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		c->out.off += n;
+	}
+	c->out.off = c->out.len = 0;
+
+	// Resume requests held back by the high water mark
+	return serve_pending(c);
+}
+
+static void client_drop(int slot)
+{
+	struct client *c = clients[slot];
+
+	// Release whatever the client left open
+	for (int i = 0; i < c->numFds; i++)
+		fs_close(c->fds[i]);
+
+	close(c->sock);
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+	clients[slot] = NULL;
+}
+
+static void client_accept(int lsock)
+{
+	int sock = accept(lsock, NULL, NULL);
+	if (sock < 0) {
+		perror("accept");
+		return;
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i])
+			continue;
+		clients[i] = calloc(1, sizeof(struct client));
+		if (!clients[i])
+			break;
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+		clients[i]->sock = sock;
+		return;
+	}
+
+	server_error("too many clients");
+	close(sock);
+}
+
+static int listen_on(const char *sockpath)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		server_error("socket path too long");
+		return -1;
+	}
+
+	int lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+	unlink(sockpath);
+	if (bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    listen(lsock, MAX_CLIENTS) < 0) {
+		perror("bind/listen");
+		close(lsock);
+		return -1;
+	}
+
+	return lsock;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfds[MAX_CLIENTS + 1];
+	int slots[MAX_CLIENTS + 1];
+
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: %s <diskname> <socket path> [trace file]\n",
+			argv[0]);
+		exit(1);
+	}
+
+	// The workload is recorded for fs_replay.x
+	if (argc == 4 && fs_trace_start(argv[3])) {
+		server_error("cannot record trace %s", argv[3]);
+		exit(1);
+	}
+
+	if (fs_mount(argv[1])) {
+		server_error("cannot mount %s", argv[1]);
+		exit(1);
+	}
+
+	int lsock = listen_on(argv[2]);
+	if (lsock < 0) {
+		fs_umount();
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		int n = 0;
+		pfds[n].fd = lsock;
+		pfds[n].events = POLLIN;
+		n++;
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			struct client *c = clients[i];
+			if (!c)
+				continue;
+			pfds[n].fd = c->sock;
+			pfds[n].events = 0;
+			if (c->out.len - c->out.off < OUT_HIGH_WATER)
+				pfds[n].events |= POLLIN;
+			if (c->out.off < c->out.len)
+				pfds[n].events |= POLLOUT;
+			slots[n++] = i;
+		}
+
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (int i = 1; i < n; i++) {
+			struct client *c = clients[slots[i]];
+			int err = 0;
+			if (pfds[i].revents & (POLLERR | POLLNVAL))
+				err = -1;
+			if (!err && (pfds[i].revents & (POLLIN | POLLHUP)))
+				err = client_read(c);
+			// Answer right away, most writes complete without POLLOUT
+			if (!err && c->out.off < c->out.len)
+				err = client_write(c);
+			if (err)
+				client_drop(slots[i]);
+		}
+
+		if (pfds[0].revents & POLLIN)
+			client_accept(lsock);
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i])
+			client_drop(i);
+	}
+	close(lsock);
+	unlink(argv[2]);
+
+	if (fs_umount()) {
+		server_error("cannot unmount %s", argv[1]);
+		exit(1);
+	}
+	if (argc == 4 && fs_trace_stop())
+		server_error("trace %s is incomplete", argv[3]);
+
+	return 0;
+}
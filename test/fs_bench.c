@@ -0,0 +1,257 @@
+#include <limits.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <fs_aio.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Name of the file written then read back by the benchmark */
+#define BENCH_FILE "bench.dat"
+
+/* Reads kept in flight by the asynchronous read phase */
+#define AIO_DEPTH 32
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX || ret <= 0)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+static int get_policy(const char *name)
+{
+	if (!strcmp(name, "none"))
+		return -1; // checksums not enabled at all
+	if (!strcmp(name, "off"))
+		return FS_CSUM_OFF;
+	if (!strcmp(name, "sampled"))
+		return FS_CSUM_SAMPLED;
+	if (!strcmp(name, "always"))
+		return FS_CSUM_ALWAYS;
+	die("invalid policy '%s'", name);
+}
+
+/* xor of the 64-bit words of len bytes at p, so that mapped data is read */
+static uint64_t scan(const void *p, size_t len)
+{
+	const uint64_t *w = p;
+	uint64_t x = 0;
+	for (size_t i = 0; i < len / sizeof(*w); i++)
+		x ^= w[i];
+	return x;
+}
+
+/* scan total bytes of fd in iosize pieces through fs_map(), in seconds */
+static double map_read(int fd, size_t total, size_t iosize)
+{
+	static volatile uint64_t sink;
+	struct fs_map map;
+
+	double start = now_s();
+	for (size_t off = 0; off < total; off += iosize) {
+		if (fs_map(fd, off, iosize, &map) || map.len != iosize)
+			die("Map failed");
+		if (map.addr)
+			sink ^= scan(map.addr, map.len);
+		for (int i = 0; !map.addr && i < map.nsegs; i++)
+			sink ^= scan(map.segs[i].addr, map.segs[i].len);
+		fs_unmap(&map);
+	}
+	return now_s() - start;
+}
+
+/* read total bytes of fd in iosize pieces with nthreads workers, in seconds */
+static double aio_read(int fd, size_t total, size_t iosize, int nthreads)
+{
+	struct fs_aio *a = fsa_create(nthreads);
+	if (!a)
+		die("Cannot create aio context");
+	char *bufs = malloc(AIO_DEPTH * iosize);
+	struct fsa_req reqs[AIO_DEPTH];
+	struct fsa_result res[AIO_DEPTH];
+	size_t off = 0, inflight = 0;
+	int slot = 0;
+
+	// Each completion frees its buffer for the next read
+	double start = now_s();
+	for (int i = 0; i < AIO_DEPTH && off < total; i++, off += iosize) {
+		reqs[i] = (struct fsa_req){ FSA_READ, fd, bufs + i * iosize,
+					    iosize, off, bufs + i * iosize };
+		slot++;
+	}
+	inflight = fsa_submit(a, reqs, slot);
+	while (inflight > 0) {
+		int n = fsa_reap(a, res, 1, AIO_DEPTH);
+		inflight -= n;
+		int next = 0;
+		for (int i = 0; i < n; i++) {
+			if (res[i].ret != iosize)
+				die("Read failed");
+			if (off < total) {
+				reqs[next++] = (struct fsa_req){ FSA_READ, fd,
+					res[i].data, iosize, off, res[i].data };
+				off += iosize;
+			}
+		}
+		inflight += fsa_submit(a, reqs, next);
+	}
+	double t = now_s() - start;
+
+	fsa_destroy(a);
+	free(bufs);
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	size_t mib = 8, iosize = 65536, rounds = 5, iovcnt = 1, nthreads = 0;
+	int policy = -1, mapped = 0;
+	unsigned int ckpt_ms = 0, ckpt_kib = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [MiB] [iosize]"
+			" [none|off|sampled|always] [iovcnt|map] [threads]"
+			" [checkpoint_ms:KiB]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		mib = get_argv(argv[2]);
+	if (argc > 3)
+		iosize = get_argv(argv[3]);
+	if (argc > 4)
+		policy = get_policy(argv[4]);
+	if (argc > 5 && !strcmp(argv[5], "map"))
+		mapped = 1; // reads scan the data in place instead
+	else if (argc > 5)
+		iovcnt = get_argv(argv[5]);
+	if (argc > 6)
+		nthreads = strtol(argv[6], NULL, 0); // 0 for synchronous reads
+	if (argc > 7 && sscanf(argv[7], "%u:%u", &ckpt_ms, &ckpt_kib) < 1)
+		die("invalid checkpoint settings '%s'", argv[7]);
+	if (iovcnt > iosize)
+		die("too many iovecs");
+	size_t total = mib * 1024 * 1024;
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount %s", argv[1]);
+	if (policy != -1 && (fs_csum_enable() || fs_csum_policy(policy)))
+		die("Cannot enable checksums");
+	if ((ckpt_ms || ckpt_kib) && fs_checkpoint_start(ckpt_ms, ckpt_kib * 1024))
+		die("Cannot start checkpointer");
+
+	fs_delete(BENCH_FILE);
+	if (fs_create(BENCH_FILE))
+		die("Cannot create file");
+	int fd = fs_open(BENCH_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+
+	char *buf = malloc(iosize);
+	for (size_t i = 0; i < iosize; i++)
+		buf[i] = rand();
+
+	// Each I/O is split in iovcnt pieces, fs_readv()/fs_writev() if several
+	struct iovec *iov = malloc(iovcnt * sizeof(*iov));
+	for (size_t i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = buf + i * (iosize / iovcnt);
+		iov[i].iov_len = i == iovcnt - 1 ? iosize - i * (iosize / iovcnt)
+						 : iosize / iovcnt;
+	}
+
+	// Sequential write, made durable before the clock stops
+	double start = now_s();
+	for (size_t off = 0; off < total; off += iosize) {
+		int ret = iovcnt == 1 ? fs_write(fd, buf, iosize)
+				      : fs_writev(fd, iov, iovcnt);
+		if (ret != iosize)
+			die("Disk too small for %zu MiB", mib);
+	}
+	if (fs_sync())
+		die("Cannot sync");
+	double wr = now_s() - start;
+
+	// Sequential reads, best of a few rounds
+	double rd = 0;
+	for (size_t r = 0; r < rounds; r++) {
+		if (nthreads) { // fsa_submit() instead, see aio_read()
+			double t = aio_read(fd, total, iosize, nthreads);
+			if (r == 0 || t < rd)
+				rd = t;
+			continue;
+		}
+		if (mapped) {
+			double t = map_read(fd, total, iosize);
+			if (r == 0 || t < rd)
+				rd = t;
+			continue;
+		}
+		fs_lseek(fd, 0);
+		start = now_s();
+		for (size_t off = 0; off < total; off += iosize) {
+			int ret = iovcnt == 1 ? fs_read(fd, buf, iosize)
+					      : fs_readv(fd, iov, iovcnt);
+			if (ret != iosize)
+				die("Read failed");
+		}
+		double t = now_s() - start;
+		if (r == 0 || t < rd)
+			rd = t;
+	}
+
+	struct fs_csum_stats st;
+	struct fs_mem_stats mem;
+	struct block_stats dev;
+	fs_csum_stats(&st);
+	fs_mem_stats(&mem);
+	block_disk_stats(&dev);
+	struct fs_checkpoint_stats ck;
+	fs_checkpoint_stats(&ck);
+
+	printf("size=%zuMiB iosize=%zu policy=%s iovcnt=%s threads=%zu\n", mib,
+	       iosize, argc > 4 ? argv[4] : "none", argc > 5 ? argv[5] : "1",
+	       nthreads);
+	printf("write: %.1f MiB/s\n", mib / wr);
+	printf("read: %.1f MiB/s\n", mib / rd);
+	printf("verified=%u errors=%u\n", st.verified, st.errors);
+	printf("memory: arena=%uKiB pool=%uKiB hits=%u misses=%u\n",
+	       mem.arena_bytes / 1024, mem.pool_bytes / 1024, mem.pool_hits,
+	       mem.pool_misses);
+	printf("disk: reads=%zu/%zu writes=%zu/%zu seeks=%zu/%zu sim=%.1fms\n",
+	       dev.reads, dev.blocks_read, dev.writes, dev.blocks_written,
+	       dev.seeks, dev.seek_blocks, dev.sim_ns / 1e6);
+	if (ckpt_ms || ckpt_kib)
+		printf("checkpoints=%u blocks=%u writes=%u stalls=%u/%.1fms "
+		       "held=%.1fms/max %.1fus\n",
+		       ck.checkpoints, ck.blocks, ck.writes, ck.stalls,
+		       ck.stall_ns / 1e6, ck.hold_ns / 1e6, ck.hold_max_ns / 1e3);
+
+	fs_close(fd);
+	fs_delete(BENCH_FILE);
+	if (fs_umount())
+		die("Cannot unmount %s", argv[1]);
+	free(iov);
+	free(buf);
+
+	return 0;
+}
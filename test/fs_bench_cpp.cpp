@@ -0,0 +1,219 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <span>
+#include <vector>
+
+#include <fs.hpp>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Name of the file used by the benchmark */
+#define BENCH_FILE "bench.dat"
+
+/* Operations per round of the metadata workloads */
+#define META_OPS 20000
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t get_argv(const char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+/* Best time of the C and of the C++ version of a workload */
+struct Timing {
+	const char *name;
+	size_t ops;
+	double c = 0, cpp = 0;
+};
+
+/* Run c() and cpp() alternately for rounds rounds, keep the best of each */
+template <typename C, typename Cpp>
+static Timing measure(const char *name, size_t ops, size_t rounds, C c, Cpp cpp)
+{
+	Timing t{name, ops};
+	for (size_t r = 0; r < rounds; r++) {
+		double start = now_s();
+		c();
+		double d = now_s() - start;
+		if (r == 0 || d < t.c)
+			t.c = d;
+		start = now_s();
+		cpp();
+		d = now_s() - start;
+		if (r == 0 || d < t.cpp)
+			t.cpp = d;
+	}
+	return t;
+}
+
+template <typename L>
+static int run(fs::Volume<L> &vol, size_t total, size_t iosize, size_t rounds)
+{
+	if (L::offset_in_block(iosize))
+		die("I/O size must be a multiple of %zu", L::block_size);
+
+	(void)vol.remove(BENCH_FILE); // may not exist
+	if (!vol.create(BENCH_FILE))
+		die("Cannot create file");
+	auto f = vol.open(BENCH_FILE);
+	if (!f)
+		die("Cannot open file: %s", fs::error_str(f.error()));
+	int fd = f->fd(); // same file through the C API
+
+	std::vector<std::byte> wbuf(iosize), rbuf(iosize);
+	for (auto &b : wbuf)
+		b = std::byte(rand());
+	size_t n = total / iosize;
+	static volatile int sink;
+
+	std::vector<Timing> res;
+
+	// Sequential overwrite of the whole file, written once beforehand
+	for (size_t i = 0; i < n; i++)
+		if (fs_write(fd, wbuf.data(), iosize) != (int)iosize)
+			die("Disk too small for %zu bytes", total);
+	if (fs_sync())
+		die("Cannot sync");
+	res.push_back(measure("write", n, rounds, [&] {
+		fs_lseek(fd, 0);
+		for (size_t i = 0; i < n; i++)
+			if (fs_write(fd, wbuf.data(), iosize) != (int)iosize)
+				die("Write failed");
+	}, [&] {
+		(void)f->seek(0);
+		for (size_t i = 0; i < n; i++)
+			if (f->write(wbuf).value_or(0) != iosize)
+				die("Write failed");
+	}));
+
+	res.push_back(measure("read", n, rounds, [&] {
+		fs_lseek(fd, 0);
+		for (size_t i = 0; i < n; i++)
+			if (fs_read(fd, rbuf.data(), iosize) != (int)iosize)
+				die("Read failed");
+	}, [&] {
+		(void)f->seek(0);
+		for (size_t i = 0; i < n; i++)
+			if (f->read(rbuf).value_or(0) != iosize)
+				die("Read failed");
+	}));
+
+	// Blocks in a scattered order: C offsets against read_blocks()
+	size_t per = iosize >> L::block_shift;
+	res.push_back(measure("pread", n, rounds, [&] {
+		for (size_t i = 0; i < n; i++) {
+			size_t j = (i * 7919) % n;
+			if (fs_pread(fd, rbuf.data(), iosize, j * iosize) != (int)iosize)
+				die("Read failed");
+		}
+	}, [&] {
+		for (size_t i = 0; i < n; i++) {
+			size_t j = (i * 7919) % n;
+			if (f->read_blocks(j * per, rbuf).value_or(0) != iosize)
+				die("Read failed");
+		}
+	}));
+
+	res.push_back(measure("open/stat/close", META_OPS, rounds, [&] {
+		for (size_t i = 0; i < META_OPS; i++) {
+			int fd2 = fs_open(BENCH_FILE);
+			if (fd2 < 0)
+				die("Cannot open file");
+			sink = fs_stat(fd2);
+			fs_close(fd2);
+		}
+	}, [&] {
+		for (size_t i = 0; i < META_OPS; i++) {
+			auto f2 = vol.open(BENCH_FILE);
+			if (!f2)
+				die("Cannot open file");
+			sink = f2->size().value_or(0);
+		}
+	}));
+
+	res.push_back(measure("readdir", META_OPS / 10, rounds, [&] {
+		struct fs_dirent ents[FS_FILE_MAX_COUNT];
+		for (size_t i = 0; i < META_OPS / 10; i++) {
+			int cnt = fs_readdir(ents, FS_FILE_MAX_COUNT);
+			for (int k = 0; k < cnt; k++)
+				sink = sink + ents[k].size;
+		}
+	}, [&] {
+		for (size_t i = 0; i < META_OPS / 10; i++) {
+			auto dir = vol.entries();
+			if (!dir)
+				die("Cannot read directory");
+			for (auto e : *dir)
+				sink = sink + e.size();
+		}
+	}));
+
+	// Both APIs wrote the same data: check it through each
+	for (size_t i = 0; i < n; i++) {
+		if (fs_pread(fd, rbuf.data(), iosize, i * iosize) != (int)iosize ||
+		    memcmp(rbuf.data(), wbuf.data(), iosize))
+			die("Data mismatch at block %zu", i * per);
+		if (!f->read_blocks(i * per, rbuf) ||
+		    memcmp(rbuf.data(), wbuf.data(), iosize))
+			die("Data mismatch at block %zu", i * per);
+	}
+
+	printf("size=%zuB iosize=%zu block=%zu rounds=%zu\n", total, iosize,
+	       L::block_size, rounds);
+	printf("%-16s %12s %12s %8s\n", "workload", "C ns/op", "C++ ns/op", "ratio");
+	for (auto &t : res)
+		printf("%-16s %12.1f %12.1f %8.3f\n", t.name, t.c / t.ops * 1e9,
+		       t.cpp / t.ops * 1e9, t.cpp / t.c);
+
+	if (!f->close() || !vol.remove(BENCH_FILE))
+		die("Cannot clean up");
+	return 0;
+}
+
+/* Mount with the layout of the image among the common ones, then run */
+template <typename L, typename... Ls>
+static int mount_run(const char *disk, size_t total, size_t iosize, size_t rounds)
+{
+	auto vol = fs::Volume<L>::mount(disk);
+	if (vol)
+		return run(*vol, total, iosize, rounds);
+	if (vol.error() != fs::Error::layout)
+		die("Cannot mount %s: %s", disk, fs::error_str(vol.error()));
+	if constexpr (sizeof...(Ls) > 0)
+		return mount_run<Ls...>(disk, total, iosize, rounds);
+	else
+		die("Unsupported block size in %s", disk);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+		die("Usage: %s <diskname> <size KiB> [iosize] [rounds]", argv[0]);
+
+	size_t total = get_argv(argv[2]) * 1024;
+	size_t iosize = argc > 3 ? get_argv(argv[3]) : 4096;
+	size_t rounds = argc > 4 ? get_argv(argv[4]) : 5;
+	if (total % iosize)
+		die("size must be a multiple of the I/O size");
+
+	return mount_run<fs::Layout4K, fs::Layout512, fs::Layout64K>(argv[1],
+		total, iosize, rounds);
+}
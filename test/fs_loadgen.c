@@ -0,0 +1,132 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs_client.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Name and size of the file hammered by the load generator */
+#define LOAD_FILE "loadgen.dat"
+#define LOAD_FILE_SIZE (256 * 1024)
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX || ret <= 0)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t ops = 10000, depth = 16, iosize = 4096, readPct = 80;
+	struct fsc_result res;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <socket path> [ops] [depth] [iosize]"
+			" [read%%]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		ops = get_argv(argv[2]);
+	if (argc > 3)
+		depth = get_argv(argv[3]);
+	if (argc > 4)
+		iosize = get_argv(argv[4]);
+	if (argc > 5)
+		readPct = get_argv(argv[5]);
+	if (iosize > LOAD_FILE_SIZE)
+		die("iosize cannot exceed %d bytes", LOAD_FILE_SIZE);
+
+	struct fs_client *c = fsc_connect(argv[1]);
+	if (!c)
+		die("Cannot connect to %s", argv[1]);
+
+	// Lay out the working file with synchronous calls
+	fsc_delete(c, LOAD_FILE);
+	if (fsc_create(c, LOAD_FILE))
+		die("Cannot create file");
+	int fd = fsc_open(c, LOAD_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+	char *buf = malloc(LOAD_FILE_SIZE);
+	memset(buf, 'x', LOAD_FILE_SIZE);
+	for (size_t off = 0; off < LOAD_FILE_SIZE; off += iosize) {
+		if (fsc_write(c, fd, buf, iosize) != iosize)
+			die("Disk too small for %d bytes", LOAD_FILE_SIZE);
+	}
+
+	double *lat = malloc(ops * sizeof(double));
+	double *sent = malloc(depth * sizeof(double));
+	size_t submitted = 0, completed = 0, bytes = 0;
+	unsigned int seed = 1;
+	double start = now_us();
+
+	// Every operation is an lseek+read or lseek+write pair, kept in order
+	while (completed < ops) {
+		while (submitted < ops && submitted - completed < depth) {
+			size_t nblk = (LOAD_FILE_SIZE - iosize) / 4096 + 1;
+			size_t off = (rand_r(&seed) % nblk) * 4096;
+			fsc_submit(c, FSP_LSEEK, fd, off, NULL, 0);
+			if (rand_r(&seed) % 100 < readPct)
+				fsc_submit(c, FSP_READ, fd, iosize, NULL, 0);
+			else
+				fsc_submit(c, FSP_WRITE, fd, 0, buf, iosize);
+			sent[submitted % depth] = now_us();
+			submitted++;
+		}
+		if (fsc_flush(c))
+			die("Connection lost");
+
+		if (fsc_reap(c, &res, NULL, 0) || res.ret != 0)
+			die("lseek failed");
+		if (fsc_reap(c, &res, buf, iosize) || res.ret != iosize)
+			die("I/O failed");
+		lat[completed] = now_us() - sent[completed % depth];
+		bytes += iosize;
+		completed++;
+	}
+
+	double elapsed = (now_us() - start) / 1e6;
+	qsort(lat, ops, sizeof(double), cmp_double);
+
+	printf("ops=%zu depth=%zu iosize=%zu read%%=%zu\n",
+	       ops, depth, iosize, readPct);
+	printf("throughput: %.0f ops/s, %.2f MiB/s\n",
+	       ops / elapsed, bytes / elapsed / (1024 * 1024));
+	printf("latency(us): p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+	       lat[ops / 2], lat[ops * 9 / 10], lat[ops * 99 / 100],
+	       lat[ops - 1]);
+
+	fsc_close(c, fd);
+	fsc_delete(c, LOAD_FILE);
+	fsc_disconnect(c);
+	free(lat);
+	free(sent);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,324 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Number of operations, enum fs_trace_op starts at 1 */
+#define OPS (FS_TR_GROW + 1)
+
+static const char *opNames[OPS] = {
+	[FS_TR_MOUNT] = "mount", [FS_TR_UMOUNT] = "umount",
+	[FS_TR_SYNC] = "sync", [FS_TR_INFO] = "info",
+	[FS_TR_STATFS] = "statfs", [FS_TR_CREATE] = "create",
+	[FS_TR_DELETE] = "delete", [FS_TR_LS] = "ls",
+	[FS_TR_READDIR] = "readdir", [FS_TR_STAT_NAME] = "stat_name",
+	[FS_TR_OPEN] = "open", [FS_TR_CLOSE] = "close",
+	[FS_TR_STAT] = "stat", [FS_TR_LSEEK] = "lseek",
+	[FS_TR_TRUNCATE] = "truncate", [FS_TR_READ] = "read",
+	[FS_TR_READV] = "readv", [FS_TR_PREAD] = "pread",
+	[FS_TR_WRITE] = "write", [FS_TR_WRITEV] = "writev",
+	[FS_TR_PWRITE] = "pwrite", [FS_TR_MAP] = "map",
+	[FS_TR_UNMAP] = "unmap", [FS_TR_SNAP_CREATE] = "snap_create",
+	[FS_TR_SNAP_DELETE] = "snap_delete", [FS_TR_SNAP_LS] = "snap_ls",
+	[FS_TR_MOUNT_SNAP] = "mount_snap", [FS_TR_CSUM_ENABLE] = "csum_enable",
+	[FS_TR_CSUM_POLICY] = "csum_policy", [FS_TR_GROW] = "grow",
+};
+
+/* Record of the trace, with its name as a string */
+struct rec {
+	struct fs_trace_rec r;
+	char name[UCHAR_MAX + 1];
+};
+
+/* Latencies of one operation, in nanoseconds */
+struct lat {
+	double *ns;
+	size_t n, cap;
+};
+
+/* Descriptors of the trace and of the replay, for open files */
+static struct { int rec, cur; } fds[FS_OPEN_MAX_COUNT];
+static int numFds;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, double ns)
+{
+	if (l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 1024;
+		l->ns = realloc(l->ns, l->cap * sizeof(*l->ns));
+	}
+	l->ns[l->n++] = ns;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* p-th percentile of sorted latencies l, in microseconds */
+static double pct(const struct lat *l, double p)
+{
+	size_t i = p * (l->n - 1) / 100;
+	return l->ns[i] / 1000;
+}
+
+/* descriptor of the replay for descriptor fd of the trace, -1 if none */
+static int fd_cur(int fd)
+{
+	for (int i = 0; i < numFds; i++) {
+		if (fds[i].rec == fd)
+			return fds[i].cur;
+	}
+	return -1;
+}
+
+static void fd_forget(int fd)
+{
+	for (int i = 0; i < numFds; i++) {
+		if (fds[i].rec == fd)
+			fds[i] = fds[--numFds];
+	}
+}
+
+/* read the records of trace path, returns their number */
+static size_t trace_load(const char *path, struct rec **out)
+{
+	FILE *f = fopen(path, "rb");
+	char magic[sizeof(FS_TRACE_MAGIC) - 1];
+	if (!f)
+		die("Cannot open trace %s", path);
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, FS_TRACE_MAGIC, sizeof(magic)))
+		die("%s is not a trace", path);
+
+	struct rec *recs = NULL;
+	size_t n = 0, cap = 0;
+	struct fs_trace_rec r;
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (n == cap) {
+			cap = cap ? 2 * cap : 4096;
+			recs = realloc(recs, cap * sizeof(*recs));
+		}
+		recs[n].r = r;
+		if (r.name_len && fread(recs[n].name, r.name_len, 1, f) != 1)
+			break; // truncated
+		recs[n].name[r.name_len] = '\0';
+		if (r.op == 0 || r.op >= OPS)
+			die("Invalid operation in record %zu", n);
+		n++;
+	}
+	fclose(f);
+
+	*out = recs;
+	return n;
+}
+
+/* run record r on diskname, returns what the call returned, or INT_MIN if skipped */
+static int replay(const struct fs_trace_rec *r, const char *name,
+		  const char *diskname, char *buf)
+{
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+	struct fs_statfs st;
+	struct fs_map map;
+	struct iovec iov[UCHAR_MAX];
+	int fd = fd_cur(r->fd);
+	int ret;
+
+	switch (r->op) {
+	case FS_TR_MOUNT:
+		return fs_mount_flags(diskname, r->arg);
+	case FS_TR_UMOUNT:
+		return fs_umount();
+	case FS_TR_SYNC:
+		return fs_sync();
+	case FS_TR_STATFS:
+		return fs_statfs(&st);
+	case FS_TR_CREATE:
+		return fs_create_flags(name, r->arg);
+	case FS_TR_DELETE:
+		return fs_delete(name);
+	case FS_TR_READDIR:
+		return fs_readdir(ents, r->arg < FS_FILE_MAX_COUNT ? r->arg
+							   : FS_FILE_MAX_COUNT);
+	case FS_TR_STAT_NAME:
+		return fs_stat_name(name, NULL);
+	case FS_TR_OPEN:
+		ret = fs_open_flags(name, r->arg);
+		if (ret >= 0 && r->ret >= 0 && numFds < FS_OPEN_MAX_COUNT) {
+			fds[numFds].rec = r->ret;
+			fds[numFds++].cur = ret;
+		}
+		return ret;
+	case FS_TR_CLOSE:
+		fd_forget(r->fd);
+		return fs_close(fd);
+	case FS_TR_STAT:
+		return fs_stat(fd);
+	case FS_TR_LSEEK:
+		return fs_lseek(fd, r->offset);
+	case FS_TR_TRUNCATE:
+		return fs_truncate(fd, r->size);
+	case FS_TR_READ:
+		return fs_read(fd, buf, r->size);
+	case FS_TR_PREAD:
+		return fs_pread(fd, buf, r->size, r->offset);
+	case FS_TR_WRITE:
+		return fs_write(fd, buf, r->size);
+	case FS_TR_PWRITE:
+		return fs_pwrite(fd, buf, r->size, r->offset);
+	case FS_TR_READV:
+	case FS_TR_WRITEV:
+		// Same total, cut in as many equal pieces
+		for (int i = 0; i < r->arg && i < UCHAR_MAX; i++) {
+			size_t piece = r->size / r->arg;
+			iov[i].iov_base = buf + i * piece;
+			iov[i].iov_len = i == r->arg - 1 ? r->size - i * piece : piece;
+		}
+		if (r->op == FS_TR_READV)
+			return fs_readv(fd, iov, r->arg < UCHAR_MAX ? r->arg : 0);
+		return fs_writev(fd, iov, r->arg < UCHAR_MAX ? r->arg : 0);
+	case FS_TR_MAP:
+		// Released right away, the unmap record is skipped
+		ret = fs_map(fd, r->offset, r->size, &map);
+		if (ret == 0)
+			fs_unmap(&map);
+		return ret;
+	case FS_TR_SNAP_CREATE:
+		return fs_snapshot_create(name);
+	case FS_TR_SNAP_DELETE:
+		return fs_snapshot_delete(name);
+	case FS_TR_MOUNT_SNAP:
+		return fs_mount_snapshot(diskname, name);
+	case FS_TR_CSUM_ENABLE:
+		return fs_csum_enable();
+	case FS_TR_CSUM_POLICY:
+		return fs_csum_policy(r->arg);
+	case FS_TR_GROW:
+		return fs_grow(r->size);
+	}
+
+	// Listings only print, unmap was done with map
+	return INT_MIN;
+}
+
+int main(int argc, char **argv)
+{
+	struct lat lat[OPS] = { 0 }, recLat[OPS] = { 0 };
+	size_t skipped = 0, mismatches = 0, rd = 0, wr = 0;
+	int timed = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <trace> <diskname> [fast|timed]\n",
+			argv[0]);
+		exit(1);
+	}
+	if (argc > 3 && !strcmp(argv[3], "timed"))
+		timed = 1; // at the pace of the trace
+	else if (argc > 3 && strcmp(argv[3], "fast"))
+		die("invalid mode '%s'", argv[3]);
+
+	struct rec *recs;
+	size_t n = trace_load(argv[1], &recs);
+	size_t maxSize = 1;
+	for (size_t i = 0; i < n; i++) {
+		if (recs[i].r.size > maxSize)
+			maxSize = recs[i].r.size;
+	}
+
+	// Data written is random, what the trace wrote is not recorded
+	char *buf = malloc(maxSize);
+	for (size_t i = 0; i < maxSize; i++)
+		buf[i] = rand();
+
+	// Traces started after the mount need one
+	int mounted = 0;
+	if (n && recs[0].r.op != FS_TR_MOUNT && recs[0].r.op != FS_TR_MOUNT_SNAP) {
+		if (fs_mount(argv[2]))
+			die("Cannot mount %s", argv[2]);
+		mounted = 1;
+	}
+
+	double start = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		const struct fs_trace_rec *r = &recs[i].r;
+		if (timed) {
+			double wait = start + r->start_ns - now_ns();
+			struct timespec ts = { wait / 1e9, (long)wait % 1000000000 };
+			if (wait > 0)
+				nanosleep(&ts, NULL);
+		}
+
+		double t = now_ns();
+		int ret = replay(r, recs[i].name, argv[2], buf);
+		t = now_ns() - t;
+		if (ret == INT_MIN) {
+			skipped++;
+			continue;
+		}
+
+		lat_add(&lat[r->op], t);
+		lat_add(&recLat[r->op], r->dur_ns);
+		if (r->op == FS_TR_OPEN ? (ret < 0) != (r->ret < 0) : ret != r->ret)
+			mismatches++;
+		if (ret > 0 && (r->op == FS_TR_READ || r->op == FS_TR_READV ||
+				r->op == FS_TR_PREAD))
+			rd += ret;
+		if (ret > 0 && (r->op == FS_TR_WRITE || r->op == FS_TR_WRITEV ||
+				r->op == FS_TR_PWRITE))
+			wr += ret;
+		if (r->op == FS_TR_MOUNT || r->op == FS_TR_MOUNT_SNAP)
+			mounted = ret == 0;
+		else if (r->op == FS_TR_UMOUNT && ret == 0)
+			mounted = 0;
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	// Files left open by the trace
+	for (int i = 0; i < numFds; i++)
+		fs_close(fds[i].cur);
+	if (mounted && fs_umount())
+		die("Cannot unmount %s", argv[2]);
+
+	printf("ops=%zu skipped=%zu mismatches=%zu elapsed=%.3fs (%.0f ops/s)\n",
+	       n - skipped, skipped, mismatches, elapsed,
+	       (n - skipped) / elapsed);
+	printf("read=%.1fMiB write=%.1fMiB throughput=%.1f MiB/s\n",
+	       rd / 1048576.0, wr / 1048576.0, (rd + wr) / 1048576.0 / elapsed);
+	printf("%-12s %8s %9s %9s %9s %9s | recorded %9s %9s\n", "op", "count",
+	       "p50us", "p90us", "p99us", "maxus", "p50us", "p99us");
+	for (int op = 1; op < OPS; op++) {
+		if (!lat[op].n)
+			continue;
+		qsort(lat[op].ns, lat[op].n, sizeof(double), cmp_double);
+		qsort(recLat[op].ns, recLat[op].n, sizeof(double), cmp_double);
+		printf("%-12s %8zu %9.1f %9.1f %9.1f %9.1f |          %9.1f %9.1f\n",
+		       opNames[op], lat[op].n, pct(&lat[op], 50), pct(&lat[op], 90),
+		       pct(&lat[op], 99), pct(&lat[op], 100),
+		       pct(&recLat[op], 50), pct(&recLat[op], 99));
+		free(lat[op].ns);
+		free(recLat[op].ns);
+	}
+
+	free(buf);
+	free(recs);
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of the reads of the workload */
+#define IO_SIZE 4096
+
+/* Most files of each kind, all open at once while populating */
+#define FILES_MAX (FS_OPEN_MAX_COUNT / 2)
+
+static size_t numFiles = 16, fileSize = 1024 * 1024, rounds = 3;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX || ret <= 0)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+/* drop the pages of the image from the page cache, as after a reboot */
+static void evict(const char *image)
+{
+	int fd = open(image, O_RDONLY);
+	if (fd < 0 || fdatasync(fd) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+		die("Cannot evict %s", image);
+	close(fd);
+}
+
+/* hot files h0, h1... interleaved with as many cold ones c0, c1... */
+static void populate(const char *image)
+{
+	char name[FS_FILENAME_LEN], *buf = malloc(IO_SIZE);
+	int fds[2 * FILES_MAX];
+
+	if (fs_mount(image))
+		die("Cannot mount %s", image);
+	for (size_t i = 0; i < 2 * numFiles; i++) {
+		snprintf(name, sizeof(name), "%c%zu", i % 2 ? 'c' : 'h', i / 2);
+		fs_delete(name);
+		if (fs_create(name) || (fds[i] = fs_open(name)) < 0)
+			die("Cannot create %s", name);
+	}
+	for (size_t off = 0; off < fileSize; off += IO_SIZE) {
+		for (size_t i = 0; i < 2 * numFiles; i++) {
+			memset(buf, i + off / IO_SIZE, IO_SIZE);
+			if (fs_write(fds[i], buf, IO_SIZE) != IO_SIZE)
+				die("Disk too small");
+		}
+	}
+	for (size_t i = 0; i < 2 * numFiles; i++)
+		fs_close(fds[i]);
+	if (fs_umount())
+		die("Cannot unmount %s", image);
+	free(buf);
+}
+
+/* read every hot file once, IO_SIZE at a time in a scattered order */
+static double workload(void)
+{
+	char name[FS_FILENAME_LEN], *buf = malloc(IO_SIZE);
+	int fds[FILES_MAX];
+	size_t pieces = fileSize / IO_SIZE, n = numFiles * pieces;
+
+	for (size_t i = 0; i < numFiles; i++) {
+		snprintf(name, sizeof(name), "h%zu", i);
+		if ((fds[i] = fs_open(name)) < 0)
+			die("Cannot open %s", name);
+	}
+	double start = now_ms();
+	for (size_t k = 0; k < n; k++) {
+		size_t j = k * 7919 % n; // 7919 is prime, and n is not a multiple
+		size_t f = j % numFiles, off = j / numFiles * IO_SIZE;
+		if (fs_pread(fds[f], buf, IO_SIZE, off) != IO_SIZE)
+			die("Read failed");
+		if (buf[0] != (char)(2 * f + off / IO_SIZE))
+			die("Wrong content in h%zu at %zu", f, off);
+	}
+	double t = now_ms() - start;
+	for (size_t i = 0; i < numFiles; i++)
+		fs_close(fds[i]);
+	free(buf);
+	return t;
+}
+
+/* a restart: cold caches, then rounds of the workload */
+static void restart(const char *image, int flags, const char *label)
+{
+	evict(image);
+	double start = now_ms();
+	if (fs_mount_flags(image, flags))
+		die("Cannot mount %s", image);
+	printf("%s:", label);
+	for (size_t r = 0; r < rounds; r++)
+		printf(" %.1fms", workload());
+
+	struct fs_warm_stats st;
+	if (flags & FS_MOUNT_WARM) {
+		do
+			fs_warm_stats(&st);
+		while (!st.done);
+		printf(" (warm-up: %u blocks in %u reads, %.1fms)", st.read,
+		       st.reads, st.ns / 1e6);
+	}
+	printf(" total %.1fms\n", now_ms() - start);
+	if (fs_umount())
+		die("Cannot unmount %s", image);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <image> [files] [KiB per file] [rounds]\n",
+			argv[0]);
+		exit(1);
+	}
+	const char *image = argv[1];
+	if (argc > 2)
+		numFiles = get_argv(argv[2]);
+	if (argc > 3)
+		fileSize = get_argv(argv[3]) * 1024;
+	if (argc > 4)
+		rounds = get_argv(argv[4]);
+	if (numFiles > FILES_MAX || fileSize % IO_SIZE ||
+	    numFiles * (fileSize / IO_SIZE) % 7919 == 0)
+		die("invalid workload");
+
+	// A first run records the hot files in the sidecar
+	populate(image);
+	char sidecar[PATH_MAX];
+	snprintf(sidecar, sizeof(sidecar), "%s.warm", image);
+	unlink(sidecar);
+	if (fs_mount_flags(image, FS_MOUNT_WARM))
+		die("Cannot mount %s", image);
+	workload();
+	if (fs_umount())
+		die("Cannot unmount %s", image);
+
+	printf("files=%zu size=%zuKiB rounds=%zu\n", numFiles, fileSize / 1024,
+	       rounds);
+	restart(image, 0, "cold");
+	restart(image, FS_MOUNT_WARM, "warm");
+
+	return 0;
+}
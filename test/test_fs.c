@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -33,6 +34,17 @@ struct thread_arg {
 	char **argv;
 };
 
+/* FS_MOUNT_RDONLY with -r, for the commands that only read */
+static int mount_flags;
+
+/* mount for a command that only reads: read-write unless -r was given */
+static int mount_disk(const char *diskname)
+{
+	if (mount_flags)
+		return fs_mount_flags(diskname, mount_flags);
+	return fs_mount(diskname);
+}
+
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -46,7 +58,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -91,7 +103,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -134,6 +146,58 @@ void thread_fs_cat(void *arg)
 	free(buf);
 }
 
+void thread_fs_map(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	struct fs_map map;
+	int fs_fd;
+	int stat;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	/* Printed in place, the mapping goes away with the file system */
+	if (fs_map(fs_fd, 0, stat, &map)) {
+		fs_umount();
+		die("Cannot map file");
+	}
+	printf("Mapped file '%s' (%zu/%d bytes, %d segments)\n", filename,
+	       map.len, stat, map.nsegs);
+	printf("Content of the file:\n");
+	if (map.addr)
+		printf("%.*s", (int)map.len, (const char *)map.addr);
+	for (int i = 0; !map.addr && i < map.nsegs; i++)
+		printf("%.*s", (int)map.segs[i].len, (const char *)map.segs[i].addr);
+	fs_unmap(&map);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+}
+
 void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -159,7 +223,45 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_add(void *arg)
+void thread_fs_truncate(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	long length;
+	int fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <length>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	length = strtol(t_arg->argv[2], NULL, 0);
+	if (length < 0)
+		die("Invalid length");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_truncate(fd, length)) {
+		fs_close(fd);
+		fs_umount();
+		die("Cannot truncate file");
+	}
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Truncated file '%s' to %ld bytes\n", filename, length);
+}
+
+void fs_add(void *arg, int flags)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
@@ -194,7 +296,7 @@ void thread_fs_add(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
+	if (fs_create_flags(filename, flags)) {
 		fs_umount();
 		die("Cannot create file");
 	}
@@ -222,6 +324,137 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_add(void *arg)
+{
+	fs_add(arg, 0);
+}
+
+void thread_fs_addz(void *arg)
+{
+	fs_add(arg, FS_CREATE_COMPRESSED);
+}
+
+void thread_fs_addd(void *arg)
+{
+	fs_add(arg, FS_CREATE_DEDUP);
+}
+
+void thread_fs_addp(void *arg)
+{
+	fs_add(arg, FS_CREATE_PACKED);
+}
+
+void thread_fs_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int fd, fs_fd;
+	struct stat st;
+	int written;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!buf)
+		die_perror("mmap");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* The file is created if needed, the host file goes at its end */
+	if (fs_stat_name(filename, NULL) < 0 && fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	fs_fd = fs_open_flags(filename, FS_OPEN_APPEND);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	written = fs_write(fs_fd, buf, st.st_size);
+	int size = fs_stat(fs_fd);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Appended to file '%s' (%d/%zu bytes, size %d)\n", filename,
+	       written, st.st_size, size);
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dedup_stats st;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_dedup_stats(&st)) {
+		fs_umount();
+		die("Cannot get dedup stats");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("logical_blk=%u\n", st.logical_blocks);
+	printf("physical_blk=%u\n", st.physical_blocks);
+	printf("dedup_ratio=%.2f\n", st.physical_blocks ?
+	       (double)st.logical_blocks / st.physical_blocks : 1.0);
+}
+
+void thread_fs_csum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_csum_enable()) {
+		fs_umount();
+		die("Cannot enable checksums");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled checksums on '%s'\n", diskname);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -232,7 +465,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -241,6 +474,37 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent ents[FS_FILE_MAX_COUNT];
+	struct fs_statfs st;
+	char *diskname;
+	int n;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	n = fs_readdir(ents, FS_FILE_MAX_COUNT);
+	if (n < 0 || fs_statfs(&st)) {
+		fs_umount();
+		die("Cannot read directory");
+	}
+	for (int i = 0; i < n; i++)
+		printf("%-16s %10u bytes %6u blocks (first %u)\n", ents[i].name,
+		       ents[i].size, ents[i].blocks, ents[i].first_blk);
+	printf("%u files, %u/%u blocks free\n", st.files, st.free_blocks,
+	       st.data_blocks);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -251,7 +515,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -260,6 +524,113 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_snap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *snapname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	snapname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_create(snapname)) {
+		fs_umount();
+		die("Cannot create snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created snapshot '%s'\n", snapname);
+}
+
+void thread_fs_snaprm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *snapname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	snapname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(snapname)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed snapshot '%s'\n", snapname);
+}
+
+void thread_fs_snapls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_snapshot_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snapcat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *snapname, *filename, *buf;
+	int fs_fd;
+	int stat, read;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <snapshot name> <filename>");
+
+	diskname = t_arg->argv[0];
+	snapname = t_arg->argv[1];
+	filename = t_arg->argv[2];
+
+	if (fs_mount_snapshot(diskname, snapname))
+		die("Cannot mount snapshot");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	buf = malloc(stat + 1);
+	read = fs_read(fs_fd, buf, stat);
+
+	if (fs_close(fs_fd) || fs_umount())
+		die("Cannot close snapshot");
+
+	printf("Read file '%s@%s' (%d/%d bytes)\n", filename, snapname, read,
+	       stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	free(buf);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -268,25 +639,162 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_stripe(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *data;
+	char spec[4096];
+	size_t unit, sunit, count, round, len;
+	int i, n, fd;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <unit> <member>...");
+
+	diskname = t_arg->argv[0];
+	unit = get_argv(t_arg->argv[1]);
+	n = t_arg->argc - 2;
+	if (unit == 0)
+		die("invalid stripe unit");
+
+	/* Whole image in memory, then dealt to the members by sector */
+	if (block_disk_open(diskname) || block_disk_block_size(BLOCK_SIZE_MIN))
+		die("Cannot open diskname");
+	count = block_disk_count();
+	data = malloc(count * BLOCK_SIZE_MIN);
+	if (!data || block_read_n(0, count, data))
+		die("Cannot read diskname");
+	block_disk_close();
+
+	/* Each member gets one unit per round, the last round may be partial */
+	sunit = unit * (BLOCK_SIZE / BLOCK_SIZE_MIN);
+	round = n * sunit;
+	len = snprintf(spec, sizeof(spec), "stripe:%zu:", unit);
+	for (i = 0; i < n; i++) {
+		size_t rem = count % round;
+		size_t extra = rem > i * sunit ? rem - i * sunit : 0;
+		size_t share = count / round * sunit + (extra < sunit ? extra : sunit);
+
+		fd = open(t_arg->argv[2 + i], O_CREAT | O_TRUNC | O_WRONLY, 0644);
+		if (fd < 0 || ftruncate(fd, share * BLOCK_SIZE_MIN))
+			die_perror(t_arg->argv[2 + i]);
+		close(fd);
+		len += snprintf(spec + len, sizeof(spec) - len, "%s%s",
+				i ? "+" : "", t_arg->argv[2 + i]);
+	}
+	if (len >= sizeof(spec))
+		die("member names too long");
+
+	if (block_disk_open(spec) || block_disk_block_size(BLOCK_SIZE_MIN) ||
+	    block_disk_count() != count || block_write_n(0, count, data))
+		die("Cannot write members");
+	block_disk_close();
+	free(data);
+
+	printf("Striped '%s' over %d images, mount '%s'\n", diskname, n, spec);
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t data, bsize = BLOCK_SIZE, fat, rdir;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <data blocks> [<block size>]");
+
+	diskname = t_arg->argv[0];
+	data = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		bsize = get_argv(t_arg->argv[2]);
+	if (data == 0 || bsize == 0)
+		die("invalid size");
+
+	/* Superblock, FAT (an entry per data block), root directory, data */
+	fat = (data * 2 + bsize - 1) / bsize;
+	rdir = (FS_FILE_MAX_COUNT * 32 + bsize - 1) / bsize;
+	fd = open(diskname, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0 || ftruncate(fd, (1 + fat + rdir + data) * bsize))
+		die_perror(diskname);
+	close(fd);
+
+	if (fs_format(diskname, bsize))
+		die("Cannot format diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks of %zu bytes\n",
+	       diskname, data, bsize);
+}
+
+void thread_fs_grow(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct fs_statfs st;
+	size_t data, before;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <data blocks>");
+
+	diskname = t_arg->argv[0];
+	data = get_argv(t_arg->argv[1]);
+	if (data == 0)
+		die("invalid size");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_statfs(&st);
+	before = st.data_blocks;
+
+	if (fs_grow(data)) {
+		fs_umount();
+		die("Cannot grow diskname");
+	}
+	fs_statfs(&st);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Grew virtual disk '%s' from %zu to %u data blocks (%u FAT blocks)\n",
+	       diskname, before, st.data_blocks, st.fat_blocks);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
+	int rdonly; /* may mount read-only */
 } commands[] = {
-	{ "info",	thread_fs_info },
-	{ "ls",		thread_fs_ls },
+	{ "info",	thread_fs_info, 1 },
+	{ "ls",		thread_fs_ls, 1 },
+	{ "dir",	thread_fs_dir, 1 },
 	{ "add",	thread_fs_add },
+	{ "addz",	thread_fs_addz },
+	{ "addd",	thread_fs_addd },
+	{ "addp",	thread_fs_addp },
+	{ "append",	thread_fs_append },
+	{ "dedup",	thread_fs_dedup },
+	{ "csum",	thread_fs_csum },
 	{ "rm",		thread_fs_rm },
-	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat },
+	{ "truncate",	thread_fs_truncate },
+	{ "cat",	thread_fs_cat, 1 },
+	{ "map",	thread_fs_map, 1 },
+	{ "stat",	thread_fs_stat, 1 },
+	{ "snap",	thread_fs_snap },
+	{ "snaprm",	thread_fs_snaprm },
+	{ "snapls",	thread_fs_snapls },
+	{ "snapcat",	thread_fs_snapcat },
+	{ "stripe",	thread_fs_stripe },
+	{ "format",	thread_fs_format },
+	{ "grow",	thread_fs_grow },
 };
 
 void usage(char *program)
 {
 	int i;
-	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
-	fprintf(stderr, "Possible commands are:\n");
+	fprintf(stderr, "Usage: %s [-r] <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are (* also read-only with -r):\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
-		fprintf(stderr, "\t%s\n", commands[i].name);
+		fprintf(stderr, "\t%s%s\n", commands[i].name,
+			commands[i].rdonly ? " *" : "");
 	exit(1);
 }
 
@@ -306,12 +814,22 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 
+	if (!strcmp(argv[0], "-r")) {
+		mount_flags = FS_MOUNT_RDONLY;
+		argc--;
+		argv++;
+		if (argc == 0)
+			usage(program);
+	}
+
 	cmd = argv[0];
 	arg.argc = --argc;
 	arg.argv = &argv[1];
 
 	for (i = 0; i < ARRAY_SIZE(commands); i++) {
 		if (!strcmp(cmd, commands[i].name)) {
+			if (mount_flags && !commands[i].rdonly)
+				die("'%s' cannot mount read-only", cmd);
 			commands[i].func(&arg);
 			break;
 		}